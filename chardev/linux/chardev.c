@@ -19,10 +19,20 @@
 #include <linux/device.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/version.h>
 
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
 
+#include "chardev.h"
+
 /* forward declarations */
 static int chardev_open(struct inode* inodep, struct file* filep);
 static int chardev_release(struct inode* inodep, struct file* filep);
@@ -30,6 +40,12 @@ static ssize_t chardev_read(struct file* filep, char* __user u_buffer,
         size_t len, loff_t* offset);
 static ssize_t chardev_write(struct file* filep, const char* __user u_buffer,
         size_t len, loff_t* offset);
+static loff_t chardev_llseek(struct file* filep, loff_t offset, int whence);
+static long chardev_ioctl(struct file* filep, unsigned int cmd,
+        unsigned long arg);
+static int chardev_mmap(struct file* filep, struct vm_area_struct* vma);
+static ssize_t chardev_pool_show(struct device* dev,
+        struct device_attribute* attr, char* buf);
 
 /**
  * \brief Class name.
@@ -57,25 +73,193 @@ static dev_t chardev_dev = MKDEV(0, 0);
 static struct cdev chardev_cdev;
 
 /**
- * \brief Message in kernel side for the device.
+ * \enum chardev_mode
+ * \brief Sharing mode of the device.
+ */
+enum chardev_mode
+{
+    /**
+     * \brief One opener at a time, buffer updated in place.
+     */
+    CHARDEV_MODE_EXCLUSIVE,
+
+    /**
+     * \brief Any number of openers, writers publish snapshots with RCU.
+     */
+    CHARDEV_MODE_RCU,
+
+    /**
+     * \brief Any number of openers, each open file has its own buffer.
+     */
+    CHARDEV_MODE_PRIVATE,
+};
+
+/**
+ * \def CHARDEV_POOL_MAX
+ * \brief Maximum number of recycled pages kept per CPU.
+ */
+#define CHARDEV_POOL_MAX 64
+
+/**
+ * \struct chardev_page_pool
+ * \brief Per-CPU pool of recycled pages.
+ */
+struct chardev_page_pool
+{
+    /**
+     * \brief Number of pages in the pool.
+     */
+    unsigned int count;
+
+    /**
+     * \brief Pages in the pool.
+     */
+    struct page* pages[CHARDEV_POOL_MAX];
+
+    /**
+     * \brief Allocations served by the pool.
+     */
+    unsigned long hits;
+
+    /**
+     * \brief Allocations that went to the page allocator.
+     */
+    unsigned long misses;
+
+    /**
+     * \brief Pages given back to the pool.
+     */
+    unsigned long recycled;
+};
+
+/**
+ * \struct chardev_buffer
+ * \brief Content of the device.
+ *
+ * In RCU mode a buffer is an immutable snapshot: a writer builds a new buffer
+ * that shares the pages it does not modify with the previous one, publishes
+ * it and the old one is freed once the last reader has dropped it and a grace
+ * period has elapsed.
+ */
+struct chardev_buffer
+{
+    /**
+     * \brief References from the device and the open files.
+     */
+    struct kref refcount;
+
+    /**
+     * \brief Deferred release.
+     */
+    struct rcu_head rcu;
+
+    /**
+     * \brief Protect size and pages installation, taken by page faults.
+     */
+    spinlock_t lock;
+
+    /**
+     * \brief Size of the data stored.
+     */
+    size_t size;
+
+    /**
+     * \brief Pages of the data, NULL if not yet allocated (reads as zeros).
+     */
+    struct page* pages[];
+};
+
+/**
+ * \struct chardev_file
+ * \brief State of an open file.
+ */
+struct chardev_file
+{
+    /**
+     * \brief Serialize threads that share the same file.
+     */
+    struct mutex lock;
+
+    /**
+     * \brief Buffer (snapshot in RCU mode) the file reads from.
+     */
+    struct chardev_buffer* buffer;
+
+    /**
+     * \brief Mappings of the buffer in private mode.
+     *
+     * Openers of the device share the address_space of its inode, so a
+     * private buffer gets its own one: zapping the mappings of a buffer must
+     * not touch the buffers of other files.
+     */
+    struct address_space mapping;
+};
+
+/**
+ * \brief Maximum size of the data in kernel side (configuration parameter).
+ *
+ * Pages are allocated only when written to.
+ */
+static unsigned long max_size = 1024 * 1024;
+
+/**
+ * \brief Sharing mode (configuration parameter).
+ *
+ * "exclusive" (default), "rcu" or "private".
+ */
+static char* mode = "exclusive";
+
+/**
+ * \brief Sharing mode parsed from mode parameter.
  */
-static char g_message[1024] = {0};
+static enum chardev_mode g_mode = CHARDEV_MODE_EXCLUSIVE;
 
 /**
- * \brief Size of g_message stored in kernel side.
+ * \brief Current content of the device.
  */
-static size_t g_message_size = 0;
+static struct chardev_buffer __rcu* g_buffer = NULL;
+
+/**
+ * \brief Number of pages of a buffer.
+ */
+static size_t g_nr_pages = 0;
+
+/**
+ * \brief Number of recycled pages kept per CPU (configuration parameter).
+ */
+static unsigned int pool_size = 16;
+
+/**
+ * \brief Recycled pages.
+ */
+static DEFINE_PER_CPU(struct chardev_page_pool, g_page_pool);
+
+/**
+ * \brief Cache for the open files state.
+ */
+static struct kmem_cache* g_file_cache = NULL;
+
+/**
+ * \brief Cache for the buffers.
+ */
+static struct kmem_cache* g_buffer_cache = NULL;
 
 /**
  * \brief Number of times device is opened.
  */
-static size_t g_number_open = 0;
+static atomic_t g_number_open = ATOMIC_INIT(0);
 
 /**
- * \brief Mutex to have only one process to open and use device.
+ * \brief Mutex to have only one process to open and use device (exclusive
+ * mode).
  */
 static DEFINE_MUTEX(mutex_chardev);
 
+/**
+ * \brief Mutex to serialize writers publishing a new buffer (RCU mode).
+ */
+static DEFINE_MUTEX(mutex_publish);
+
 /**
  * \brief File operations.
  */
@@ -85,8 +269,520 @@ static struct file_operations fops = {
     .release = chardev_release,
     .read = chardev_read,
     .write = chardev_write,
+    .llseek = chardev_llseek,
+    .unlocked_ioctl = chardev_ioctl,
+    .mmap = chardev_mmap,
 };
 
+/**
+ * \brief Allocate a zeroed page, from the pool of this CPU if possible.
+ * \return page, or NULL if out of memory.
+ */
+static struct page* chardev_page_alloc(void)
+{
+    struct chardev_page_pool* pool = NULL;
+    struct page* page = NULL;
+    unsigned long flags = 0;
+
+    /* pages are also released from RCU callbacks */
+    local_irq_save(flags);
+    pool = this_cpu_ptr(&g_page_pool);
+
+    if(pool->count > 0)
+    {
+        page = pool->pages[--pool->count];
+        pool->hits++;
+    }
+    else
+    {
+        pool->misses++;
+    }
+    local_irq_restore(flags);
+
+    if(page)
+    {
+        clear_page(page_address(page));
+        return page;
+    }
+    return alloc_page(GFP_KERNEL | __GFP_ZERO);
+}
+
+/**
+ * \brief Release a page of a buffer, to the pool of this CPU if possible.
+ * \param page page.
+ */
+static void chardev_page_free(struct page* page)
+{
+    struct chardev_page_pool* pool = NULL;
+    unsigned long flags = 0;
+
+    if(page_ref_count(page) != 1)
+    {
+        /* still mapped or shared with another snapshot */
+        put_page(page);
+        return;
+    }
+
+    local_irq_save(flags);
+    pool = this_cpu_ptr(&g_page_pool);
+
+    if(pool->count < min_t(unsigned int, pool_size, CHARDEV_POOL_MAX))
+    {
+        pool->pages[pool->count++] = page;
+        pool->recycled++;
+        page = NULL;
+    }
+    local_irq_restore(flags);
+
+    if(page)
+    {
+        put_page(page);
+    }
+}
+
+/**
+ * \brief Release the pages of all the pools.
+ */
+static void chardev_page_pool_drain(void)
+{
+    int cpu = 0;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct chardev_page_pool* pool = per_cpu_ptr(&g_page_pool, cpu);
+
+        while(pool->count > 0)
+        {
+            put_page(pool->pages[--pool->count]);
+        }
+    }
+}
+
+/**
+ * \brief Allocate an empty buffer.
+ * \return buffer with one reference, or NULL if out of memory.
+ */
+static struct chardev_buffer* chardev_buffer_alloc(void)
+{
+    struct chardev_buffer* buffer = NULL;
+
+    buffer = kmem_cache_zalloc(g_buffer_cache, GFP_KERNEL);
+
+    if(buffer)
+    {
+        kref_init(&buffer->refcount);
+        spin_lock_init(&buffer->lock);
+    }
+    return buffer;
+}
+
+/**
+ * \brief Free a buffer after the RCU grace period.
+ * \param rcu RCU head of the buffer.
+ */
+static void chardev_buffer_free_rcu(struct rcu_head* rcu)
+{
+    struct chardev_buffer* buffer = container_of(rcu, struct chardev_buffer,
+            rcu);
+    size_t i = 0;
+
+    for(i = 0; i < g_nr_pages; i++)
+    {
+        if(buffer->pages[i])
+        {
+            chardev_page_free(buffer->pages[i]);
+        }
+    }
+    kmem_cache_free(g_buffer_cache, buffer);
+}
+
+/**
+ * \brief Release callback when last reference of a buffer is dropped.
+ * \param kref reference counter of the buffer.
+ */
+static void chardev_buffer_release(struct kref* kref)
+{
+    struct chardev_buffer* buffer = container_of(kref, struct chardev_buffer,
+            refcount);
+
+    /* readers may still be looking at it under rcu_read_lock() */
+    call_rcu(&buffer->rcu, chardev_buffer_free_rcu);
+}
+
+/**
+ * \brief Drop a reference on a buffer.
+ * \param buffer buffer.
+ */
+static void chardev_buffer_put(struct chardev_buffer* buffer)
+{
+    kref_put(&buffer->refcount, chardev_buffer_release);
+}
+
+/**
+ * \brief Get a reference on the current content of the device.
+ * \return current buffer.
+ */
+static struct chardev_buffer* chardev_buffer_get_current(void)
+{
+    struct chardev_buffer* buffer = NULL;
+
+    rcu_read_lock();
+    do
+    {
+        /* a zero refcount means it has just been replaced, retry */
+        buffer = rcu_dereference(g_buffer);
+    }
+    while(!kref_get_unless_zero(&buffer->refcount));
+    rcu_read_unlock();
+
+    return buffer;
+}
+
+/**
+ * \brief Make a new buffer sharing all pages with an existing one.
+ * \param old buffer to copy.
+ * \return new buffer with one reference, or NULL if out of memory.
+ */
+static struct chardev_buffer* chardev_buffer_clone(
+        const struct chardev_buffer* old)
+{
+    struct chardev_buffer* buffer = chardev_buffer_alloc();
+    size_t i = 0;
+
+    if(!buffer)
+    {
+        return NULL;
+    }
+
+    for(i = 0; i < g_nr_pages; i++)
+    {
+        /* a page fault may be installing a zeroed page, that's the same */
+        struct page* page = smp_load_acquire(&old->pages[i]);
+
+        if(page)
+        {
+            get_page(page);
+            buffer->pages[i] = page;
+        }
+    }
+    buffer->size = old->size;
+
+    return buffer;
+}
+
+/**
+ * \brief Get a page of a buffer that can be modified.
+ *
+ * Missing pages are allocated zeroed, which does not change the content, so
+ * this is also used by page faults without holding the file lock.
+ * \param buffer buffer.
+ * \param index index of the page.
+ * \param cow page may be shared with another snapshot and has to be copied.
+ * \return page, or NULL if out of memory.
+ */
+static struct page* chardev_buffer_writable_page(
+        struct chardev_buffer* buffer, size_t index, bool cow)
+{
+    struct page* old = smp_load_acquire(&buffer->pages[index]);
+    struct page* page = NULL;
+
+    if(old && !cow)
+    {
+        return old;
+    }
+
+    page = chardev_page_alloc();
+    if(!page)
+    {
+        return NULL;
+    }
+
+    if(old)
+    {
+        copy_page(page_address(page), page_address(old));
+    }
+
+    spin_lock(&buffer->lock);
+
+    if(!old && buffer->pages[index])
+    {
+        /* installed meanwhile by a page fault */
+        spin_unlock(&buffer->lock);
+        chardev_page_free(page);
+        return buffer->pages[index];
+    }
+
+    /* page content has to be visible before lockless readers find it */
+    smp_store_release(&buffer->pages[index], page);
+    spin_unlock(&buffer->lock);
+
+    if(old)
+    {
+        chardev_page_free(old);
+    }
+    return page;
+}
+
+/**
+ * \brief Extend the size of the data of a buffer.
+ * \param buffer buffer.
+ * \param size minimum size.
+ */
+static void chardev_buffer_grow(struct chardev_buffer* buffer, size_t size)
+{
+    spin_lock(&buffer->lock);
+    buffer->size = max(buffer->size, size);
+    spin_unlock(&buffer->lock);
+}
+
+/**
+ * \brief Copy data from a buffer to userspace.
+ * \param buffer buffer.
+ * \param u_buffer userspace buffer to fill.
+ * \param len length to copy.
+ * \param pos position in buffer.
+ * \return 0 if success, negative value otherwise.
+ */
+static int chardev_buffer_read(const struct chardev_buffer* buffer,
+        char* __user u_buffer, size_t len, loff_t pos)
+{
+    while(len > 0)
+    {
+        size_t offset = offset_in_page(pos);
+        size_t chunk = min_t(size_t, len, PAGE_SIZE - offset);
+        struct page* page = smp_load_acquire(&buffer->pages[pos >> PAGE_SHIFT]);
+        unsigned long err = 0;
+
+        if(page)
+        {
+            err = copy_to_user(u_buffer, page_address(page) + offset, chunk);
+        }
+        else
+        {
+            /* hole */
+            err = clear_user(u_buffer, chunk);
+        }
+
+        if(err != 0)
+        {
+            return -EFAULT;
+        }
+
+        u_buffer += chunk;
+        pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * \brief Copy data from userspace to a buffer.
+ * \param buffer buffer.
+ * \param u_buffer userspace buffer that contains data.
+ * \param len length to copy.
+ * \param pos position in buffer.
+ * \param cow pages may be shared with another snapshot.
+ * \return 0 if success, negative value otherwise.
+ */
+static int chardev_buffer_write(struct chardev_buffer* buffer,
+        const char* __user u_buffer, size_t len, loff_t pos, bool cow)
+{
+    while(len > 0)
+    {
+        size_t offset = offset_in_page(pos);
+        size_t chunk = min_t(size_t, len, PAGE_SIZE - offset);
+        struct page* page = chardev_buffer_writable_page(buffer,
+                pos >> PAGE_SHIFT, cow);
+
+        if(!page)
+        {
+            return -ENOMEM;
+        }
+
+        if(copy_from_user(page_address(page) + offset, u_buffer, chunk) != 0)
+        {
+            return -EFAULT;
+        }
+
+        u_buffer += chunk;
+        pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * \brief Resize the data of a buffer.
+ *
+ * Bytes beyond the size are always zero: pages past the new size are
+ * released and the tail of the last page is cleared.
+ * \param buffer buffer.
+ * \param size new size.
+ * \param cow pages may be shared with another snapshot.
+ * \return 0 if success, negative value otherwise.
+ */
+static int chardev_buffer_truncate(struct chardev_buffer* buffer, size_t size,
+        bool cow)
+{
+    size_t index = size >> PAGE_SHIFT;
+    size_t i = 0;
+
+    if(size < READ_ONCE(buffer->size) && offset_in_page(size) != 0 &&
+            READ_ONCE(buffer->pages[index]))
+    {
+        struct page* page = chardev_buffer_writable_page(buffer, index, cow);
+
+        if(!page)
+        {
+            return -ENOMEM;
+        }
+        memset(page_address(page) + offset_in_page(size), 0x00,
+                PAGE_SIZE - offset_in_page(size));
+    }
+
+    spin_lock(&buffer->lock);
+
+    for(i = DIV_ROUND_UP(size, PAGE_SIZE); i < g_nr_pages; i++)
+    {
+        if(buffer->pages[i])
+        {
+            /* still there for existing mappings until they are zapped */
+            chardev_page_free(buffer->pages[i]);
+            WRITE_ONCE(buffer->pages[i], NULL);
+        }
+    }
+
+    buffer->size = size;
+    spin_unlock(&buffer->lock);
+    return 0;
+}
+
+/**
+ * \brief Find next data or hole in a buffer (SEEK_DATA/SEEK_HOLE).
+ * \param buffer buffer.
+ * \param pos position to start from.
+ * \param hole look for a hole instead of data.
+ * \return position found, or negative value otherwise.
+ */
+static loff_t chardev_buffer_seek_data(const struct chardev_buffer* buffer,
+        loff_t pos, bool hole)
+{
+    size_t size = READ_ONCE(buffer->size);
+    size_t i = 0;
+
+    if(pos >= size)
+    {
+        return -ENXIO;
+    }
+
+    for(i = pos >> PAGE_SHIFT; i < DIV_ROUND_UP(size, PAGE_SIZE); i++)
+    {
+        if((READ_ONCE(buffer->pages[i]) == NULL) == hole)
+        {
+            return max_t(loff_t, pos, (loff_t)i << PAGE_SHIFT);
+        }
+    }
+
+    /* there is an implicit hole at the end of the data */
+    return hole ? (loff_t)size : -ENXIO;
+}
+
+/**
+ * \brief Start a modification of the device content (RCU mode).
+ *
+ * Lock the writers out and make a copy of the current buffer, which becomes
+ * visible to readers only with chardev_publish_end().
+ * \return new buffer, or NULL if out of memory.
+ */
+static struct chardev_buffer* chardev_publish_begin(void)
+{
+    struct chardev_buffer* buffer = NULL;
+
+    mutex_lock(&mutex_publish);
+
+    buffer = chardev_buffer_clone(rcu_dereference_protected(g_buffer,
+                lockdep_is_held(&mutex_publish)));
+
+    if(!buffer)
+    {
+        mutex_unlock(&mutex_publish);
+    }
+    return buffer;
+}
+
+/**
+ * \brief Finish a modification of the device content (RCU mode).
+ * \param buffer buffer from chardev_publish_begin().
+ * \param commit publish the buffer, otherwise discard it.
+ */
+static void chardev_publish_end(struct chardev_buffer* buffer, bool commit)
+{
+    struct chardev_buffer* old = buffer;
+
+    if(commit)
+    {
+        old = rcu_dereference_protected(g_buffer,
+                lockdep_is_held(&mutex_publish));
+        rcu_assign_pointer(g_buffer, buffer);
+    }
+
+    mutex_unlock(&mutex_publish);
+
+    /* reference of the device on the old snapshot, or discarded copy */
+    chardev_buffer_put(old);
+}
+
+/**
+ * \brief Make an open file use the latest snapshot (RCU mode).
+ * \param file open file, its lock has to be held.
+ */
+static void chardev_file_refresh(struct chardev_file* file)
+{
+    if(g_mode == CHARDEV_MODE_RCU &&
+            rcu_access_pointer(g_buffer) != file->buffer)
+    {
+        chardev_buffer_put(file->buffer);
+        file->buffer = chardev_buffer_get_current();
+    }
+}
+
+/**
+ * \brief Resize the content of the device.
+ * \param filep file.
+ * \param size new size.
+ * \return 0 if success, negative value otherwise.
+ */
+static int chardev_file_truncate(struct file* filep, size_t size)
+{
+    struct chardev_file* file = filep->private_data;
+    struct chardev_buffer* buffer = NULL;
+    int err = 0;
+
+    if(g_mode == CHARDEV_MODE_RCU)
+    {
+        buffer = chardev_publish_begin();
+
+        if(!buffer)
+        {
+            return -ENOMEM;
+        }
+
+        err = chardev_buffer_truncate(buffer, size, true);
+        chardev_publish_end(buffer, err == 0);
+    }
+    else
+    {
+        mutex_lock(&file->lock);
+        err = chardev_buffer_truncate(file->buffer, size, false);
+        mutex_unlock(&file->lock);
+
+        /* drop the released pages from the mappings of this buffer only,
+         * refault gives zeros */
+        unmap_mapping_range(filep->f_mapping, PAGE_ALIGN(size), 0, 1);
+    }
+    return err;
+}
+
 /**
  * \brief Open callback for character device.
  * \param inodep inode.
@@ -95,13 +791,62 @@ static struct file_operations fops = {
  */
 static int chardev_open(struct inode* inodep, struct file* filep)
 {
-    if(!mutex_trylock(&mutex_chardev))
+    struct chardev_file* file = NULL;
+
+    if(g_mode == CHARDEV_MODE_EXCLUSIVE && !mutex_trylock(&mutex_chardev))
     {
         printk(KERN_ALERT "%s mutex already locked!\n", THIS_MODULE->name);
         return -EBUSY;
     }
-    g_number_open++;
-    printk(KERN_INFO "%s: open (%zu)\n", THIS_MODULE->name, g_number_open);
+
+    file = kmem_cache_alloc(g_file_cache, GFP_KERNEL);
+    if(file)
+    {
+        file->buffer = (g_mode == CHARDEV_MODE_PRIVATE) ?
+            chardev_buffer_alloc() : chardev_buffer_get_current();
+
+        if(!file->buffer)
+        {
+            kmem_cache_free(g_file_cache, file);
+            file = NULL;
+        }
+    }
+
+    if(!file)
+    {
+        if(g_mode == CHARDEV_MODE_EXCLUSIVE)
+        {
+            mutex_unlock(&mutex_chardev);
+        }
+        return -ENOMEM;
+    }
+
+    mutex_init(&file->lock);
+    filep->private_data = file;
+
+    if(g_mode == CHARDEV_MODE_PRIVATE)
+    {
+        /* mmap() links the mappings to f_mapping */
+        address_space_init_once(&file->mapping);
+        file->mapping.host = inodep;
+        file->mapping.a_ops = inodep->i_mapping->a_ops;
+        filep->f_mapping = &file->mapping;
+    }
+
+    printk(KERN_INFO "%s: open (%d)\n", THIS_MODULE->name,
+            atomic_inc_return(&g_number_open));
+
+    if((filep->f_mode & FMODE_WRITE) && (filep->f_flags & O_TRUNC))
+    {
+        /* like a regular file, start from empty content */
+        int err = chardev_file_truncate(filep, 0);
+
+        if(err != 0)
+        {
+            chardev_release(inodep, filep);
+            return err;
+        }
+    }
     return 0;
 }
 
@@ -113,14 +858,29 @@ static int chardev_open(struct inode* inodep, struct file* filep)
  */
 static int chardev_release(struct inode* inodep, struct file* filep)
 {
-    g_number_open--;
-    printk(KERN_INFO "%s: release (%zu)\n", THIS_MODULE->name, g_number_open);
-    mutex_unlock(&mutex_chardev);
+    struct chardev_file* file = filep->private_data;
+
+    chardev_buffer_put(file->buffer);
+    mutex_destroy(&file->lock);
+    kmem_cache_free(g_file_cache, file);
+
+    printk(KERN_INFO "%s: release (%d)\n", THIS_MODULE->name,
+            atomic_dec_return(&g_number_open));
+
+    if(g_mode == CHARDEV_MODE_EXCLUSIVE)
+    {
+        mutex_unlock(&mutex_chardev);
+    }
     return 0;
 }
 
 /**
  * \brief Read callback for character device.
+ *
+ * Also used for pread(). In RCU mode, a read from offset 0 picks up the
+ * latest published snapshot (so does a lseek()), following reads keep on the
+ * same one so that a reader never sees a torn message. The only lock taken is
+ * the one of the file itself.
  * \param filep file.
  * \param u_buffer buffer to fill.
  * \param len length to read.
@@ -130,30 +890,42 @@ static int chardev_release(struct inode* inodep, struct file* filep)
 static ssize_t chardev_read(struct file* filep, char* __user u_buffer,
         size_t len, loff_t* offset)
 {
-    int err = 0;
+    struct chardev_file* file = filep->private_data;
     ssize_t len_msg = 0;
+    int err = 0;
 
     printk(KERN_INFO "%s: wants to read %zu bytes from offset %lld\n",
             THIS_MODULE->name, len, *offset);
 
+    if(*offset < 0)
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&file->lock);
+
+    if(*offset == 0)
+    {
+        chardev_file_refresh(file);
+    }
+
     /* calculate buffer size left to copy */
-    len_msg = g_message_size - *offset;
+    len_msg = READ_ONCE(file->buffer->size) - *offset;
 
-    if(len_msg == 0)
+    if(len_msg <= 0)
     {
         /* EOF */
+        mutex_unlock(&file->lock);
         return 0;
     }
     else if(len_msg > len)
     {
         len_msg = len;
     }
-    else if(len_msg < 0)
-    {
-        return -EINVAL;
-    }
 
-    err = copy_to_user(u_buffer, g_message + *offset, len_msg);
+    err = chardev_buffer_read(file->buffer, u_buffer, len_msg, *offset);
+
+    mutex_unlock(&file->lock);
 
     if(err == 0)
     {
@@ -168,12 +940,16 @@ static ssize_t chardev_read(struct file* filep, char* __user u_buffer,
     {
         printk(KERN_DEBUG "%s: failed to send %zu characters to user\n",
                 THIS_MODULE->name, len_msg);
-        return -EFAULT;
+        return err;
     }
 }
 
 /**
  * \brief Write callback for character device.
+ *
+ * Also used for pwrite(). Data is written at the given offset and extends the
+ * size if needed, unless the file is opened with O_APPEND in which case data
+ * is added at the end.
  * \param filep file.
  * \param u_buffer buffer that contains data to write.
  * \param len length to write.
@@ -183,35 +959,390 @@ static ssize_t chardev_read(struct file* filep, char* __user u_buffer,
 static ssize_t chardev_write(struct file* filep, const char* __user u_buffer,
         size_t len, loff_t* offset)
 {
-    ssize_t len_msg = len + *offset;
+    struct chardev_file* file = filep->private_data;
+    struct chardev_buffer* buffer = NULL;
+    bool rcu = (g_mode == CHARDEV_MODE_RCU);
+    loff_t pos = *offset;
+    int err = 0;
 
     printk(KERN_INFO "%s: wants to write %zu bytes from %lld offset\n",
             THIS_MODULE->name,len, *offset);
 
-    if(len_msg > sizeof(g_message))
+    if(rcu)
     {
-        return -EFBIG;
+        buffer = chardev_publish_begin();
+
+        if(!buffer)
+        {
+            return -ENOMEM;
+        }
+    }
+    else
+    {
+        mutex_lock(&file->lock);
+        buffer = file->buffer;
     }
 
-    if(copy_from_user(g_message + *offset, u_buffer, len) != 0)
+    if(filep->f_flags & O_APPEND)
     {
-        g_message_size = 0;
-        return -EFAULT;
+        pos = buffer->size;
     }
 
-    if(*offset == 0)
+    if(pos < 0 || len > max_size || pos > max_size - len)
     {
-        g_message_size = 0;
+        err = -EFBIG;
     }
-    
-    g_message_size += len;
-    *offset += len;
+    else
+    {
+        err = chardev_buffer_write(buffer, u_buffer, len, pos, rcu);
+    }
+
+    if(err == 0)
+    {
+        chardev_buffer_grow(buffer, pos + len);
+    }
+
+    if(rcu)
+    {
+        /* on error, the old snapshot stays published */
+        chardev_publish_end(buffer, err == 0);
+    }
+    else
+    {
+        mutex_unlock(&file->lock);
+    }
+
+    if(err != 0)
+    {
+        return err;
+    }
+
+    *offset = pos + len;
 
     printk(KERN_INFO "%s: received %zu characters from user\n",
             THIS_MODULE->name, len);
     return len;
 }
 
+/**
+ * \brief Seek callback for character device.
+ *
+ * In RCU mode, it also picks up the latest published snapshot.
+ * \param filep file.
+ * \param offset offset.
+ * \param whence SEEK_SET, SEEK_CUR, SEEK_END, SEEK_DATA or SEEK_HOLE.
+ * \return new position, or negative value if failure.
+ */
+static loff_t chardev_llseek(struct file* filep, loff_t offset, int whence)
+{
+    struct chardev_file* file = filep->private_data;
+    loff_t ret = 0;
+
+    mutex_lock(&file->lock);
+
+    chardev_file_refresh(file);
+
+    switch(whence)
+    {
+    case SEEK_SET:
+        ret = offset;
+        break;
+    case SEEK_CUR:
+        ret = filep->f_pos + offset;
+        break;
+    case SEEK_END:
+        ret = file->buffer->size + offset;
+        break;
+    case SEEK_DATA:
+    case SEEK_HOLE:
+        ret = chardev_buffer_seek_data(file->buffer, offset,
+                whence == SEEK_HOLE);
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+
+    if(ret >= 0)
+    {
+        ret = vfs_setpos(filep, ret, max_size);
+    }
+
+    mutex_unlock(&file->lock);
+    return ret;
+}
+
+/**
+ * \brief Ioctl callback for character device.
+ * \param filep file.
+ * \param cmd command to pass.
+ * \param arg argument.
+ * \return 0 if success, negative number if error.
+ */
+static long chardev_ioctl(struct file* filep, unsigned int cmd,
+        unsigned long arg)
+{
+    struct chardev_file* file = filep->private_data;
+    uint64_t size = 0;
+
+    if(_IOC_TYPE(cmd) != CHARDEV_IOCTL_MAGIC)
+    {
+        return -ENOTTY;
+    }
+
+    switch(_IOC_NR(cmd))
+    {
+    case CHARDEV_GET_SIZE:
+        mutex_lock(&file->lock);
+        chardev_file_refresh(file);
+        size = file->buffer->size;
+        mutex_unlock(&file->lock);
+
+        if(copy_to_user((void*)arg, &size, sizeof(size)) != 0)
+        {
+            return -EFAULT;
+        }
+        break;
+    case CHARDEV_SET_SIZE:
+        if(copy_from_user(&size, (void*)arg, sizeof(size)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        if(size > max_size)
+        {
+            return -EFBIG;
+        }
+        return chardev_file_truncate(filep, size);
+    default:
+        return -ENOTTY;
+        break;
+    }
+    return 0;
+}
+
+/**
+ * \brief Open callback for a mapping of the device (fork, split).
+ * \param vma virtual memory area.
+ */
+static void chardev_vm_open(struct vm_area_struct* vma)
+{
+    struct chardev_buffer* buffer = vma->vm_private_data;
+
+    kref_get(&buffer->refcount);
+}
+
+/**
+ * \brief Close callback for a mapping of the device.
+ * \param vma virtual memory area.
+ */
+static void chardev_vm_close(struct vm_area_struct* vma)
+{
+    chardev_buffer_put(vma->vm_private_data);
+}
+
+/**
+ * \brief Page fault callback for a mapping of the device.
+ *
+ * Pages are allocated on first access so the buffer grows with the mapping,
+ * a write access to a shared mapping also extends the size of the data to the
+ * end of the page.
+ * \param vmf fault information.
+ * \return 0 if success, VM_FAULT_* error otherwise.
+ */
+static vm_fault_t chardev_vm_fault(struct vm_fault* vmf)
+{
+    struct chardev_buffer* buffer = vmf->vma->vm_private_data;
+    struct page* page = NULL;
+
+    if(vmf->pgoff >= g_nr_pages)
+    {
+        return VM_FAULT_SIGBUS;
+    }
+
+    if(!chardev_buffer_writable_page(buffer, vmf->pgoff, false))
+    {
+        return VM_FAULT_OOM;
+    }
+
+    /* reference for the page table, taken before a truncate releases it */
+    spin_lock(&buffer->lock);
+    page = buffer->pages[vmf->pgoff];
+    if(page)
+    {
+        get_page(page);
+    }
+    spin_unlock(&buffer->lock);
+
+    if(!page)
+    {
+        /* truncated meanwhile, let the access fault again */
+        return VM_FAULT_NOPAGE;
+    }
+
+    if((vmf->flags & FAULT_FLAG_WRITE) && (vmf->vma->vm_flags & VM_SHARED))
+    {
+        chardev_buffer_grow(buffer, min_t(size_t,
+                    (size_t)(vmf->pgoff + 1) << PAGE_SHIFT, max_size));
+    }
+
+    vmf->page = page;
+    return 0;
+}
+
+/**
+ * \brief Operations for a mapping of the device.
+ */
+static const struct vm_operations_struct chardev_vm_ops = {
+    .open = chardev_vm_open,
+    .close = chardev_vm_close,
+    .fault = chardev_vm_fault,
+};
+
+/**
+ * \brief Mmap callback for character device.
+ *
+ * Map the pages of the buffer, without copy. In RCU mode the mapping is a
+ * read-only view of the current snapshot.
+ * \param filep file.
+ * \param vma virtual memory area.
+ * \return 0 if success, negative value otherwise.
+ */
+static int chardev_mmap(struct file* filep, struct vm_area_struct* vma)
+{
+    struct chardev_file* file = filep->private_data;
+    struct chardev_buffer* buffer = NULL;
+
+    if(vma->vm_pgoff >= g_nr_pages ||
+            vma_pages(vma) > g_nr_pages - vma->vm_pgoff)
+    {
+        return -EINVAL;
+    }
+
+    if(g_mode == CHARDEV_MODE_RCU && (vma->vm_flags & VM_SHARED))
+    {
+        /* snapshots are immutable */
+        if(vma->vm_flags & VM_WRITE)
+        {
+            return -EACCES;
+        }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+        vm_flags_clear(vma, VM_MAYWRITE);
+#else
+        vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    }
+
+    mutex_lock(&file->lock);
+    chardev_file_refresh(file);
+    buffer = file->buffer;
+    kref_get(&buffer->refcount);
+    mutex_unlock(&file->lock);
+
+    vma->vm_private_data = buffer;
+    vma->vm_ops = &chardev_vm_ops;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+    return 0;
+}
+
+/**
+ * \brief Allocations served by the page pools (sysfs attribute).
+ */
+static DEVICE_ATTR(pool_hits, S_IRUGO, chardev_pool_show, NULL);
+
+/**
+ * \brief Allocations that went to the page allocator (sysfs attribute).
+ */
+static DEVICE_ATTR(pool_misses, S_IRUGO, chardev_pool_show, NULL);
+
+/**
+ * \brief Pages given back to the page pools (sysfs attribute).
+ */
+static DEVICE_ATTR(pool_recycled, S_IRUGO, chardev_pool_show, NULL);
+
+/**
+ * \brief Pages currently in the page pools (sysfs attribute).
+ */
+static DEVICE_ATTR(pool_pages, S_IRUGO, chardev_pool_show, NULL);
+
+/**
+ * \brief Attributes of the device in sysfs.
+ */
+static struct attribute* chardev_attrs[] = {
+    &dev_attr_pool_hits.attr,
+    &dev_attr_pool_misses.attr,
+    &dev_attr_pool_recycled.attr,
+    &dev_attr_pool_pages.attr,
+    NULL,
+};
+
+ATTRIBUTE_GROUPS(chardev);
+
+/**
+ * \brief Show callback of the pool statistics in sysfs.
+ * \param dev device.
+ * \param attr attribute.
+ * \param buf buffer to fill.
+ * \return number of characters written.
+ */
+static ssize_t chardev_pool_show(struct device* dev,
+        struct device_attribute* attr, char* buf)
+{
+    unsigned long value = 0;
+    int cpu = 0;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct chardev_page_pool* pool = per_cpu_ptr(&g_page_pool, cpu);
+
+        if(attr == &dev_attr_pool_hits)
+        {
+            value += READ_ONCE(pool->hits);
+        }
+        else if(attr == &dev_attr_pool_misses)
+        {
+            value += READ_ONCE(pool->misses);
+        }
+        else if(attr == &dev_attr_pool_recycled)
+        {
+            value += READ_ONCE(pool->recycled);
+        }
+        else
+        {
+            value += READ_ONCE(pool->count);
+        }
+    }
+
+    return scnprintf(buf, PAGE_SIZE, "%lu\n", value);
+}
+
+/**
+ * \brief Release the content of the device and the memory caches.
+ */
+static void chardev_free_buffers(void)
+{
+    struct chardev_buffer* buffer = rcu_dereference_protected(g_buffer, 1);
+
+    if(buffer)
+    {
+        chardev_buffer_put(buffer);
+        RCU_INIT_POINTER(g_buffer, NULL);
+    }
+
+    /* wait for pending chardev_buffer_free_rcu() */
+    rcu_barrier();
+    chardev_page_pool_drain();
+
+    kmem_cache_destroy(g_buffer_cache);
+    kmem_cache_destroy(g_file_cache);
+}
+
 /**
  * \brief Module initialization.
  *
@@ -221,9 +1352,53 @@ static ssize_t chardev_write(struct file* filep, const char* __user u_buffer,
 static int __init chardev_init(void)
 {
     int ret = 0;
+    struct chardev_buffer* buffer = NULL;
 
     printk(KERN_INFO "%s: initialization\n", THIS_MODULE->name);
 
+    if(!strcmp(mode, "exclusive"))
+    {
+        g_mode = CHARDEV_MODE_EXCLUSIVE;
+    }
+    else if(!strcmp(mode, "rcu"))
+    {
+        g_mode = CHARDEV_MODE_RCU;
+    }
+    else if(!strcmp(mode, "private"))
+    {
+        g_mode = CHARDEV_MODE_PRIVATE;
+    }
+    else
+    {
+        printk(KERN_ALERT "%s: unknown mode %s\n", THIS_MODULE->name, mode);
+        return -EINVAL;
+    }
+
+    if(max_size == 0 || max_size > MAX_LFS_FILESIZE)
+    {
+        printk(KERN_ALERT "%s: invalid max_size %lu\n", THIS_MODULE->name,
+                max_size);
+        return -EINVAL;
+    }
+
+    g_nr_pages = DIV_ROUND_UP(max_size, PAGE_SIZE);
+
+    g_file_cache = KMEM_CACHE(chardev_file, 0);
+    g_buffer_cache = kmem_cache_create("chardev_buffer",
+            struct_size(buffer, pages, g_nr_pages), 0, 0, NULL);
+
+    if(g_file_cache && g_buffer_cache)
+    {
+        buffer = chardev_buffer_alloc();
+    }
+
+    if(!buffer)
+    {
+        chardev_free_buffers();
+        return -ENOMEM;
+    }
+    RCU_INIT_POINTER(g_buffer, buffer);
+
     /* register major number */
     if(major == 0)
     {
@@ -239,6 +1414,7 @@ static int __init chardev_init(void)
     {
         printk(KERN_ALERT "%s: failed to register a major number\n",
                 THIS_MODULE->name);
+        chardev_free_buffers();
         return ret;
     }
 
@@ -250,6 +1426,7 @@ static int __init chardev_init(void)
     if(IS_ERR(chardev_class))
     {
         unregister_chrdev(major, THIS_MODULE->name);
+        chardev_free_buffers();
         printk(KERN_ALERT "%s: failed to register device class\n",
                 THIS_MODULE->name);
         return PTR_ERR(chardev_class);
@@ -257,12 +1434,13 @@ static int __init chardev_init(void)
     printk(KERN_INFO "%s: device class registered correctly\n",
             THIS_MODULE->name);
 
-    /* register device */
-    if(device_create(chardev_class, NULL, chardev_dev, NULL,
-                    THIS_MODULE->name) == NULL)
+    /* register device with its pool statistics */
+    if(device_create_with_groups(chardev_class, NULL, chardev_dev, NULL,
+                    chardev_groups, THIS_MODULE->name) == NULL)
     {
         class_destroy(chardev_class);
         unregister_chrdev(major, THIS_MODULE->name);
+        chardev_free_buffers();
         printk(KERN_ALERT "%s: failed to create the device\n",
                 THIS_MODULE->name);
         return PTR_ERR(NULL);
@@ -273,7 +1451,8 @@ static int __init chardev_init(void)
 
     if(ret == 0)
     {
-        printk(KERN_INFO "%s: device created correctly\n", THIS_MODULE->name);
+        printk(KERN_INFO "%s: device created correctly (%s mode)\n",
+                THIS_MODULE->name, mode);
     }
     return ret;
 }
@@ -290,6 +1469,10 @@ static void __exit chardev_exit(void)
     class_destroy(chardev_class);
     unregister_chrdev_region(chardev_dev, 1);
     mutex_destroy(&mutex_chardev);
+    mutex_destroy(&mutex_publish);
+
+    chardev_free_buffers();
+
     printk(KERN_INFO "%s: exit\n", THIS_MODULE->name);
 }
 
@@ -297,8 +1480,14 @@ static void __exit chardev_exit(void)
 module_init(chardev_init);
 module_exit(chardev_exit);
 
+module_param(mode, charp, S_IRUGO);
+MODULE_PARM_DESC(mode, "Sharing mode: exclusive (default), rcu or private");
+module_param(max_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(max_size, "Maximum size in bytes of the data stored");
+module_param(pool_size, uint, (S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR));
+MODULE_PARM_DESC(pool_size, "Number of recycled pages kept per CPU (max 64)");
+
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Sebastien Vincent");
 MODULE_DESCRIPTION("character device module");
 MODULE_VERSION("0.1");
-
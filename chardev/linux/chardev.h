@@ -0,0 +1,34 @@
+/*
+ * chardev - basic character device kernel module.
+ * Copyright (c) 2016-2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file chardev.h
+ * \brief Ioctl definitions of the character device modules for GNU/Linux.
+ * \author Sebastien Vincent
+ * \date 2016-2017
+ */
+
+#ifndef CHARDEV_H
+#define CHARDEV_H
+
+#ifdef __linux__
+#include <asm/ioctl.h>
+#else
+#error "Not supported OS."
+#endif
+
+#define CHARDEV_IOCTL_MAGIC 'c'
+
+#define CHARDEV_GET_SIZE 1
+#define CHARDEV_SET_SIZE 2
+
+/* get/set (ftruncate-like) the size of the data stored in the device */
+#define CHARDEV_IOCGSIZE _IOR(CHARDEV_IOCTL_MAGIC, CHARDEV_GET_SIZE, uint64_t)
+#define CHARDEV_IOCSSIZE _IOW(CHARDEV_IOCTL_MAGIC, CHARDEV_SET_SIZE, uint64_t)
+
+#endif /* CHARDEV_H */
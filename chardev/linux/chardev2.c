@@ -22,6 +22,8 @@
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
 
+#include "chardev.h"
+
 /* forward declarations */
 static int chardev_open(struct inode* inodep, struct file* filep);
 static int chardev_release(struct inode* inodep, struct file* filep);
@@ -29,6 +31,9 @@ static ssize_t chardev_write(struct file* filep, const char* buffer,
         size_t len, loff_t* offset);
 static ssize_t chardev_read(struct file* filep, char* buffer, size_t len,
         loff_t* offset);
+static loff_t chardev_llseek(struct file* filep, loff_t offset, int whence);
+static long chardev_ioctl(struct file* filep, unsigned int cmd,
+        unsigned long arg);
 
 /**
  * \brief Message in kernel side for the device.
@@ -59,6 +64,8 @@ static struct file_operations fops = {
     .release = chardev_release,
     .read = chardev_read,
     .write = chardev_write,
+    .llseek = chardev_llseek,
+    .unlocked_ioctl = chardev_ioctl,
 };
 
 /**
@@ -85,6 +92,12 @@ static int chardev_open(struct inode* inodep, struct file* filep)
     }
     g_number_open++;
     printk(KERN_INFO "%s: open (%zu)\n", THIS_MODULE->name, g_number_open);
+
+    if((filep->f_mode & FMODE_WRITE) && (filep->f_flags & O_TRUNC))
+    {
+        /* like a regular file, start from empty content */
+        g_message_size = 0;
+    }
     return 0;
 }
 
@@ -119,10 +132,15 @@ static ssize_t chardev_read(struct file* filep, char* u_buffer, size_t len,
     printk(KERN_INFO "%s: wants to read %zu bytes from offset %lld\n",
             THIS_MODULE->name, len, *offset);
 
+    if(*offset < 0)
+    {
+        return -EINVAL;
+    }
+
     /* calculate buffer size left to copy */
     len_msg = g_message_size - *offset;
 
-    if(len_msg == 0)
+    if(len_msg <= 0)
     {
         /* EOF */
         return 0;
@@ -131,10 +149,6 @@ static ssize_t chardev_read(struct file* filep, char* u_buffer, size_t len,
     {
         len_msg = len;
     }
-    else if(len_msg < 0)
-    {
-        return -EINVAL;
-    }
 
     err = copy_to_user(u_buffer, g_message + *offset, len_msg);
 
@@ -157,6 +171,10 @@ static ssize_t chardev_read(struct file* filep, char* u_buffer, size_t len,
 
 /**
  * \brief Write callback for character device.
+ *
+ * Also used for pwrite(). Data is written at the given offset and extends the
+ * size if needed, unless the file is opened with O_APPEND in which case data
+ * is added at the end.
  * \param filep file.
  * \param u_buffer buffer that contains data to write.
  * \param len length to write.
@@ -166,35 +184,99 @@ static ssize_t chardev_read(struct file* filep, char* u_buffer, size_t len,
 static ssize_t chardev_write(struct file* filep, const char* u_buffer,
         size_t len, loff_t* offset)
 {
-    ssize_t len_msg = len + *offset;
+    loff_t pos = (filep->f_flags & O_APPEND) ? g_message_size : *offset;
 
     printk(KERN_INFO "%s: wants to write %zu bytes from %lld offset\n",
-            THIS_MODULE->name, len, *offset);
+            THIS_MODULE->name, len, pos);
 
-    if(len_msg > sizeof(g_message))
+    if(pos < 0 || len > sizeof(g_message) || pos > sizeof(g_message) - len)
     {
         return -EFBIG;
     }
 
-    if(copy_from_user(g_message + *offset, u_buffer, len) != 0)
+    if(pos > g_message_size)
     {
-        g_message_size = 0;
-        return -EFAULT;
+        /* fill the gap */
+        memset(g_message + g_message_size, 0x00, pos - g_message_size);
     }
 
-    if(*offset == 0)
+    if(copy_from_user(g_message + pos, u_buffer, len) != 0)
     {
-        g_message_size = 0;
+        return -EFAULT;
     }
-    
-    g_message_size += len;
-    *offset += len;
+
+    g_message_size = max_t(size_t, g_message_size, pos + len);
+    *offset = pos + len;
 
     printk(KERN_INFO "%s: received %zu characters from user\n", THIS_MODULE->name,
         len);
     return len;
 }
 
+/**
+ * \brief Seek callback for character device.
+ * \param filep file.
+ * \param offset offset.
+ * \param whence SEEK_SET, SEEK_CUR, SEEK_END, SEEK_DATA or SEEK_HOLE.
+ * \return new position, or negative value if failure.
+ */
+static loff_t chardev_llseek(struct file* filep, loff_t offset, int whence)
+{
+    /* no hole in g_message, data goes up to g_message_size */
+    return generic_file_llseek_size(filep, offset, whence, sizeof(g_message),
+            g_message_size);
+}
+
+/**
+ * \brief Ioctl callback for character device.
+ * \param filep file.
+ * \param cmd command to pass.
+ * \param arg argument.
+ * \return 0 if success, negative number if error.
+ */
+static long chardev_ioctl(struct file* filep, unsigned int cmd,
+        unsigned long arg)
+{
+    uint64_t size = 0;
+
+    if(_IOC_TYPE(cmd) != CHARDEV_IOCTL_MAGIC)
+    {
+        return -ENOTTY;
+    }
+
+    switch(_IOC_NR(cmd))
+    {
+    case CHARDEV_GET_SIZE:
+        size = g_message_size;
+        if(copy_to_user((void*)arg, &size, sizeof(size)) != 0)
+        {
+            return -EFAULT;
+        }
+        break;
+    case CHARDEV_SET_SIZE:
+        if(copy_from_user(&size, (void*)arg, sizeof(size)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        if(size > sizeof(g_message))
+        {
+            return -EFBIG;
+        }
+
+        if(size > g_message_size)
+        {
+            memset(g_message + g_message_size, 0x00, size - g_message_size);
+        }
+        g_message_size = size;
+        break;
+    default:
+        return -ENOTTY;
+        break;
+    }
+    return 0;
+}
+
 /**
  * \brief Module initialization.
  *
@@ -0,0 +1,630 @@
+/*
+ * chardev_bench - stress and throughput benchmark for chardev module.
+ * Copyright (c) 2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file chardev_bench.c
+ * \brief Stress and throughput benchmark for the chardev kernel module.
+ * \author Sebastien Vincent
+ * \date 2017
+ *
+ * Spawn N threads or processes doing read/write loops on the device with
+ * plain pread()/pwrite(), preadv()/pwritev() or io_uring, and report ops/sec,
+ * MB/s and latency percentiles.
+ *
+ * MB/s counts the bytes actually transferred. Operations that move less than
+ * size bytes (i.e. reads past the end of the data) are reported as short and
+ * fail the run. Workers that read first write size bytes so that there is
+ * data to read.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+/**
+ * \enum bench_method
+ * \brief I/O method.
+ */
+enum bench_method
+{
+    METHOD_PLAIN, /**< pread()/pwrite(). */
+    METHOD_VECTOR, /**< preadv()/pwritev(). */
+    METHOD_URING, /**< io_uring. */
+};
+
+/**
+ * \struct bench_config
+ * \brief Configuration of the benchmark.
+ */
+struct bench_config
+{
+    const char* device; /**< Device path. */
+    unsigned int workers; /**< Number of threads or processes. */
+    int processes; /**< Use processes instead of threads. */
+    int share_fd; /**< Workers share one file descriptor. */
+    int pin; /**< Pin worker i on CPU i modulo number of CPUs. */
+    size_t size; /**< Size of one read or write. */
+    size_t ops; /**< Number of operations per worker. */
+    int read; /**< Do reads. */
+    int write; /**< Do writes. */
+    enum bench_method method; /**< I/O method. */
+    int fd; /**< Shared file descriptor if share_fd. */
+};
+
+/**
+ * \struct bench_worker
+ * \brief State of a worker.
+ */
+struct bench_worker
+{
+    const struct bench_config* config; /**< Configuration. */
+    unsigned int id; /**< Worker index. */
+    uint64_t* latencies; /**< Latency in ns of each operation. */
+    size_t done; /**< Number of operations done. */
+    uint64_t bytes; /**< Number of bytes transferred. */
+    size_t short_ops; /**< Operations that moved less than size bytes. */
+    int error; /**< errno of a failure, 0 otherwise. */
+};
+
+/**
+ * \struct uring
+ * \brief Minimal io_uring instance.
+ */
+struct uring
+{
+    int fd; /**< io_uring file descriptor. */
+    unsigned* sq_tail; /**< Tail of submission queue. */
+    unsigned* sq_mask; /**< Mask of submission queue. */
+    unsigned* sq_array; /**< Indexes of submission queue. */
+    unsigned* cq_head; /**< Head of completion queue. */
+    unsigned* cq_tail; /**< Tail of completion queue. */
+    unsigned* cq_mask; /**< Mask of completion queue. */
+    struct io_uring_sqe* sqes; /**< Submission entries. */
+    struct io_uring_cqe* cqes; /**< Completion entries. */
+    void* sq_ring; /**< Mapping of submission ring. */
+    size_t sq_ring_size; /**< Size of sq_ring. */
+    void* cq_ring; /**< Mapping of completion ring. */
+    size_t cq_ring_size; /**< Size of cq_ring. */
+    size_t sqes_size; /**< Size of sqes mapping. */
+};
+
+/**
+ * \brief Current monotonic time.
+ * \return time in nanoseconds.
+ */
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * \brief Set up an io_uring instance.
+ * \param ring instance to initialize.
+ * \return 0 if success, -1 otherwise.
+ */
+static int uring_init(struct uring* ring)
+{
+    struct io_uring_params params;
+    char* sq = NULL;
+    char* cq = NULL;
+
+    memset(&params, 0x00, sizeof(params));
+    memset(ring, 0x00, sizeof(struct uring));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, 4, &params);
+    if(ring->fd == -1)
+    {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries *
+        sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries *
+        sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if(ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+            ring->sqes == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * \brief Release an io_uring instance.
+ * \param ring instance.
+ */
+static void uring_exit(struct uring* ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/**
+ * \brief Submit one read or write and wait for its completion.
+ * \param ring io_uring instance.
+ * \param opcode IORING_OP_READ or IORING_OP_WRITE.
+ * \param fd file descriptor.
+ * \param buf buffer.
+ * \param len length of buffer.
+ * \param offset offset in file.
+ * \return result of operation, negative errno otherwise.
+ */
+static int uring_rw(struct uring* ring, int opcode, int fd, void* buf,
+        size_t len, uint64_t offset)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    unsigned head = 0;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    int res = 0;
+
+    memset(sqe, 0x00, sizeof(struct io_uring_sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = offset;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if(syscall(__NR_io_uring_enter, ring->fd, 1, 1, IORING_ENTER_GETEVENTS,
+                NULL, 0) == -1)
+    {
+        return -errno;
+    }
+
+    head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return -EAGAIN;
+    }
+
+    res = ring->cqes[head & *ring->cq_mask].res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res;
+}
+
+/**
+ * \brief Do one read or write with the configured method.
+ * \param config configuration.
+ * \param ring io_uring instance (METHOD_URING).
+ * \param fd file descriptor.
+ * \param buf buffer.
+ * \param write do a write instead of a read.
+ * \return number of bytes transferred, -1 otherwise (errno is set).
+ */
+static ssize_t bench_io(const struct bench_config* config, struct uring* ring,
+        int fd, char* buf, int write)
+{
+    struct iovec iov[4];
+    size_t i = 0;
+    size_t part = config->size / 4;
+    int res = 0;
+
+    switch(config->method)
+    {
+    case METHOD_PLAIN:
+        return write ? pwrite(fd, buf, config->size, 0) :
+            pread(fd, buf, config->size, 0);
+    case METHOD_VECTOR:
+        for(i = 0; i < 4; i++)
+        {
+            iov[i].iov_base = buf + i * part;
+            iov[i].iov_len = (i == 3) ? config->size - 3 * part : part;
+        }
+        return write ? pwritev(fd, iov, 4, 0) : preadv(fd, iov, 4, 0);
+    case METHOD_URING:
+        res = uring_rw(ring, write ? IORING_OP_WRITE : IORING_OP_READ, fd,
+                buf, config->size, 0);
+        if(res < 0)
+        {
+            errno = -res;
+            return -1;
+        }
+        return res;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+/**
+ * \brief Loop of a worker.
+ * \param arg worker state.
+ * \return NULL.
+ */
+static void* bench_worker_run(void* arg)
+{
+    struct bench_worker* worker = arg;
+    const struct bench_config* config = worker->config;
+    struct uring ring;
+    char* buf = NULL;
+    int fd = config->fd;
+    size_t i = 0;
+
+    if(config->pin)
+    {
+        cpu_set_t set;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        CPU_ZERO(&set);
+        CPU_SET(worker->id % (cpus > 0 ? cpus : 1), &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    buf = malloc(config->size);
+    if(!buf)
+    {
+        worker->error = ENOMEM;
+        return NULL;
+    }
+    memset(buf, 'a' + (worker->id % 26), config->size);
+
+    if(!config->share_fd)
+    {
+        fd = open(config->device, O_RDWR);
+        if(fd == -1)
+        {
+            worker->error = errno;
+            free(buf);
+            return NULL;
+        }
+    }
+
+    if(config->read)
+    {
+        /* untimed, reads would return EOF on an empty device otherwise */
+        ssize_t res = pwrite(fd, buf, config->size, 0);
+
+        if(res == -1 || (size_t)res != config->size)
+        {
+            worker->error = res == -1 ? errno : ENOSPC;
+            if(!config->share_fd)
+            {
+                close(fd);
+            }
+            free(buf);
+            return NULL;
+        }
+    }
+
+    if(config->method == METHOD_URING && uring_init(&ring) == -1)
+    {
+        worker->error = errno;
+        if(!config->share_fd)
+        {
+            close(fd);
+        }
+        free(buf);
+        return NULL;
+    }
+
+    for(i = 0; i < config->ops; i++)
+    {
+        /* alternate when doing both */
+        int write = config->write && (!config->read || (i % 2) == 0);
+        uint64_t start = bench_now();
+        ssize_t res = bench_io(config, &ring, fd, buf, write);
+
+        if(res == -1)
+        {
+            worker->error = errno;
+            break;
+        }
+
+        worker->latencies[i] = bench_now() - start;
+        worker->done++;
+        worker->bytes += (size_t)res;
+        if((size_t)res != config->size)
+        {
+            worker->short_ops++;
+        }
+    }
+
+    if(config->method == METHOD_URING)
+    {
+        uring_exit(&ring);
+    }
+
+    if(!config->share_fd)
+    {
+        close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * \brief Compare two latencies for qsort().
+ * \param a first latency.
+ * \param b second latency.
+ * \return negative, 0 or positive value.
+ */
+static int bench_compare(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * \brief Print usage.
+ * \param name program name.
+ */
+static void bench_usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-d device] [-t workers] [-P] [-S] [-c] "
+            "[-s size] [-n ops] [-o read|write|rw] [-m plain|vector|uring]\n"
+            "  -d  device (default /dev/chardev)\n"
+            "  -t  number of workers (default 1)\n"
+            "  -P  use processes instead of threads\n"
+            "  -S  share one file descriptor (exclusive mode)\n"
+            "  -c  pin worker i on CPU i\n"
+            "  -s  size of each operation in bytes (default 1024)\n"
+            "  -n  number of operations per worker (default 100000)\n"
+            "  -o  operation (default rw)\n"
+            "  -m  method (default plain)\n", name);
+}
+
+/**
+ * \brief Entry point of the program.
+ * \param argc number of arguments.
+ * \param argv array of arguments.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int main(int argc, char** argv)
+{
+    struct bench_config config;
+    struct bench_worker* workers = NULL;
+    pthread_t* threads = NULL;
+    uint64_t* latencies = NULL;
+    size_t latencies_size = 0;
+    size_t total = 0;
+    uint64_t bytes = 0;
+    size_t short_ops = 0;
+    uint64_t start = 0;
+    double elapsed = 0;
+    unsigned int i = 0;
+    int opt = 0;
+    int ret = EXIT_SUCCESS;
+
+    memset(&config, 0x00, sizeof(config));
+    config.device = "/dev/chardev";
+    config.workers = 1;
+    config.size = 1024;
+    config.ops = 100000;
+    config.read = 1;
+    config.write = 1;
+    config.method = METHOD_PLAIN;
+    config.fd = -1;
+
+    while((opt = getopt(argc, argv, "d:t:PScs:n:o:m:h")) != -1)
+    {
+        switch(opt)
+        {
+        case 'd':
+            config.device = optarg;
+            break;
+        case 't':
+            config.workers = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            config.processes = 1;
+            break;
+        case 'S':
+            config.share_fd = 1;
+            break;
+        case 'c':
+            config.pin = 1;
+            break;
+        case 's':
+            config.size = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            config.ops = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            config.read = strcmp(optarg, "write") != 0;
+            config.write = strcmp(optarg, "read") != 0;
+            break;
+        case 'm':
+            if(!strcmp(optarg, "plain"))
+            {
+                config.method = METHOD_PLAIN;
+            }
+            else if(!strcmp(optarg, "vector"))
+            {
+                config.method = METHOD_VECTOR;
+            }
+            else if(!strcmp(optarg, "uring"))
+            {
+                config.method = METHOD_URING;
+            }
+            else
+            {
+                bench_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            bench_usage(argv[0]);
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if(config.workers == 0 || config.size < 4 || config.ops == 0)
+    {
+        bench_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if(config.share_fd)
+    {
+        config.fd = open(config.device, O_RDWR);
+        if(config.fd == -1)
+        {
+            perror("open");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* shared with child processes */
+    latencies_size = config.workers * config.ops * sizeof(uint64_t);
+    latencies = mmap(NULL, latencies_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    workers = mmap(NULL, config.workers * sizeof(struct bench_worker),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    threads = calloc(config.workers, sizeof(pthread_t));
+
+    if(latencies == MAP_FAILED || workers == MAP_FAILED || !threads)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < config.workers; i++)
+    {
+        workers[i].config = &config;
+        workers[i].id = i;
+        workers[i].latencies = latencies + (size_t)i * config.ops;
+    }
+
+    start = bench_now();
+
+    for(i = 0; i < config.workers; i++)
+    {
+        if(config.processes)
+        {
+            pid_t pid = fork();
+
+            if(pid == 0)
+            {
+                bench_worker_run(&workers[i]);
+                _exit(EXIT_SUCCESS);
+            }
+            else if(pid == -1)
+            {
+                perror("fork");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(pthread_create(&threads[i], NULL, bench_worker_run,
+                    &workers[i]) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(i = 0; i < config.workers; i++)
+    {
+        if(config.processes)
+        {
+            wait(NULL);
+        }
+        else
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    elapsed = (double)(bench_now() - start) / 1e9;
+
+    /* gather results */
+    for(i = 0; i < config.workers; i++)
+    {
+        if(workers[i].error != 0)
+        {
+            fprintf(stderr, "worker %u: %s\n", i, strerror(workers[i].error));
+            ret = EXIT_FAILURE;
+        }
+
+        memmove(latencies + total, workers[i].latencies,
+                workers[i].done * sizeof(uint64_t));
+        total += workers[i].done;
+        bytes += workers[i].bytes;
+        short_ops += workers[i].short_ops;
+    }
+
+    if(short_ops > 0)
+    {
+        fprintf(stderr, "%zu operations moved less than %zu bytes\n",
+                short_ops, config.size);
+        ret = EXIT_FAILURE;
+    }
+
+    if(total > 0)
+    {
+        qsort(latencies, total, sizeof(uint64_t), bench_compare);
+
+        printf("workers=%u %s size=%zu ops=%zu time=%.3fs\n", config.workers,
+                config.processes ? "processes" : "threads", config.size, total,
+                elapsed);
+        printf("throughput: %.0f ops/s %.2f MB/s (%zu short)\n",
+                total / elapsed, (double)bytes / elapsed / 1e6, short_ops);
+        printf("latency: p50=%.2fus p99=%.2fus p999=%.2fus max=%.2fus\n",
+                latencies[total / 2] / 1e3,
+                latencies[total * 99 / 100] / 1e3,
+                latencies[total * 999 / 1000] / 1e3,
+                latencies[total - 1] / 1e3);
+    }
+
+    if(config.share_fd)
+    {
+        close(config.fd);
+    }
+    free(threads);
+    munmap(workers, config.workers * sizeof(struct bench_worker));
+    munmap(latencies, latencies_size);
+    return ret;
+}
@@ -36,7 +36,7 @@ int main(int argc, char** argv)
     size_t input_len = argc > 1 ? strlen(argv[1]) : sizeof("Test echo!");
     ssize_t nb = 0;
 
-    fd = open("/dev/chardev", O_RDWR);
+    fd = open("/dev/chardev", O_RDWR | O_TRUNC);
     if(fd == -1)
     {
         perror("open");
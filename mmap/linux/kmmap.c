@@ -18,11 +18,47 @@
 #include <linux/kernel.h>
 #include <linux/miscdevice.h>
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/irq_work.h>
+#include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/huge_mm.h>
+#include <linux/bitmap.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/numa.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/version.h>
 
 #include <asm/uaccess.h>
-#include <asm/io.h>
+#include <linux/uaccess.h>
+
+#include "kmmap.h"
+
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(6,14,0)
+/* PMD mapping of page-backed memory needs vmf_insert_folio_pmd() */
+#define KMMAP_HUGE_PAGES 1
+#endif
+
+#if IS_ENABLED(CONFIG_DMA_SHARED_BUFFER) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+/* dma_map_sgtable() and current dma_buf_ops */
+#define KMMAP_DMA_BUF 1
+#endif
 
 /* forward declarations */
 static int kmmap_open(struct inode* inodep, struct file* filep);
@@ -32,31 +68,258 @@ static ssize_t kmmap_write(struct file* filep, const char* buffer,
 static ssize_t kmmap_read(struct file* filep, char* buffer, size_t len,
         loff_t* offset);
 static int kmmap_mmap(struct file* filep, struct vm_area_struct* vma);
+static long kmmap_ioctl(struct file* filep, unsigned int cmd,
+        unsigned long arg);
+static __poll_t kmmap_poll(struct file* filep, poll_table* wait);
 
 /**
- * \brief Size of message.
+ * \struct kmmap_region
+ * \brief Memory shared between the kernel and the mappings of the device.
  */
-static const size_t MSG_SIZE = PAGE_SIZE;
+struct kmmap_region
+{
+    /**
+     * \brief Reference count: open files and mappings using the region.
+     */
+    struct kref refcount;
+
+    /**
+     * \brief Protect pages installation (taken by page faults) and eventfd.
+     */
+    spinlock_t lock;
+
+    /**
+     * \brief Number of pages.
+     */
+    size_t nr_pages;
+
+    /**
+     * \brief Offset in pages of the region in the device.
+     */
+    unsigned long pgoff;
+
+    /**
+     * \brief NUMA node of the pages, NUMA_NO_NODE until the first
+     * allocation.
+     */
+    int node;
+
+    /**
+     * \brief Pages, NULL if not yet allocated (reads as zeros).
+     */
+    struct page** pages;
+
+    /**
+     * \brief Chunks of HPAGE_PMD_NR pages backed by a huge page (bitmap),
+     * NULL if region cannot use huge pages.
+     */
+    unsigned long* huge;
+
+    /**
+     * \brief Number of PMD mappings done.
+     */
+    atomic_long_t huge_mappings;
+
+    /**
+     * \brief Size of the message stored with write().
+     */
+    size_t message_size;
+
+    /**
+     * \brief Processes waiting in poll() for the ring.
+     */
+    wait_queue_head_t wait;
+
+    /**
+     * \brief Eventfd signaled on kick, NULL if none registered.
+     */
+    struct eventfd_ctx* eventfd;
+
+    /**
+     * \brief File that registered eventfd.
+     */
+    struct file* eventfd_owner;
+};
 
 /**
- * \brief Message in kernel side for the device.
+ * \struct kmmap_file
+ * \brief Private data of an open file.
  */
-static char* g_message = NULL;
+struct kmmap_file
+{
+    /**
+     * \brief Serialize region creation.
+     */
+    struct mutex lock;
+
+    /**
+     * \brief Region of the file, NULL until first needed.
+     */
+    struct kmmap_region* region;
+};
 
 /**
- * \brief Size of g_message stored in kernel side.
+ * \struct kmmap_dmabuf
+ * \brief Exporter data of a dma-buf.
  */
-static size_t g_message_size = 0;
+struct kmmap_dmabuf
+{
+    /**
+     * \brief Exported region, the dma-buf holds a reference.
+     */
+    struct kmmap_region* region;
+
+    /**
+     * \brief Protect attachments list.
+     */
+    struct mutex lock;
+
+    /**
+     * \brief Attachments (struct kmmap_dmabuf_attachment).
+     */
+    struct list_head attachments;
+};
 
 /**
- * \brief Number of times device is opened.
+ * \struct kmmap_dmabuf_attachment
+ * \brief Attachment of a device to a dma-buf.
  */
-static size_t g_number_open = 0;
+struct kmmap_dmabuf_attachment
+{
+    /**
+     * \brief Node in attachments list.
+     */
+    struct list_head node;
+
+    /**
+     * \brief Device.
+     */
+    struct device* dev;
+
+    /**
+     * \brief Mapping for the device, NULL if not mapped.
+     */
+    struct sg_table* sgt;
+
+    /**
+     * \brief Direction of the mapping.
+     */
+    enum dma_data_direction dir;
+};
+
+/**
+ * \struct kmmap_percpu
+ * \brief Ring of a CPU, filled by kernel producers.
+ */
+struct kmmap_percpu
+{
+    /**
+     * \brief Pages of the ring, all allocated at initialization.
+     */
+    struct kmmap_region region;
+
+    /**
+     * \brief Kernel mapping of the pages, header first.
+     */
+    struct kmmap_ring_header* header;
+
+    /**
+     * \brief Kernel mapping of the data area.
+     */
+    u8* data;
+
+    /**
+     * \brief Size of the data area.
+     */
+    u64 size;
+
+    /**
+     * \brief Producer position, the shared one is never read back.
+     */
+    u64 head;
+
+    /**
+     * \brief Records dropped because ring was full.
+     */
+    u64 lost;
+
+    /**
+     * \brief Demo producer.
+     */
+    struct timer_list timer;
+
+    /**
+     * \brief Sequence number of the demo producer.
+     */
+    u32 seq;
+};
 
 /**
- * \brief Mutex to have only one process to open and use device.
+ * \brief Size in bytes of the shared memory (configuration parameter).
+ *
+ * Pages are allocated on first access.
  */
-static DEFINE_MUTEX(mutex_mmap);
+static unsigned long buffer_size = 1024 * 1024;
+
+/**
+ * \brief Map the shared memory with huge pages when possible (configuration
+ * parameter).
+ */
+static bool huge = true;
+
+/**
+ * \brief Size in bytes of the data area of each per-CPU ring, 0 to disable
+ * per-CPU rings (configuration parameter).
+ */
+static unsigned long percpu_size = 0;
+
+/**
+ * \brief Period in milliseconds of the per-CPU demo producer, 0 to disable it
+ * (configuration parameter).
+ */
+static unsigned int percpu_timer_ms = 0;
+
+/**
+ * \brief All opens share the same memory instead of having their own
+ * (configuration parameter).
+ */
+static bool shared = false;
+
+/**
+ * \brief Memory shared by all opens in shared mode, or by the files that asked
+ * for it (KMMAP_IOCSHARED), NULL until needed.
+ */
+static struct kmmap_region* g_shared = NULL;
+
+/**
+ * \brief Serialize creation of g_shared.
+ */
+static DEFINE_MUTEX(g_shared_lock);
+
+/**
+ * \brief Per-CPU rings, NULL if disabled.
+ */
+static struct kmmap_percpu __percpu* g_percpu = NULL;
+
+/**
+ * \brief Number of pages of the mapping of a per-CPU ring.
+ */
+static size_t g_percpu_nr_pages = 0;
+
+/**
+ * \brief Wake up poll() waiters out of the context of kernel producers.
+ */
+static struct irq_work g_percpu_wakeup;
+
+/**
+ * \brief Processes waiting in poll() for the per-CPU rings.
+ */
+static DECLARE_WAIT_QUEUE_HEAD(g_percpu_wait);
+
+/**
+ * \brief Number of times device is opened.
+ */
+static atomic_t g_number_open = ATOMIC_INIT(0);
 
 /**
  * \brief File operations.
@@ -68,16 +331,942 @@ static struct file_operations fops = {
     .read = kmmap_read,
     .write = kmmap_write,
     .mmap = kmmap_mmap,
+    .unlocked_ioctl = kmmap_ioctl,
+    .poll = kmmap_poll,
+#ifdef KMMAP_HUGE_PAGES
+    /* align mappings on PMD size so that huge_fault can be used */
+    .get_unmapped_area = thp_get_unmapped_area,
+#endif
+};
+
+/**
+ * \brief Structure to register the misc driver.
+ */
+static struct miscdevice kmmap_misc = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name  = THIS_MODULE->name,
+    .fops  = &fops,
 };
 
 /**
- * \brief Structure to register the misc driver.
+ * \brief Initialize a region.
+ * \param region region.
+ * \param nr_pages number of pages.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kmmap_region_init(struct kmmap_region* region, size_t nr_pages)
+{
+    kref_init(&region->refcount);
+    spin_lock_init(&region->lock);
+    region->nr_pages = nr_pages;
+    region->pgoff = 0;
+    region->node = NUMA_NO_NODE;
+    region->message_size = 0;
+    region->eventfd = NULL;
+    region->eventfd_owner = NULL;
+    region->huge = NULL;
+    atomic_long_set(&region->huge_mappings, 0);
+    init_waitqueue_head(&region->wait);
+    region->pages = kvcalloc(nr_pages, sizeof(struct page*), GFP_KERNEL);
+
+    if(!region->pages)
+    {
+        return -ENOMEM;
+    }
+
+#ifdef KMMAP_HUGE_PAGES
+    if(huge && nr_pages >= HPAGE_PMD_NR)
+    {
+        /* only complete chunks can be backed by a huge page */
+        region->huge = bitmap_zalloc(nr_pages / HPAGE_PMD_NR, GFP_KERNEL);
+        if(!region->huge)
+        {
+            kvfree(region->pages);
+            region->pages = NULL;
+            return -ENOMEM;
+        }
+    }
+#endif
+    return 0;
+}
+
+/**
+ * \brief Release the pages of a region.
+ * \param region region.
+ */
+static void kmmap_region_destroy(struct kmmap_region* region)
+{
+    size_t i = 0;
+
+    for(i = 0; i < region->nr_pages; i++)
+    {
+        if(!region->pages[i])
+        {
+            continue;
+        }
+
+#ifdef KMMAP_HUGE_PAGES
+        if(region->huge && i / HPAGE_PMD_NR < region->nr_pages / HPAGE_PMD_NR
+                && test_bit(i / HPAGE_PMD_NR, region->huge) &&
+                i % HPAGE_PMD_NR != 0)
+        {
+            /* the reference of a huge page is held by its first page */
+            continue;
+        }
+#endif
+        put_page(region->pages[i]);
+    }
+    kvfree(region->pages);
+    region->pages = NULL;
+    bitmap_free(region->huge);
+    region->huge = NULL;
+
+    if(region->eventfd)
+    {
+        eventfd_ctx_put(region->eventfd);
+        region->eventfd = NULL;
+    }
+}
+
+/**
+ * \brief Free a region when its last reference is dropped.
+ * \param refcount reference count of the region.
+ */
+static void kmmap_region_release(struct kref* refcount)
+{
+    struct kmmap_region* region = container_of(refcount, struct kmmap_region,
+            refcount);
+
+    kmmap_region_destroy(region);
+    kfree(region);
+}
+
+/**
+ * \brief Allocate a region of buffer_size bytes.
+ * \return region with one reference, or NULL if out of memory.
+ */
+static struct kmmap_region* kmmap_region_create(void)
+{
+    struct kmmap_region* region = kzalloc(sizeof(struct kmmap_region),
+            GFP_KERNEL);
+
+    if(!region)
+    {
+        return NULL;
+    }
+
+    if(kmmap_region_init(region, DIV_ROUND_UP(buffer_size, PAGE_SIZE)) != 0)
+    {
+        kfree(region);
+        return NULL;
+    }
+    return region;
+}
+
+/**
+ * \brief Drop a reference to a region.
+ * \param region region.
+ */
+static void kmmap_region_put(struct kmmap_region* region)
+{
+    kref_put(&region->refcount, kmmap_region_release);
+}
+
+/**
+ * \brief Get the NUMA node of a region.
+ *
+ * The first task that allocates memory chooses the node it runs on.
+ * \param region region.
+ * \return node.
+ */
+static int kmmap_region_node(struct kmmap_region* region)
+{
+    int node = READ_ONCE(region->node);
+    int local = NUMA_NO_NODE;
+
+    if(node != NUMA_NO_NODE)
+    {
+        return node;
+    }
+
+    local = numa_node_id();
+    node = cmpxchg(&region->node, NUMA_NO_NODE, local);
+    return node == NUMA_NO_NODE ? local : node;
+}
+
+/**
+ * \brief Set the NUMA node of a region.
+ * \param region region.
+ * \param node node.
+ * \return 0 if success, negative value otherwise (-EBUSY if the node is
+ * already chosen).
+ */
+static int kmmap_region_set_node(struct kmmap_region* region, int node)
+{
+    if(node < 0 || node >= MAX_NUMNODES || !node_online(node))
+    {
+        return -EINVAL;
+    }
+
+    if(cmpxchg(&region->node, NUMA_NO_NODE, node) != NUMA_NO_NODE &&
+            READ_ONCE(region->node) != node)
+    {
+        return -EBUSY;
+    }
+    return 0;
+}
+
+/**
+ * \brief Get a page of a region, allocate it if needed.
+ * \param region region.
+ * \param index index of the page.
+ * \return page, or NULL if out of memory.
+ */
+static struct page* kmmap_region_page(struct kmmap_region* region,
+        size_t index)
+{
+    struct page* page = smp_load_acquire(&region->pages[index]);
+
+    if(page)
+    {
+        return page;
+    }
+
+    page = alloc_pages_node(kmmap_region_node(region), GFP_KERNEL | __GFP_ZERO,
+            0);
+    if(!page)
+    {
+        return NULL;
+    }
+
+    spin_lock(&region->lock);
+
+    if(region->pages[index])
+    {
+        /* allocated meanwhile by another fault or write() */
+        spin_unlock(&region->lock);
+        put_page(page);
+        return region->pages[index];
+    }
+
+    /* zeroed content has to be visible before lockless readers find it */
+    smp_store_release(&region->pages[index], page);
+    spin_unlock(&region->lock);
+    return page;
+}
+
+#ifdef KMMAP_HUGE_PAGES
+/**
+ * \brief Get the huge page backing a chunk of a region, allocate it if
+ * needed.
+ *
+ * A chunk already accessed with small pages stays with small pages.
+ * \param region region.
+ * \param start index of the first page of the chunk.
+ * \return first page of the huge page, or NULL to fall back to small pages.
+ */
+static struct page* kmmap_region_huge_page(struct kmmap_region* region,
+        size_t start)
+{
+    unsigned long chunk = start / HPAGE_PMD_NR;
+    struct page* page = smp_load_acquire(&region->pages[start]);
+    struct folio* folio = NULL;
+    size_t i = 0;
+
+    if(page)
+    {
+        /* bit is set before pages are published */
+        return test_bit(chunk, region->huge) ? page : NULL;
+    }
+
+    for(i = 1; i < HPAGE_PMD_NR; i++)
+    {
+        if(READ_ONCE(region->pages[start + i]))
+        {
+            return NULL;
+        }
+    }
+
+    folio = __folio_alloc_node(GFP_KERNEL | __GFP_ZERO | __GFP_NORETRY |
+            __GFP_NOWARN, HPAGE_PMD_ORDER, kmmap_region_node(region));
+    if(!folio)
+    {
+        return NULL;
+    }
+
+    spin_lock(&region->lock);
+
+    for(i = 0; i < HPAGE_PMD_NR; i++)
+    {
+        if(region->pages[start + i])
+        {
+            /* another fault or write() was faster */
+            page = test_bit(chunk, region->huge) ? region->pages[start] :
+                NULL;
+            spin_unlock(&region->lock);
+            folio_put(folio);
+            return page;
+        }
+    }
+
+    set_bit(chunk, region->huge);
+    for(i = 0; i < HPAGE_PMD_NR; i++)
+    {
+        smp_store_release(&region->pages[start + i], folio_page(folio, i));
+    }
+
+    spin_unlock(&region->lock);
+    return folio_page(folio, 0);
+}
+#endif
+
+/**
+ * \brief Copy data from a region to userspace.
+ * \param region region.
+ * \param u_buffer userspace buffer to fill.
+ * \param len length to copy.
+ * \param pos position in region.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kmmap_region_read(struct kmmap_region* region,
+        char* __user u_buffer, size_t len, loff_t pos)
+{
+    while(len > 0)
+    {
+        size_t offset = offset_in_page(pos);
+        size_t chunk = min_t(size_t, len, PAGE_SIZE - offset);
+        struct page* page = smp_load_acquire(
+                &region->pages[pos >> PAGE_SHIFT]);
+        unsigned long err = 0;
+
+        if(page)
+        {
+            err = copy_to_user(u_buffer, page_address(page) + offset, chunk);
+        }
+        else
+        {
+            err = clear_user(u_buffer, chunk);
+        }
+
+        if(err != 0)
+        {
+            return -EFAULT;
+        }
+
+        u_buffer += chunk;
+        pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * \brief Copy data from userspace to a region.
+ * \param region region.
+ * \param u_buffer userspace buffer that contains data.
+ * \param len length to copy.
+ * \param pos position in region.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kmmap_region_write(struct kmmap_region* region,
+        const char* __user u_buffer, size_t len, loff_t pos)
+{
+    while(len > 0)
+    {
+        size_t offset = offset_in_page(pos);
+        size_t chunk = min_t(size_t, len, PAGE_SIZE - offset);
+        struct page* page = kmmap_region_page(region, pos >> PAGE_SHIFT);
+
+        if(!page)
+        {
+            return -ENOMEM;
+        }
+
+        if(copy_from_user(page_address(page) + offset, u_buffer, chunk) != 0)
+        {
+            return -EFAULT;
+        }
+
+        u_buffer += chunk;
+        pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * \brief Format a SPSC ring at the beginning of a region.
+ *
+ * The header takes the first page, the data area follows. Both sides must
+ * not be using the ring while it is formatted.
+ * \param region region.
+ * \param data_size size of the data area, 0 for the largest possible.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kmmap_ring_format(struct kmmap_region* region, uint64_t data_size)
+{
+    struct kmmap_ring_header* header = NULL;
+    struct page* page = NULL;
+    uint64_t available = (uint64_t)(region->nr_pages - 1) << PAGE_SHIFT;
+
+    BUILD_BUG_ON(sizeof(struct kmmap_ring_header) != 192);
+
+    if(region->nr_pages < 2)
+    {
+        return -ENOSPC;
+    }
+
+    if(data_size == 0)
+    {
+        data_size = rounddown_pow_of_two(available);
+    }
+
+    if(!is_power_of_2(data_size) || data_size < PAGE_SIZE ||
+            data_size > available)
+    {
+        return -EINVAL;
+    }
+
+    page = kmmap_region_page(region, 0);
+    if(!page)
+    {
+        return -ENOMEM;
+    }
+
+    header = page_address(page);
+    memset(header, 0x00, sizeof(struct kmmap_ring_header));
+    header->version = 1;
+    header->data_offset = PAGE_SIZE;
+    header->data_size = data_size;
+
+    /* layout visible before the ring is seen as formatted */
+    smp_store_release(&header->magic, KMMAP_RING_MAGIC);
+    return 0;
+}
+
+/**
+ * \brief Format a MPMC queue at the beginning of a region.
+ *
+ * The header takes the first page, the slots follow. Nobody must be using
+ * the queue while it is formatted.
+ * \param region region.
+ * \param init geometry of the queue.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kmmap_mpmc_format(struct kmmap_region* region,
+        const struct kmmap_mpmc_init* init)
+{
+    struct kmmap_mpmc_header* header = NULL;
+    struct page* page = NULL;
+    uint64_t available = (uint64_t)(region->nr_pages - 1) << PAGE_SHIFT;
+    uint64_t nr_slots = init->nr_slots;
+    uint64_t slot_size = init->slot_size;
+    uint64_t i = 0;
+
+    BUILD_BUG_ON(sizeof(struct kmmap_mpmc_header) != 192);
+
+    if(region->nr_pages < 2 || init->reserved != 0 ||
+            !is_power_of_2(slot_size) || slot_size < 32 ||
+            slot_size > available)
+    {
+        return -EINVAL;
+    }
+
+    if(nr_slots == 0)
+    {
+        nr_slots = rounddown_pow_of_two(div64_u64(available, slot_size));
+    }
+
+    if(!is_power_of_2(nr_slots) || nr_slots < 2 ||
+            nr_slots > div64_u64(available, slot_size))
+    {
+        return -EINVAL;
+    }
+
+    page = kmmap_region_page(region, 0);
+    if(!page)
+    {
+        return -ENOMEM;
+    }
+
+    /* not seen as formatted while slots are written */
+    header = page_address(page);
+    WRITE_ONCE(header->magic, 0);
+
+    for(i = 0; i < nr_slots; i++)
+    {
+        /* slot size is a power of two, a slot header never crosses a page */
+        uint64_t offset = PAGE_SIZE + i * slot_size;
+        struct kmmap_mpmc_slot* slot = NULL;
+
+        page = kmmap_region_page(region, offset >> PAGE_SHIFT);
+        if(!page)
+        {
+            return -ENOMEM;
+        }
+
+        slot = page_address(page) + offset_in_page(offset);
+        slot->sequence = i;
+        slot->len = 0;
+    }
+
+    memset(header, 0x00, sizeof(struct kmmap_mpmc_header));
+    header->version = 1;
+    header->slots_offset = PAGE_SIZE;
+    header->nr_slots = nr_slots;
+    header->slot_size = slot_size;
+
+    /* layout and slots visible before the queue is seen as formatted */
+    smp_store_release(&header->magic, KMMAP_MPMC_MAGIC);
+    return 0;
+}
+
+/**
+ * \brief Get the ring header of a region.
+ * \param region region.
+ * \return header, or NULL if no ring is formatted.
+ */
+static struct kmmap_ring_header* kmmap_ring_header_get(
+        struct kmmap_region* region)
+{
+    struct page* page = smp_load_acquire(&region->pages[0]);
+    struct kmmap_ring_header* header = NULL;
+
+    if(!page)
+    {
+        return NULL;
+    }
+
+    header = page_address(page);
+    return smp_load_acquire(&header->magic) == KMMAP_RING_MAGIC ? header :
+        NULL;
+}
+
+/**
+ * \brief Wake up the consumer of a region.
+ *
+ * Called when the producer sees KMMAP_RING_NEED_WAKEUP.
+ * \param region region.
+ */
+static void kmmap_region_kick(struct kmmap_region* region)
+{
+    wake_up_interruptible_poll(&region->wait, EPOLLIN | EPOLLRDNORM);
+
+    spin_lock(&region->lock);
+    if(region->eventfd)
+    {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+        eventfd_signal(region->eventfd);
+#else
+        eventfd_signal(region->eventfd, 1);
+#endif
+    }
+    spin_unlock(&region->lock);
+}
+
+/**
+ * \brief Register the eventfd signaled on kick.
+ * \param region region.
+ * \param filep file that registers it.
+ * \param fd eventfd, negative value to unregister.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kmmap_region_set_eventfd(struct kmmap_region* region,
+        struct file* filep, int fd)
+{
+    struct eventfd_ctx* ctx = NULL;
+    struct eventfd_ctx* old = NULL;
+
+    if(fd >= 0)
+    {
+        ctx = eventfd_ctx_fdget(fd);
+        if(IS_ERR(ctx))
+        {
+            return PTR_ERR(ctx);
+        }
+    }
+
+    spin_lock(&region->lock);
+    old = region->eventfd;
+    region->eventfd = ctx;
+    region->eventfd_owner = ctx ? filep : NULL;
+    spin_unlock(&region->lock);
+
+    if(old)
+    {
+        eventfd_ctx_put(old);
+    }
+    return 0;
+}
+
+/**
+ * \brief Check if a ring holds records.
+ * \param header ring header.
+ * \return true if readable.
+ */
+static bool kmmap_ring_readable(struct kmmap_ring_header* header)
+{
+    return smp_load_acquire(&header->head) != READ_ONCE(header->tail);
+}
+
+/**
+ * \brief Wake up poll() waiters (irq_work callback).
+ * \param work work.
+ */
+static void kmmap_percpu_wakeup(struct irq_work* work)
+{
+    wake_up_interruptible_poll(&g_percpu_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+int kmmap_percpu_emit(const void* data, uint32_t len)
+{
+    struct kmmap_percpu* percpu = NULL;
+    struct kmmap_ring_header* header = NULL;
+    struct kmmap_ring_record* record = NULL;
+    u64 total = ALIGN(sizeof(struct kmmap_ring_record) + (u64)len,
+            KMMAP_RING_ALIGN);
+    u64 offset = 0;
+    u64 end = 0;
+    u64 needed = 0;
+    u64 tail = 0;
+    unsigned long flags = 0;
+    int ret = 0;
+
+    if(!g_percpu)
+    {
+        return -ENODEV;
+    }
+
+    /* the ring of a CPU has a single producer once interrupts are off */
+    local_irq_save(flags);
+    percpu = this_cpu_ptr(g_percpu);
+    header = percpu->header;
+
+    if(total > percpu->size / 2)
+    {
+        ret = -EMSGSIZE;
+        goto out;
+    }
+
+    offset = percpu->head & (percpu->size - 1);
+    end = percpu->size - offset;
+    needed = total > end ? end + total : total;
+
+    /* tail comes from userspace, a bogus value only makes the ring full */
+    tail = smp_load_acquire(&header->tail);
+    if(percpu->head - tail > percpu->size ||
+            percpu->head + needed - tail > percpu->size)
+    {
+        WRITE_ONCE(header->lost, ++percpu->lost);
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    if(total > end)
+    {
+        /* fill the end of the data area, record goes at the beginning */
+        record = (struct kmmap_ring_record*)(percpu->data + offset);
+        record->len = end - sizeof(struct kmmap_ring_record);
+        record->flags = KMMAP_RING_PAD;
+        percpu->head += end;
+        offset = 0;
+    }
+
+    record = (struct kmmap_ring_record*)(percpu->data + offset);
+    record->len = len;
+    record->flags = 0;
+    memcpy(record + 1, data, len);
+
+    percpu->head += total;
+    smp_store_release(&header->head, percpu->head);
+
+    /* order the store of head with the load of flags */
+    smp_mb();
+    if(READ_ONCE(header->flags) & KMMAP_RING_NEED_WAKEUP)
+    {
+        irq_work_queue(&g_percpu_wakeup);
+    }
+
+out:
+    local_irq_restore(flags);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(kmmap_percpu_emit);
+
+/**
+ * \brief Demo producer, emits a record on its CPU.
+ * \param timer timer.
+ */
+static void kmmap_percpu_timer(struct timer_list* timer)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,16,0)
+    struct kmmap_percpu* percpu = timer_container_of(percpu, timer, timer);
+#else
+    struct kmmap_percpu* percpu = from_timer(percpu, timer, timer);
+#endif
+    struct kmmap_timer_event event = {
+        .timestamp = ktime_get_ns(),
+        .cpu = smp_processor_id(),
+        .seq = percpu->seq++,
+    };
+
+    kmmap_percpu_emit(&event, sizeof(event));
+    mod_timer(timer, jiffies + msecs_to_jiffies(percpu_timer_ms));
+}
+
+/**
+ * \brief Release the per-CPU rings.
+ */
+static void kmmap_percpu_destroy(void)
+{
+    int cpu = 0;
+
+    if(!g_percpu)
+    {
+        return;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        struct kmmap_percpu* percpu = per_cpu_ptr(g_percpu, cpu);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,2,0)
+        timer_delete_sync(&percpu->timer);
+#else
+        del_timer_sync(&percpu->timer);
+#endif
+    }
+    irq_work_sync(&g_percpu_wakeup);
+
+    for_each_possible_cpu(cpu)
+    {
+        struct kmmap_percpu* percpu = per_cpu_ptr(g_percpu, cpu);
+
+        if(percpu->header)
+        {
+            vunmap(percpu->header);
+        }
+        if(percpu->region.pages)
+        {
+            kmmap_region_destroy(&percpu->region);
+        }
+    }
+
+    free_percpu(g_percpu);
+    g_percpu = NULL;
+}
+
+/**
+ * \brief Allocate and format the per-CPU rings.
+ *
+ * Pages are allocated upfront and mapped contiguously in the kernel, kernel
+ * producers can run where allocation is not possible.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kmmap_percpu_init(void)
+{
+    u64 data_size = roundup_pow_of_two(max_t(unsigned long, percpu_size,
+                PAGE_SIZE));
+    size_t nr_pages = 1 + (data_size >> PAGE_SHIFT);
+    int cpu = 0;
+    int ret = 0;
+
+    init_irq_work(&g_percpu_wakeup, kmmap_percpu_wakeup);
+
+    g_percpu = alloc_percpu(struct kmmap_percpu);
+    if(!g_percpu)
+    {
+        return -ENOMEM;
+    }
+    g_percpu_nr_pages = nr_pages;
+
+    for_each_possible_cpu(cpu)
+    {
+        timer_setup(&per_cpu_ptr(g_percpu, cpu)->timer, kmmap_percpu_timer,
+                TIMER_PINNED);
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        struct kmmap_percpu* percpu = per_cpu_ptr(g_percpu, cpu);
+        size_t i = 0;
+
+        ret = kmmap_region_init(&percpu->region, nr_pages);
+        if(ret != 0)
+        {
+            goto err;
+        }
+        percpu->region.pgoff = (KMMAP_PERCPU_OFFSET >> PAGE_SHIFT) +
+            cpu * nr_pages;
+        /* memory of the producers of this CPU, not of the insmod task */
+        percpu->region.node = cpu_to_node(cpu);
+
+        for(i = 0; i < nr_pages; i++)
+        {
+            if(!kmmap_region_page(&percpu->region, i))
+            {
+                ret = -ENOMEM;
+                goto err;
+            }
+        }
+
+        ret = kmmap_ring_format(&percpu->region, data_size);
+        if(ret != 0)
+        {
+            goto err;
+        }
+
+        percpu->header = vmap(percpu->region.pages, nr_pages, VM_MAP,
+                PAGE_KERNEL);
+        if(!percpu->header)
+        {
+            ret = -ENOMEM;
+            goto err;
+        }
+        percpu->data = (u8*)percpu->header + PAGE_SIZE;
+        percpu->size = data_size;
+    }
+
+    if(percpu_timer_ms != 0)
+    {
+        /* CPUs that come online later have no demo producer */
+        for_each_online_cpu(cpu)
+        {
+            struct kmmap_percpu* percpu = per_cpu_ptr(g_percpu, cpu);
+
+            percpu->timer.expires = jiffies +
+                msecs_to_jiffies(percpu_timer_ms);
+            add_timer_on(&percpu->timer, cpu);
+        }
+    }
+    return 0;
+
+err:
+    kmmap_percpu_destroy();
+    return ret;
+}
+
+/**
+ * \brief Get a reference on the memory shared by all files, create it if
+ * needed.
+ * \return region, or NULL if out of memory.
+ */
+static struct kmmap_region* kmmap_shared_get(void)
+{
+    struct kmmap_region* region = NULL;
+
+    mutex_lock(&g_shared_lock);
+    if(!g_shared)
+    {
+        /* kept until module is removed, data outlives the files */
+        g_shared = kmmap_region_create();
+    }
+
+    region = g_shared;
+    if(region)
+    {
+        kref_get(&region->refcount);
+    }
+    mutex_unlock(&g_shared_lock);
+    return region;
+}
+
+/**
+ * \brief Make a file use the memory shared by all files.
+ * \param filep file.
+ * \return 0 if success, negative value otherwise (-EBUSY if the file already
+ * has its own memory).
+ */
+static int kmmap_file_share(struct file* filep)
+{
+    struct kmmap_file* kfile = filep->private_data;
+    struct kmmap_region* region = NULL;
+    int ret = 0;
+
+    mutex_lock(&kfile->lock);
+    if(kfile->region)
+    {
+        ret = kfile->region == READ_ONCE(g_shared) ? 0 : -EBUSY;
+    }
+    else
+    {
+        region = kmmap_shared_get();
+        if(region)
+        {
+            /* region initialized before lockless readers find it */
+            smp_store_release(&kfile->region, region);
+        }
+        else
+        {
+            ret = -ENOMEM;
+        }
+    }
+    mutex_unlock(&kfile->lock);
+    return ret;
+}
+
+/**
+ * \brief Get the region of a file.
+ * \param filep file.
+ * \param create allocate the region if the file has none yet.
+ * \return region, or NULL if none (or out of memory when create is set).
+ */
+static struct kmmap_region* kmmap_file_region(struct file* filep,
+        bool create)
+{
+    struct kmmap_file* kfile = filep->private_data;
+    struct kmmap_region* region = smp_load_acquire(&kfile->region);
+
+    if(region || !create)
+    {
+        return region;
+    }
+
+    mutex_lock(&kfile->lock);
+    region = kfile->region;
+    if(!region)
+    {
+        region = shared ? kmmap_shared_get() : kmmap_region_create();
+
+        if(region)
+        {
+            /* region initialized before lockless readers find it */
+            smp_store_release(&kfile->region, region);
+        }
+    }
+    mutex_unlock(&kfile->lock);
+    return region;
+}
+
+/**
+ * \brief Find the region mapped at an offset of the device.
+ * \param filep file.
+ * \param pgoff offset in pages.
+ * \return region, or NULL if none.
  */
-static struct miscdevice kmmap_misc = {
-    .minor = MISC_DYNAMIC_MINOR,
-    .name  = THIS_MODULE->name,
-    .fops  = &fops,
-};
+static struct kmmap_region* kmmap_region_find(struct file* filep,
+        unsigned long pgoff)
+{
+    unsigned long base = KMMAP_PERCPU_OFFSET >> PAGE_SHIFT;
+    unsigned long cpu = 0;
+
+    if(pgoff < base)
+    {
+        return kmmap_file_region(filep, true);
+    }
+
+    if(!g_percpu)
+    {
+        return NULL;
+    }
+
+    cpu = (pgoff - base) / g_percpu_nr_pages;
+    if(cpu >= nr_cpu_ids || !cpu_possible(cpu))
+    {
+        return NULL;
+    }
+    return &per_cpu_ptr(g_percpu, cpu)->region;
+}
 
 /**
  * \brief Open callback for character device.
@@ -87,13 +1276,19 @@ static struct miscdevice kmmap_misc = {
  */
 static int kmmap_open(struct inode* inodep, struct file* filep)
 {
-    if(!mutex_trylock(&mutex_mmap))
+    struct kmmap_file* kfile = kzalloc(sizeof(struct kmmap_file), GFP_KERNEL);
+
+    if(!kfile)
     {
-        printk(KERN_ALERT "%s: mutex already locked!\n", THIS_MODULE->name);
-        return -EBUSY;
+        return -ENOMEM;
     }
-    g_number_open++;
-    printk(KERN_INFO "%s: open (%zu)\n", THIS_MODULE->name, g_number_open);
+
+    /* region is allocated on first use */
+    mutex_init(&kfile->lock);
+    filep->private_data = kfile;
+
+    printk(KERN_INFO "%s: open (%d)\n", THIS_MODULE->name,
+            atomic_inc_return(&g_number_open));
     return 0;
 }
 
@@ -105,9 +1300,26 @@ static int kmmap_open(struct inode* inodep, struct file* filep)
  */
 static int kmmap_release(struct inode* inodep, struct file* filep)
 {
-    g_number_open--;
-    printk(KERN_INFO "%s: release (%zu)\n", THIS_MODULE->name, g_number_open);
-    mutex_unlock(&mutex_mmap);
+    struct kmmap_file* kfile = filep->private_data;
+    struct kmmap_region* region = kfile->region;
+
+    printk(KERN_INFO "%s: release (%d)\n", THIS_MODULE->name,
+            atomic_dec_return(&g_number_open));
+
+    if(region)
+    {
+        /* eventfd belongs to the file that is going away */
+        if(READ_ONCE(region->eventfd_owner) == filep)
+        {
+            kmmap_region_set_eventfd(region, filep, -1);
+        }
+
+        /* mappings keep their own reference */
+        kmmap_region_put(region);
+    }
+
+    mutex_destroy(&kfile->lock);
+    kfree(kfile);
     return 0;
 }
 
@@ -122,14 +1334,21 @@ static int kmmap_release(struct inode* inodep, struct file* filep)
 static ssize_t kmmap_read(struct file* filep, char* u_buffer, size_t len,
         loff_t* offset)
 {
+    struct kmmap_region* region = kmmap_file_region(filep, false);
     int err = 0;
     ssize_t len_msg = 0;
 
     printk(KERN_INFO "%s: wants to read %zu bytes from offset %lld\n",
             THIS_MODULE->name, len, *offset);
 
+    if(!region)
+    {
+        /* nothing written yet */
+        return 0;
+    }
+
     /* calculate buffer size left to copy */
-    len_msg = g_message_size - *offset;
+    len_msg = region->message_size - *offset;
 
     if(len_msg == 0)
     {
@@ -145,7 +1364,7 @@ static ssize_t kmmap_read(struct file* filep, char* u_buffer, size_t len,
         return -EINVAL;
     }
 
-    err = copy_to_user(u_buffer, g_message + *offset, len_msg);
+    err = kmmap_region_read(region, u_buffer, len_msg, *offset);
 
     if(err == 0)
     {
@@ -160,7 +1379,7 @@ static ssize_t kmmap_read(struct file* filep, char* u_buffer, size_t len,
     {
         printk(KERN_DEBUG "%s: failed to send %zu characters to user\n",
                 THIS_MODULE->name, len_msg);
-        return -EFAULT;
+        return err;
     }
 }
 
@@ -175,28 +1394,36 @@ static ssize_t kmmap_read(struct file* filep, char* u_buffer, size_t len,
 static ssize_t kmmap_write(struct file* filep, const char* u_buffer,
         size_t len, loff_t* offset)
 {
+    struct kmmap_region* region = kmmap_file_region(filep, true);
     ssize_t len_msg = len + *offset;
+    int err = 0;
 
     printk(KERN_INFO "%s: wants to write %zu bytes from %lld offset\n",
             THIS_MODULE->name, len, *offset);
 
-    if(len_msg > MSG_SIZE)
+    if(!region)
+    {
+        return -ENOMEM;
+    }
+
+    if(*offset < 0 || len_msg > (region->nr_pages << PAGE_SHIFT))
     {
         return -EFBIG;
     }
 
-    if(copy_from_user(g_message + *offset, u_buffer, len) != 0)
+    err = kmmap_region_write(region, u_buffer, len, *offset);
+    if(err != 0)
     {
-        g_message_size = 0;
-        return -EFAULT;
+        region->message_size = 0;
+        return err;
     }
 
     if(*offset == 0)
     {
-        g_message_size = 0;
+        region->message_size = 0;
     }
     
-    g_message_size += len;
+    region->message_size += len;
     *offset += len;
 
     printk(KERN_INFO "%s: received %zu characters from user\n", THIS_MODULE->name,
@@ -205,29 +1432,652 @@ static ssize_t kmmap_write(struct file* filep, const char* u_buffer,
 }
 
 /**
- * \brief Write callback for character device.
- * \param vma virtual memory area. 
+ * \brief Open callback for a mapping of the device (split or fork).
+ * \param vma virtual memory area.
+ */
+static void kmmap_vm_open(struct vm_area_struct* vma)
+{
+    struct kmmap_region* region = vma->vm_private_data;
+
+    kref_get(&region->refcount);
+}
+
+/**
+ * \brief Close callback for a mapping of the device.
+ *
+ * The region is freed when the last mapping and the file are gone.
+ * \param vma virtual memory area.
+ */
+static void kmmap_vm_close(struct vm_area_struct* vma)
+{
+    kmmap_region_put(vma->vm_private_data);
+}
+
+/**
+ * \brief Page fault callback for a mapping of the device.
+ *
+ * Pages are allocated on first access.
+ * \param vmf fault information.
+ * \return 0 if success, VM_FAULT_* error otherwise.
+ */
+static vm_fault_t kmmap_vm_fault(struct vm_fault* vmf)
+{
+    struct kmmap_region* region = vmf->vma->vm_private_data;
+    unsigned long index = vmf->pgoff - region->pgoff;
+    struct page* page = NULL;
+
+    if(index >= region->nr_pages)
+    {
+        return VM_FAULT_SIGBUS;
+    }
+
+    page = kmmap_region_page(region, index);
+    if(!page)
+    {
+        return VM_FAULT_OOM;
+    }
+
+    /* reference for the page table */
+    get_page(page);
+    vmf->page = page;
+    return 0;
+}
+
+#ifdef KMMAP_HUGE_PAGES
+/**
+ * \brief Huge page fault callback for a mapping of the device.
+ *
+ * The core only calls it for PMD-aligned ranges of the mapping, falling back
+ * to kmmap_vm_fault() makes the chunk use small pages.
+ * \param vmf fault information.
+ * \param order order of the mapping requested.
+ * \return VM_FAULT_NOPAGE if success, VM_FAULT_FALLBACK or error otherwise.
+ */
+static vm_fault_t kmmap_vm_huge_fault(struct vm_fault* vmf,
+        unsigned int order)
+{
+    struct kmmap_region* region = vmf->vma->vm_private_data;
+    size_t start = round_down(vmf->pgoff - region->pgoff, HPAGE_PMD_NR);
+    struct page* page = NULL;
+    vm_fault_t ret = 0;
+
+    /* private mappings keep small pages for copy-on-write */
+    if(order != HPAGE_PMD_ORDER || !region->huge ||
+            !(vmf->vma->vm_flags & VM_SHARED) ||
+            region->pgoff % HPAGE_PMD_NR != 0 ||
+            start + HPAGE_PMD_NR > region->nr_pages)
+    {
+        return VM_FAULT_FALLBACK;
+    }
+
+    page = kmmap_region_huge_page(region, start);
+    if(!page)
+    {
+        return VM_FAULT_FALLBACK;
+    }
+
+    ret = vmf_insert_folio_pmd(vmf, page_folio(page),
+            vmf->flags & FAULT_FLAG_WRITE);
+    if(ret == VM_FAULT_NOPAGE)
+    {
+        atomic_long_inc(&region->huge_mappings);
+    }
+    return ret;
+}
+#endif
+
+/**
+ * \brief Operations for a mapping of the device.
+ */
+static const struct vm_operations_struct kmmap_vm_ops = {
+    .open = kmmap_vm_open,
+    .close = kmmap_vm_close,
+    .fault = kmmap_vm_fault,
+#ifdef KMMAP_HUGE_PAGES
+    .huge_fault = kmmap_vm_huge_fault,
+#endif
+};
+
+/**
+ * \brief Mmap callback for character device.
+ *
+ * Pages of the shared memory are mapped by the page fault handler, without
+ * copy. The region of the file is allocated on first mmap.
+ * \param filep file.
+ * \param vma virtual memory area.
  * \return 0 if success, negative value otherwise.
  */
 static int kmmap_mmap(struct file* filep, struct vm_area_struct* vma)
 {
-    int ret = 0;
+    struct kmmap_region* region = kmmap_region_find(filep, vma->vm_pgoff);
+    unsigned long index = 0;
+
+    printk(KERN_INFO "%s: mmap %lu bytes at page %lu\n", THIS_MODULE->name,
+            vma->vm_end - vma->vm_start, vma->vm_pgoff);
+
+    if(!region)
+    {
+        return -ENXIO;
+    }
 
-    printk(KERN_INFO "%s: %zu\n", THIS_MODULE->name, (vma->vm_end - vma->vm_start));
-    if((unsigned long)(vma->vm_end - vma->vm_start) > MSG_SIZE)
+    /* a mapping does not cross regions */
+    index = vma->vm_pgoff - region->pgoff;
+    if(index >= region->nr_pages ||
+            vma_pages(vma) > region->nr_pages - index)
     {
         return -EINVAL;
     }
 
-    ret = remap_pfn_range(vma, (unsigned long)vma->vm_start,
-            virt_to_phys(g_message) >> PAGE_SHIFT, vma->vm_end - vma->vm_start,
-            vma->vm_page_prot);
+    /* reference of the mapping, dropped by kmmap_vm_close() */
+    kref_get(&region->refcount);
+    vma->vm_private_data = region;
+    vma->vm_ops = &kmmap_vm_ops;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+
+#ifdef KMMAP_HUGE_PAGES
+    if(region->huge)
+    {
+        /* eligible for huge_fault even when THP is in madvise mode */
+        vm_flags_set(vma, VM_HUGEPAGE);
+    }
+#endif
+    return 0;
+}
+
+#ifdef KMMAP_DMA_BUF
+/**
+ * \brief Attach callback of a dma-buf.
+ * \param dmabuf dma-buf.
+ * \param attach attachment.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kmmap_dmabuf_attach(struct dma_buf* dmabuf,
+        struct dma_buf_attachment* attach)
+{
+    struct kmmap_dmabuf* kbuf = dmabuf->priv;
+    struct kmmap_dmabuf_attachment* katt = kzalloc(
+            sizeof(struct kmmap_dmabuf_attachment), GFP_KERNEL);
+
+    if(!katt)
+    {
+        return -ENOMEM;
+    }
+
+    katt->dev = attach->dev;
+    katt->dir = DMA_NONE;
+    attach->priv = katt;
+
+    mutex_lock(&kbuf->lock);
+    list_add(&katt->node, &kbuf->attachments);
+    mutex_unlock(&kbuf->lock);
+    return 0;
+}
+
+/**
+ * \brief Detach callback of a dma-buf.
+ * \param dmabuf dma-buf.
+ * \param attach attachment.
+ */
+static void kmmap_dmabuf_detach(struct dma_buf* dmabuf,
+        struct dma_buf_attachment* attach)
+{
+    struct kmmap_dmabuf* kbuf = dmabuf->priv;
+    struct kmmap_dmabuf_attachment* katt = attach->priv;
+
+    mutex_lock(&kbuf->lock);
+    list_del(&katt->node);
+    mutex_unlock(&kbuf->lock);
+    kfree(katt);
+}
+
+/**
+ * \brief Map a dma-buf for the device of an attachment.
+ * \param attach attachment.
+ * \param dir direction.
+ * \return scatter-gather table, or ERR_PTR.
+ */
+static struct sg_table* kmmap_dmabuf_map(struct dma_buf_attachment* attach,
+        enum dma_data_direction dir)
+{
+    struct kmmap_dmabuf* kbuf = attach->dmabuf->priv;
+    struct kmmap_dmabuf_attachment* katt = attach->priv;
+    struct kmmap_region* region = kbuf->region;
+    struct sg_table* sgt = kzalloc(sizeof(struct sg_table), GFP_KERNEL);
+    int ret = 0;
+
+    if(!sgt)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    /* all pages were allocated at export */
+    ret = sg_alloc_table_from_pages(sgt, region->pages, region->nr_pages, 0,
+            region->nr_pages << PAGE_SHIFT, GFP_KERNEL);
+    if(ret != 0)
+    {
+        kfree(sgt);
+        return ERR_PTR(ret);
+    }
 
+    ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
     if(ret != 0)
     {
-        return -EAGAIN;
+        sg_free_table(sgt);
+        kfree(sgt);
+        return ERR_PTR(ret);
+    }
+
+    mutex_lock(&kbuf->lock);
+    katt->sgt = sgt;
+    katt->dir = dir;
+    mutex_unlock(&kbuf->lock);
+    return sgt;
+}
+
+/**
+ * \brief Unmap a dma-buf for the device of an attachment.
+ * \param attach attachment.
+ * \param sgt scatter-gather table.
+ * \param dir direction.
+ */
+static void kmmap_dmabuf_unmap(struct dma_buf_attachment* attach,
+        struct sg_table* sgt, enum dma_data_direction dir)
+{
+    struct kmmap_dmabuf* kbuf = attach->dmabuf->priv;
+    struct kmmap_dmabuf_attachment* katt = attach->priv;
+
+    mutex_lock(&kbuf->lock);
+    katt->sgt = NULL;
+    katt->dir = DMA_NONE;
+    mutex_unlock(&kbuf->lock);
+
+    dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+/**
+ * \brief Prepare CPU access to a dma-buf (DMA_BUF_SYNC_START).
+ *
+ * Make the writes of the devices visible to the CPU.
+ * \param dmabuf dma-buf.
+ * \param dir direction.
+ * \return 0.
+ */
+static int kmmap_dmabuf_begin_cpu_access(struct dma_buf* dmabuf,
+        enum dma_data_direction dir)
+{
+    struct kmmap_dmabuf* kbuf = dmabuf->priv;
+    struct kmmap_dmabuf_attachment* katt = NULL;
+
+    mutex_lock(&kbuf->lock);
+    list_for_each_entry(katt, &kbuf->attachments, node)
+    {
+        if(katt->sgt)
+        {
+            dma_sync_sgtable_for_cpu(katt->dev, katt->sgt, katt->dir);
+        }
+    }
+    mutex_unlock(&kbuf->lock);
+    return 0;
+}
+
+/**
+ * \brief Finish CPU access to a dma-buf (DMA_BUF_SYNC_END).
+ *
+ * Make the writes of the CPU visible to the devices.
+ * \param dmabuf dma-buf.
+ * \param dir direction.
+ * \return 0.
+ */
+static int kmmap_dmabuf_end_cpu_access(struct dma_buf* dmabuf,
+        enum dma_data_direction dir)
+{
+    struct kmmap_dmabuf* kbuf = dmabuf->priv;
+    struct kmmap_dmabuf_attachment* katt = NULL;
+
+    mutex_lock(&kbuf->lock);
+    list_for_each_entry(katt, &kbuf->attachments, node)
+    {
+        if(katt->sgt)
+        {
+            dma_sync_sgtable_for_device(katt->dev, katt->sgt, katt->dir);
+        }
+    }
+    mutex_unlock(&kbuf->lock);
+    return 0;
+}
+
+/**
+ * \brief Mmap callback of a dma-buf.
+ *
+ * Same mapping as the device, offset 0 is the start of the memory.
+ * \param dmabuf dma-buf.
+ * \param vma virtual memory area.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kmmap_dmabuf_mmap(struct dma_buf* dmabuf,
+        struct vm_area_struct* vma)
+{
+    struct kmmap_dmabuf* kbuf = dmabuf->priv;
+    struct kmmap_region* region = kbuf->region;
+
+    if(vma->vm_pgoff >= region->nr_pages ||
+            vma_pages(vma) > region->nr_pages - vma->vm_pgoff)
+    {
+        return -EINVAL;
+    }
+
+    kref_get(&region->refcount);
+    vma->vm_private_data = region;
+    vma->vm_ops = &kmmap_vm_ops;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+    return 0;
+}
+
+/**
+ * \brief Release callback of a dma-buf, when its last reference is gone.
+ * \param dmabuf dma-buf.
+ */
+static void kmmap_dmabuf_release(struct dma_buf* dmabuf)
+{
+    struct kmmap_dmabuf* kbuf = dmabuf->priv;
+
+    kmmap_region_put(kbuf->region);
+    mutex_destroy(&kbuf->lock);
+    kfree(kbuf);
+}
+
+/**
+ * \brief Operations of an exported dma-buf.
+ */
+static const struct dma_buf_ops kmmap_dmabuf_ops = {
+    .attach = kmmap_dmabuf_attach,
+    .detach = kmmap_dmabuf_detach,
+    .map_dma_buf = kmmap_dmabuf_map,
+    .unmap_dma_buf = kmmap_dmabuf_unmap,
+    .begin_cpu_access = kmmap_dmabuf_begin_cpu_access,
+    .end_cpu_access = kmmap_dmabuf_end_cpu_access,
+    .mmap = kmmap_dmabuf_mmap,
+    .release = kmmap_dmabuf_release,
+};
+
+/**
+ * \brief Export a region as a dma-buf.
+ *
+ * The caller installs the file of the dma-buf in an fd, or drops it with
+ * dma_buf_put().
+ * \param region region.
+ * \param flags flags of the dma-buf file (O_RDWR).
+ * \return dma-buf if success, ERR_PTR() otherwise.
+ */
+static struct dma_buf* kmmap_region_export(struct kmmap_region* region,
+        uint32_t flags)
+{
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct kmmap_dmabuf* kbuf = NULL;
+    struct dma_buf* dmabuf = NULL;
+    size_t i = 0;
+
+    /* devices need every page, not only the ones touched so far */
+    for(i = 0; i < region->nr_pages; i++)
+    {
+        if(!kmmap_region_page(region, i))
+        {
+            return ERR_PTR(-ENOMEM);
+        }
+    }
+
+    kbuf = kzalloc(sizeof(struct kmmap_dmabuf), GFP_KERNEL);
+    if(!kbuf)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    mutex_init(&kbuf->lock);
+    INIT_LIST_HEAD(&kbuf->attachments);
+    kref_get(&region->refcount);
+    kbuf->region = region;
+
+    exp_info.ops = &kmmap_dmabuf_ops;
+    exp_info.size = region->nr_pages << PAGE_SHIFT;
+    exp_info.flags = flags & O_ACCMODE;
+    exp_info.priv = kbuf;
+
+    dmabuf = dma_buf_export(&exp_info);
+    if(IS_ERR(dmabuf))
+    {
+        kmmap_region_put(region);
+        mutex_destroy(&kbuf->lock);
+        kfree(kbuf);
+    }
+    return dmabuf;
+}
+#endif
+
+/**
+ * \brief Ioctl callback for character device.
+ * \param filep file.
+ * \param cmd command to pass.
+ * \param arg argument.
+ * \return 0 if success, negative number if error.
+ */
+static long kmmap_ioctl(struct file* filep, unsigned int cmd,
+        unsigned long arg)
+{
+    struct kmmap_region* region = NULL;
+    uint64_t value = 0;
+    int32_t fd = -1;
+    struct kmmap_percpu_info info;
+    int32_t node = NUMA_NO_NODE;
+    struct kmmap_mpmc_init mpmc;
+#ifdef KMMAP_DMA_BUF
+    struct kmmap_export exp;
+    struct dma_buf* dmabuf = NULL;
+#endif
+
+    if(_IOC_TYPE(cmd) != KMMAP_IOCTL_MAGIC)
+    {
+        return -ENOTTY;
+    }
+
+    switch(_IOC_NR(cmd))
+    {
+    case KMMAP_GET_SIZE:
+        value = (uint64_t)DIV_ROUND_UP(buffer_size, PAGE_SIZE) << PAGE_SHIFT;
+        if(copy_to_user((void*)arg, &value, sizeof(value)) != 0)
+        {
+            return -EFAULT;
+        }
+        break;
+    case KMMAP_RING_INIT:
+        if(copy_from_user(&value, (void*)arg, sizeof(value)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        region = kmmap_file_region(filep, true);
+        if(!region)
+        {
+            return -ENOMEM;
+        }
+        return kmmap_ring_format(region, value);
+    case KMMAP_SET_EVENTFD:
+        if(copy_from_user(&fd, (void*)arg, sizeof(fd)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        region = kmmap_file_region(filep, true);
+        if(!region)
+        {
+            return -ENOMEM;
+        }
+        return kmmap_region_set_eventfd(region, filep, fd);
+    case KMMAP_KICK:
+        region = kmmap_file_region(filep, false);
+        if(region)
+        {
+            kmmap_region_kick(region);
+        }
+        break;
+    case KMMAP_GET_PERCPU:
+        if(!g_percpu)
+        {
+            return -ENODEV;
+        }
+
+        memset(&info, 0x00, sizeof(info));
+        info.nr_cpus = nr_cpu_ids;
+        info.offset = KMMAP_PERCPU_OFFSET;
+        info.size = (uint64_t)g_percpu_nr_pages << PAGE_SHIFT;
+        if(copy_to_user((void*)arg, &info, sizeof(info)) != 0)
+        {
+            return -EFAULT;
+        }
+        break;
+    case KMMAP_GET_HUGE:
+        region = kmmap_file_region(filep, false);
+        value = region ? atomic_long_read(&region->huge_mappings) : 0;
+        if(copy_to_user((void*)arg, &value, sizeof(value)) != 0)
+        {
+            return -EFAULT;
+        }
+        break;
+    case KMMAP_MPMC_INIT:
+        if(copy_from_user(&mpmc, (void*)arg, sizeof(mpmc)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        region = kmmap_file_region(filep, true);
+        if(!region)
+        {
+            return -ENOMEM;
+        }
+        return kmmap_mpmc_format(region, &mpmc);
+    case KMMAP_SET_NODE:
+        if(copy_from_user(&node, (void*)arg, sizeof(node)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        region = kmmap_file_region(filep, true);
+        if(!region)
+        {
+            return -ENOMEM;
+        }
+        return kmmap_region_set_node(region, node);
+    case KMMAP_GET_NODE:
+        region = kmmap_file_region(filep, false);
+        node = region ? READ_ONCE(region->node) : NUMA_NO_NODE;
+        if(copy_to_user((void*)arg, &node, sizeof(node)) != 0)
+        {
+            return -EFAULT;
+        }
+        break;
+    case KMMAP_EXPORT:
+#ifdef KMMAP_DMA_BUF
+        if(copy_from_user(&exp, (void*)arg, sizeof(exp)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        if(exp.flags & ~(O_CLOEXEC | O_ACCMODE))
+        {
+            return -EINVAL;
+        }
+
+        region = kmmap_file_region(filep, true);
+        if(!region)
+        {
+            return -ENOMEM;
+        }
+
+        /* fd is installed only once the process knows its number */
+        exp.fd = get_unused_fd_flags(exp.flags & O_CLOEXEC);
+        if(exp.fd < 0)
+        {
+            return exp.fd;
+        }
+
+        dmabuf = kmmap_region_export(region, exp.flags & O_ACCMODE);
+        if(IS_ERR(dmabuf))
+        {
+            put_unused_fd(exp.fd);
+            return PTR_ERR(dmabuf);
+        }
+
+        if(copy_to_user((void*)arg, &exp, sizeof(exp)) != 0)
+        {
+            /* release callback drops the region */
+            put_unused_fd(exp.fd);
+            dma_buf_put(dmabuf);
+            return -EFAULT;
+        }
+        fd_install(exp.fd, dmabuf->file);
+        break;
+#else
+        return -EOPNOTSUPP;
+#endif
+    case KMMAP_SET_SHARED:
+        return kmmap_file_share(filep);
+    default:
+        return -ENOTTY;
+        break;
+    }
+    return 0;
+}
+
+/**
+ * \brief Poll callback for character device.
+ *
+ * Readable when the ring or one of the per-CPU rings holds records. The
+ * consumer sleeps here after it set KMMAP_RING_NEED_WAKEUP, the producer
+ * wakes it up with KMMAP_IOCKICK (or an irq_work for kernel producers).
+ * \param filep file.
+ * \param wait poll table.
+ * \return mask of events ready.
+ */
+static __poll_t kmmap_poll(struct file* filep, poll_table* wait)
+{
+    struct kmmap_region* region = kmmap_file_region(filep, false);
+    struct kmmap_ring_header* header = NULL;
+    int cpu = 0;
+
+    if(region)
+    {
+        poll_wait(filep, &region->wait, wait);
+
+        header = kmmap_ring_header_get(region);
+        if(header && kmmap_ring_readable(header))
+        {
+            return EPOLLIN | EPOLLRDNORM;
+        }
     }
 
+    if(g_percpu)
+    {
+        poll_wait(filep, &g_percpu_wait, wait);
+
+        for_each_possible_cpu(cpu)
+        {
+            if(kmmap_ring_readable(per_cpu_ptr(g_percpu, cpu)->header))
+            {
+                return EPOLLIN | EPOLLRDNORM;
+            }
+        }
+    }
     return 0;
 }
 
@@ -240,21 +2090,31 @@ static int kmmap_mmap(struct file* filep, struct vm_area_struct* vma)
 static int __init kmmap_init(void)
 {
     int ret = 0;
-    struct page* page = NULL;
 
     printk(KERN_INFO "%s: initialization\n", THIS_MODULE->name);
 
-    g_message = kzalloc(MSG_SIZE, GFP_KERNEL);
-    
-    if(!g_message)
+    if(buffer_size == 0 || buffer_size > KMMAP_PERCPU_OFFSET)
     {
-        return -ENOMEM;
+        return -EINVAL;
+    }
+
+    if(shared)
+    {
+        g_shared = kmmap_region_create();
+        if(!g_shared)
+        {
+            return -ENOMEM;
+        }
     }
 
-    /* reserved page in memory to not be swapped */
-    g_message[0] = 0x00;
-    page = virt_to_page(g_message);
-    SetPageReserved(page);
+    if(percpu_size != 0)
+    {
+        ret = kmmap_percpu_init();
+        if(ret != 0)
+        {
+            goto err;
+        }
+    }
 
     /* register device */
     ret = misc_register(&kmmap_misc);
@@ -262,12 +2122,16 @@ static int __init kmmap_init(void)
     if(ret == 0)
     {
         printk(KERN_INFO "%s: device created correctly\n", THIS_MODULE->name);
+        return 0;
     }
-    else
+
+    kmmap_percpu_destroy();
+err:
+    if(g_shared)
     {
-        kfree(g_message);
+        kmmap_region_put(g_shared);
+        g_shared = NULL;
     }
-
     return ret;
 }
 
@@ -278,11 +2142,13 @@ static int __init kmmap_init(void)
  */
 static void __exit kmmap_exit(void)
 {
-    mutex_destroy(&mutex_mmap);
     misc_deregister(&kmmap_misc);
 
-    ClearPageReserved(virt_to_page(g_message));
-    kzfree(g_message);
+    kmmap_percpu_destroy();
+    if(g_shared)
+    {
+        kmmap_region_put(g_shared);
+    }
 
     printk(KERN_INFO "%s: exit\n", THIS_MODULE->name);
 }
@@ -291,6 +2157,27 @@ static void __exit kmmap_exit(void)
 module_init(kmmap_init);
 module_exit(kmmap_exit);
 
+module_param(buffer_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(buffer_size, "Size in bytes of the shared memory");
+module_param(shared, bool, S_IRUGO);
+MODULE_PARM_DESC(shared, "All opens share the same memory");
+module_param(huge, bool, S_IRUGO);
+MODULE_PARM_DESC(huge, "Map the shared memory with huge pages when possible");
+module_param(percpu_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(percpu_size,
+        "Size in bytes of each per-CPU ring, 0 to disable them");
+module_param(percpu_timer_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(percpu_timer_ms,
+        "Period in ms of the per-CPU demo producer, 0 to disable it");
+
+#ifdef KMMAP_DMA_BUF
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+#endif
+
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Sebastien Vincent");
 MODULE_DESCRIPTION("character device module with mmap");
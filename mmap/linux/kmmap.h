@@ -0,0 +1,257 @@
+/*
+ * kmmap - character device kernel module with mmap.
+ * Copyright (c) 2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file kmmap.h
+ * \brief Ioctl definitions and shared memory layouts of kmmap.
+ * \author Sebastien Vincent
+ * \date 2017
+ */
+
+#ifndef KMMAP_H
+#define KMMAP_H
+
+#ifdef __linux__
+#include <asm/ioctl.h>
+#else
+#error "Not supported OS."
+#endif
+
+#define KMMAP_IOCTL_MAGIC 'm'
+
+#define KMMAP_GET_SIZE 1
+#define KMMAP_RING_INIT 2
+#define KMMAP_SET_EVENTFD 3
+#define KMMAP_KICK 4
+#define KMMAP_GET_PERCPU 5
+#define KMMAP_GET_HUGE 6
+#define KMMAP_EXPORT 7
+#define KMMAP_SET_NODE 8
+#define KMMAP_GET_NODE 9
+#define KMMAP_MPMC_INIT 10
+#define KMMAP_SET_SHARED 11
+
+/* size in bytes of the shared memory */
+#define KMMAP_IOCGSIZE _IOR(KMMAP_IOCTL_MAGIC, KMMAP_GET_SIZE, uint64_t)
+/* format a SPSC ring at offset 0, argument is data size (0 for largest) */
+#define KMMAP_IOCRINGINIT _IOW(KMMAP_IOCTL_MAGIC, KMMAP_RING_INIT, uint64_t)
+/* eventfd signaled on kick, argument is the eventfd (-1 to unregister) */
+#define KMMAP_IOCSEVENTFD _IOW(KMMAP_IOCTL_MAGIC, KMMAP_SET_EVENTFD, int32_t)
+/* wake up consumer waiting in poll() or on the registered eventfd */
+#define KMMAP_IOCKICK _IO(KMMAP_IOCTL_MAGIC, KMMAP_KICK)
+/* layout of the per-CPU rings */
+#define KMMAP_IOCGPERCPU _IOR(KMMAP_IOCTL_MAGIC, KMMAP_GET_PERCPU, \
+        struct kmmap_percpu_info)
+/* number of PMD (huge page) mappings done, 0 if only 4K pages were mapped */
+#define KMMAP_IOCGHUGE _IOR(KMMAP_IOCTL_MAGIC, KMMAP_GET_HUGE, uint64_t)
+/* export the memory as a dma-buf */
+#define KMMAP_IOCEXPORT _IOWR(KMMAP_IOCTL_MAGIC, KMMAP_EXPORT, \
+        struct kmmap_export)
+/* NUMA node of the memory, before its first allocation */
+#define KMMAP_IOCSNODE _IOW(KMMAP_IOCTL_MAGIC, KMMAP_SET_NODE, int32_t)
+/* NUMA node of the memory, -1 if not yet chosen */
+#define KMMAP_IOCGNODE _IOR(KMMAP_IOCTL_MAGIC, KMMAP_GET_NODE, int32_t)
+/* format a MPMC queue at offset 0 */
+#define KMMAP_IOCMPMCINIT _IOW(KMMAP_IOCTL_MAGIC, KMMAP_MPMC_INIT, \
+        struct kmmap_mpmc_init)
+/* use the memory shared by every file that asks for it instead of a private
+ * one, before first use (it is kept until the module is removed) */
+#define KMMAP_IOCSHARED _IO(KMMAP_IOCTL_MAGIC, KMMAP_SET_SHARED)
+
+/**
+ * \def KMMAP_PERCPU_OFFSET
+ * \brief Offset in the device of the ring of CPU 0.
+ */
+#define KMMAP_PERCPU_OFFSET (1ULL << 32)
+
+/**
+ * \def KMMAP_RING_MAGIC
+ * \brief Value of magic field once a ring is formatted.
+ */
+#define KMMAP_RING_MAGIC 0x6b6d7267
+
+/**
+ * \def KMMAP_RING_ALIGN
+ * \brief Alignment of the records in the data area.
+ */
+#define KMMAP_RING_ALIGN 8
+
+/**
+ * \def KMMAP_RING_PAD
+ * \brief Flag of a record that only fills the end of the data area.
+ */
+#define KMMAP_RING_PAD 0x1
+
+/**
+ * \def KMMAP_RING_NEED_WAKEUP
+ * \brief Flag set by the consumer in the header before it goes to sleep.
+ */
+#define KMMAP_RING_NEED_WAKEUP 0x1
+
+/**
+ * \struct kmmap_ring_header
+ * \brief Header of a single-producer/single-consumer ring.
+ *
+ * The header is at the beginning of the mapping and the data area, a power of
+ * two, at data_offset. head and tail are free running byte positions, each on
+ * its own cache line so that the producer and the consumer do not share any
+ * line they write to.
+ *
+ * The producer writes a record (kmmap_ring_record then payload padded to
+ * KMMAP_RING_ALIGN) at head then publishes it with a store-release of head.
+ * The consumer load-acquires head, reads records up to it and gives the
+ * space back with a store-release of tail. A record never wraps: if it does
+ * not fit before the end of the data area, a KMMAP_RING_PAD record fills it.
+ *
+ * A consumer that wants to sleep sets KMMAP_RING_NEED_WAKEUP in flags, checks
+ * head again then waits with poll() or on its eventfd. After it publishes
+ * head, the producer kicks (KMMAP_IOCKICK) only if the flag is set, so a
+ * consumer that keeps polling the ring never costs a system call.
+ */
+struct kmmap_ring_header
+{
+    uint32_t magic; /**< KMMAP_RING_MAGIC when formatted. */
+    uint32_t version; /**< Layout version (1). */
+    uint64_t data_offset; /**< Offset of the data area in the mapping. */
+    uint64_t data_size; /**< Size of the data area, power of two. */
+    uint8_t pad0[40]; /**< Keep head on its own cache line. */
+
+    uint64_t head; /**< Producer position, written by producer only. */
+    uint64_t lost; /**< Records dropped by a kernel producer (ring full). */
+    uint8_t pad1[48]; /**< Keep tail on its own cache line. */
+
+    uint64_t tail; /**< Consumer position, written by consumer only. */
+    uint32_t flags; /**< KMMAP_RING_NEED_WAKEUP, written by consumer only. */
+    uint8_t pad2[52]; /**< Padding up to cache line size. */
+};
+
+/**
+ * \struct kmmap_ring_record
+ * \brief Header of a record in the data area.
+ */
+struct kmmap_ring_record
+{
+    uint32_t len; /**< Length of the payload. */
+    uint32_t flags; /**< KMMAP_RING_PAD or 0. */
+};
+
+/**
+ * \def KMMAP_MPMC_MAGIC
+ * \brief Value of magic field once a MPMC queue is formatted.
+ */
+#define KMMAP_MPMC_MAGIC 0x6b6d6d71
+
+/**
+ * \struct kmmap_mpmc_init
+ * \brief Argument of KMMAP_IOCMPMCINIT.
+ */
+struct kmmap_mpmc_init
+{
+    uint32_t slot_size; /**< Size of a slot, power of two, at least 32. */
+    uint32_t reserved; /**< Must be 0. */
+    uint64_t nr_slots; /**< Number of slots, power of two, 0 for most. */
+};
+
+/**
+ * \struct kmmap_mpmc_header
+ * \brief Header of a bounded multi-producer/multi-consumer queue.
+ *
+ * Vyukov bounded queue: slots follow the header at slots_offset, each one
+ * starts with a sequence number. Slot i is formatted with sequence i.
+ *
+ * A producer that reads sequence == pos in slot pos & (nr_slots - 1) owns it
+ * once it moved enqueue_pos from pos to pos + 1 (compare-and-swap), writes
+ * the payload then publishes it with a store-release of sequence pos + 1.
+ * A consumer that reads sequence == pos + 1 in slot of dequeue_pos pos owns
+ * it once it moved dequeue_pos, reads the payload then gives it back with a
+ * store-release of sequence pos + nr_slots.
+ *
+ * A process that dies between the compare-and-swap and the store-release
+ * leaves its slot stuck.
+ */
+struct kmmap_mpmc_header
+{
+    uint32_t magic; /**< KMMAP_MPMC_MAGIC when formatted. */
+    uint32_t version; /**< Layout version (1). */
+    uint64_t slots_offset; /**< Offset of the first slot in the mapping. */
+    uint64_t nr_slots; /**< Number of slots, power of two. */
+    uint64_t slot_size; /**< Size of a slot, power of two. */
+    uint8_t pad0[32]; /**< Keep enqueue_pos on its own cache line. */
+
+    uint64_t enqueue_pos; /**< Next position to produce. */
+    uint8_t pad1[56]; /**< Keep dequeue_pos on its own cache line. */
+
+    uint64_t dequeue_pos; /**< Next position to consume. */
+    uint8_t pad2[56]; /**< Padding up to cache line size. */
+};
+
+/**
+ * \struct kmmap_mpmc_slot
+ * \brief Header of a slot, payload follows.
+ */
+struct kmmap_mpmc_slot
+{
+    uint64_t sequence; /**< Sequence number. */
+    uint32_t len; /**< Length of the payload. */
+    uint32_t reserved; /**< Unused. */
+};
+
+/**
+ * \struct kmmap_percpu_info
+ * \brief Layout of the per-CPU rings (KMMAP_IOCGPERCPU).
+ *
+ * The ring of CPU n is mapped at offset + n * size. It is formatted by the
+ * kernel, which is the only producer; userspace drains it as a consumer.
+ * CPUs that are not possible have no ring (mmap fails with ENXIO).
+ */
+struct kmmap_percpu_info
+{
+    uint32_t nr_cpus; /**< Number of CPU ids. */
+    uint32_t reserved; /**< Unused. */
+    uint64_t offset; /**< Offset of the ring of CPU 0 (KMMAP_PERCPU_OFFSET). */
+    uint64_t size; /**< Size of the mapping of one ring. */
+};
+
+/**
+ * \struct kmmap_export
+ * \brief Argument of KMMAP_IOCEXPORT.
+ *
+ * The dma-buf references the memory of the file, it stays valid after the
+ * file is closed. CPU accesses through its mapping are bracketed with
+ * DMA_BUF_IOCTL_SYNC.
+ */
+struct kmmap_export
+{
+    uint32_t flags; /**< O_CLOEXEC and/or O_RDWR for the dma-buf fd. */
+    int32_t fd; /**< dma-buf fd (output). */
+};
+
+/**
+ * \struct kmmap_timer_event
+ * \brief Record produced by the per-CPU demo timer.
+ */
+struct kmmap_timer_event
+{
+    uint64_t timestamp; /**< Monotonic time in nanoseconds. */
+    uint32_t cpu; /**< CPU that produced the record. */
+    uint32_t seq; /**< Sequence number on this CPU. */
+};
+
+#ifdef __KERNEL__
+/**
+ * \brief Copy a record in the ring of the current CPU.
+ *
+ * Lockless, callable from any context but NMI.
+ * \param data payload.
+ * \param len length of payload.
+ * \return 0 if success, negative value otherwise (-ENOSPC if ring is full).
+ */
+int kmmap_percpu_emit(const void* data, uint32_t len);
+#endif
+
+#endif /* KMMAP_H */
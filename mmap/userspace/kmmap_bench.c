@@ -0,0 +1,654 @@
+/*
+ * kmmap_bench - shared memory vs read/write benchmark for kmmap module.
+ * Copyright (c) 2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file kmmap_bench.c
+ * \brief Throughput and latency benchmark for the kmmap kernel module.
+ * \author Sebastien Vincent
+ * \date 2017
+ *
+ * Move a volume of data through /dev/kmmap with:
+ * - rw: pwrite() then pread() of each message;
+ * - spin: SPSC ring in the mapping, consumer busy-polls the head index;
+ * - sleep: same ring, idle consumer sleeps in poll() and the producer kicks
+ *   it only when it asked for it.
+ *
+ * Each channel has its own open file (own region). Runs sweep message sizes
+ * and channel counts and report throughput and latency percentiles. For ring
+ * modes, latency is from reserve() to consume, queueing included.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+
+#include "kmmap_ring.h"
+
+/**
+ * \brief Maximum number of values in a sweep list.
+ */
+#define BENCH_LIST_MAX 16
+
+/**
+ * \brief Number of empty peeks before the consumer sleeps (sleep mode).
+ */
+#define BENCH_SPIN_COUNT 1024
+
+/**
+ * \enum bench_mode
+ * \brief Transfer method.
+ */
+enum bench_mode
+{
+    MODE_RW, /**< pwrite()/pread(). */
+    MODE_SPIN, /**< Ring, busy-polling consumer. */
+    MODE_SLEEP, /**< Ring, sleeping consumer woken up by kicks. */
+    MODE_MAX, /**< Number of modes. */
+};
+
+/**
+ * \brief Names of modes.
+ */
+static const char* g_mode_names[MODE_MAX] = {"rw", "spin", "sleep"};
+
+/**
+ * \struct bench_config
+ * \brief Configuration of the benchmark.
+ */
+struct bench_config
+{
+    const char* device; /**< Device path. */
+    size_t sizes[BENCH_LIST_MAX]; /**< Message sizes. */
+    size_t nb_sizes; /**< Number of message sizes. */
+    unsigned int channels[BENCH_LIST_MAX]; /**< Channel counts. */
+    size_t nb_channels; /**< Number of channel counts. */
+    int modes[MODE_MAX]; /**< Modes to run. */
+    uint64_t volume; /**< Bytes to move per run. */
+    int pin; /**< Pin threads on CPUs. */
+};
+
+/**
+ * \struct bench_channel
+ * \brief State of a channel.
+ */
+struct bench_channel
+{
+    const struct bench_config* config; /**< Configuration. */
+    enum bench_mode mode; /**< Mode. */
+    unsigned int id; /**< Channel index. */
+    size_t size; /**< Message size. */
+    size_t count; /**< Number of messages. */
+    int fd; /**< Device. */
+    void* mem; /**< Mapping (ring modes). */
+    uint64_t mem_size; /**< Size of mapping. */
+    uint64_t* latencies; /**< Latency in ns of each message. */
+    size_t done; /**< Number of messages received. */
+    uint64_t sleeps; /**< Number of times consumer slept. */
+    int error; /**< errno of a failure, 0 otherwise. */
+};
+
+/**
+ * \brief Current monotonic time.
+ * \return time in nanoseconds.
+ */
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * \brief Pin calling thread on a CPU.
+ * \param config configuration.
+ * \param cpu CPU index, modulo number of CPUs.
+ */
+static void bench_pin(const struct bench_config* config, unsigned int cpu)
+{
+    cpu_set_t set;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(!config->pin)
+    {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % (cpus > 0 ? cpus : 1), &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+/**
+ * \brief Loop of a channel in rw mode.
+ * \param arg channel state.
+ * \return NULL.
+ */
+static void* bench_rw_run(void* arg)
+{
+    struct bench_channel* channel = arg;
+    char* buf = malloc(channel->size);
+    char* out = malloc(channel->size);
+    size_t i = 0;
+
+    bench_pin(channel->config, channel->id);
+
+    if(!buf || !out)
+    {
+        channel->error = ENOMEM;
+        free(buf);
+        free(out);
+        return NULL;
+    }
+    memset(buf, 'a' + (channel->id % 26), channel->size);
+
+    for(i = 0; i < channel->count; i++)
+    {
+        uint64_t start = bench_now();
+
+        if(pwrite(channel->fd, buf, channel->size, 0) !=
+                (ssize_t)channel->size ||
+                pread(channel->fd, out, channel->size, 0) !=
+                (ssize_t)channel->size)
+        {
+            channel->error = errno ? errno : EIO;
+            break;
+        }
+
+        channel->latencies[i] = bench_now() - start;
+        channel->done++;
+    }
+
+    free(buf);
+    free(out);
+    return NULL;
+}
+
+/**
+ * \brief Producer of a channel in ring modes.
+ * \param arg channel state.
+ * \return NULL.
+ */
+static void* bench_producer_run(void* arg)
+{
+    struct bench_channel* channel = arg;
+    struct kmmap_ring ring;
+    char* buf = malloc(channel->size);
+    size_t i = 0;
+
+    bench_pin(channel->config, 2 * channel->id);
+
+    if(!buf || kmmap_ring_attach(&ring, channel->mem, channel->mem_size) == -1)
+    {
+        channel->error = buf ? errno : ENOMEM;
+        free(buf);
+        return NULL;
+    }
+    memset(buf, 'a' + (channel->id % 26), channel->size);
+
+    for(i = 0; i < channel->count; i++)
+    {
+        uint64_t now = 0;
+        char* payload = NULL;
+
+        while(!(payload = kmmap_ring_reserve(&ring, (uint32_t)channel->size)))
+        {
+            /* full */
+            sched_yield();
+        }
+
+        now = bench_now();
+        memcpy(payload, buf, channel->size);
+        memcpy(payload, &now, sizeof(now));
+        kmmap_ring_commit(&ring, (uint32_t)channel->size);
+
+        if(channel->mode == MODE_SLEEP && kmmap_ring_need_wakeup(&ring))
+        {
+            ioctl(channel->fd, KMMAP_IOCKICK);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/**
+ * \brief Consumer of a channel in ring modes.
+ * \param arg channel state.
+ * \return NULL.
+ */
+static void* bench_consumer_run(void* arg)
+{
+    struct bench_channel* channel = arg;
+    struct kmmap_ring ring;
+    char* out = malloc(channel->size);
+    unsigned int spins = 0;
+
+    bench_pin(channel->config, 2 * channel->id + 1);
+
+    if(!out || kmmap_ring_attach(&ring, channel->mem, channel->mem_size) == -1)
+    {
+        channel->error = out ? errno : ENOMEM;
+        free(out);
+        return NULL;
+    }
+
+    while(channel->done < channel->count)
+    {
+        uint32_t len = 0;
+        const void* payload = kmmap_ring_peek(&ring, &len);
+        uint64_t sent = 0;
+
+        if(!payload)
+        {
+            if(channel->mode == MODE_SLEEP && ++spins >= BENCH_SPIN_COUNT)
+            {
+                spins = 0;
+                if(kmmap_ring_prepare_wait(&ring))
+                {
+                    struct pollfd pfd;
+
+                    pfd.fd = channel->fd;
+                    pfd.events = POLLIN;
+                    pfd.revents = 0;
+                    poll(&pfd, 1, -1);
+                    channel->sleeps++;
+                }
+                kmmap_ring_finish_wait(&ring);
+            }
+            continue;
+        }
+
+        spins = 0;
+        memcpy(out, payload, len);
+        kmmap_ring_release(&ring, len);
+
+        memcpy(&sent, out, sizeof(sent));
+        channel->latencies[channel->done++] = bench_now() - sent;
+    }
+
+    free(out);
+    return NULL;
+}
+
+/**
+ * \brief Close the device of a channel.
+ * \param channel channel.
+ */
+static void bench_channel_close(struct bench_channel* channel)
+{
+    if(channel->mem)
+    {
+        munmap(channel->mem, channel->mem_size);
+    }
+    close(channel->fd);
+}
+
+/**
+ * \brief Open the device of a channel and set up the ring if needed.
+ * \param channel channel.
+ * \return 0 if success, -1 otherwise (errno is set).
+ */
+static int bench_channel_open(struct bench_channel* channel)
+{
+    struct kmmap_ring ring;
+    uint64_t data_size = 0;
+
+    channel->fd = open(channel->config->device, O_RDWR);
+    if(channel->fd == -1)
+    {
+        return -1;
+    }
+
+    if(channel->mode == MODE_RW)
+    {
+        return 0;
+    }
+
+    if(ioctl(channel->fd, KMMAP_IOCGSIZE, &channel->mem_size) == -1 ||
+            ioctl(channel->fd, KMMAP_IOCRINGINIT, &data_size) == -1)
+    {
+        close(channel->fd);
+        return -1;
+    }
+
+    channel->mem = mmap(NULL, channel->mem_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, channel->fd, 0);
+    if(channel->mem == MAP_FAILED)
+    {
+        channel->mem = NULL;
+        close(channel->fd);
+        return -1;
+    }
+
+    if(kmmap_ring_attach(&ring, channel->mem, channel->mem_size) == -1 ||
+            kmmap_ring_record_size((uint32_t)channel->size) > ring.size / 2)
+    {
+        /* producer would never be able to reserve */
+        bench_channel_close(channel);
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Compare two latencies for qsort().
+ * \param a first latency.
+ * \param b second latency.
+ * \return negative, 0 or positive value.
+ */
+static int bench_compare(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * \brief Run one mode with one message size and one channel count.
+ * \param config configuration.
+ * \param mode mode.
+ * \param size message size.
+ * \param nb number of channels.
+ * \return 0 if success, -1 otherwise.
+ */
+static int bench_run(const struct bench_config* config, enum bench_mode mode,
+        size_t size, unsigned int nb)
+{
+    struct bench_channel* channels = calloc(nb, sizeof(struct bench_channel));
+    pthread_t* threads = calloc(2 * nb, sizeof(pthread_t));
+    size_t count = config->volume / size / nb;
+    uint64_t* latencies = NULL;
+    size_t total = 0;
+    uint64_t sleeps = 0;
+    uint64_t start = 0;
+    double elapsed = 0;
+    unsigned int i = 0;
+    int ret = 0;
+
+    count = count > 0 ? count : 1;
+    latencies = malloc(nb * count * sizeof(uint64_t));
+
+    if(!channels || !threads || !latencies)
+    {
+        fprintf(stderr, "out of memory\n");
+        free(channels);
+        free(threads);
+        free(latencies);
+        return -1;
+    }
+
+    for(i = 0; i < nb; i++)
+    {
+        channels[i].config = config;
+        channels[i].mode = mode;
+        channels[i].id = i;
+        channels[i].size = size;
+        channels[i].count = count;
+        channels[i].latencies = latencies + (size_t)i * count;
+
+        if(bench_channel_open(&channels[i]) == -1)
+        {
+            perror("open");
+            while(i-- > 0)
+            {
+                bench_channel_close(&channels[i]);
+            }
+            free(channels);
+            free(threads);
+            free(latencies);
+            return -1;
+        }
+    }
+
+    start = bench_now();
+
+    for(i = 0; i < nb; i++)
+    {
+        if(mode == MODE_RW)
+        {
+            pthread_create(&threads[2 * i], NULL, bench_rw_run, &channels[i]);
+        }
+        else
+        {
+            pthread_create(&threads[2 * i], NULL, bench_consumer_run,
+                    &channels[i]);
+            pthread_create(&threads[2 * i + 1], NULL, bench_producer_run,
+                    &channels[i]);
+        }
+    }
+
+    for(i = 0; i < nb; i++)
+    {
+        pthread_join(threads[2 * i], NULL);
+        if(mode != MODE_RW)
+        {
+            pthread_join(threads[2 * i + 1], NULL);
+        }
+    }
+
+    elapsed = (double)(bench_now() - start) / 1e9;
+
+    /* gather results */
+    for(i = 0; i < nb; i++)
+    {
+        if(channels[i].error != 0)
+        {
+            fprintf(stderr, "channel %u: %s\n", i,
+                    strerror(channels[i].error));
+            ret = -1;
+        }
+
+        memmove(latencies + total, channels[i].latencies,
+                channels[i].done * sizeof(uint64_t));
+        total += channels[i].done;
+        sleeps += channels[i].sleeps;
+        bench_channel_close(&channels[i]);
+    }
+
+    if(total > 0)
+    {
+        qsort(latencies, total, sizeof(uint64_t), bench_compare);
+
+        printf("%-5s %8zu %8u %10.2f %12.0f %10.2f %10.2f %10.2f %10lu\n",
+                g_mode_names[mode], size, nb,
+                (double)total * size / elapsed / 1e6, total / elapsed,
+                latencies[total / 2] / 1e3,
+                latencies[total * 99 / 100] / 1e3,
+                latencies[total * 999 / 1000] / 1e3,
+                (unsigned long)sleeps);
+    }
+
+    free(channels);
+    free(threads);
+    free(latencies);
+    return ret;
+}
+
+/**
+ * \brief Parse a comma separated list of numbers.
+ * \param str string to parse.
+ * \param values array to fill.
+ * \return number of values, 0 if invalid.
+ */
+static size_t bench_parse_list(char* str, size_t* values)
+{
+    size_t nb = 0;
+    char* token = strtok(str, ",");
+
+    while(token && nb < BENCH_LIST_MAX)
+    {
+        values[nb] = strtoul(token, NULL, 0);
+        if(values[nb] == 0)
+        {
+            return 0;
+        }
+        nb++;
+        token = strtok(NULL, ",");
+    }
+    return nb;
+}
+
+/**
+ * \brief Print usage.
+ * \param name program name.
+ */
+static void bench_usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-d device] [-s sizes] [-t channels] "
+            "[-v volume] [-m modes] [-c]\n"
+            "  -d  device (default /dev/kmmap)\n"
+            "  -s  message sizes, comma separated (default 64,1024,16384)\n"
+            "  -t  channel counts, comma separated (default 1,2,4)\n"
+            "  -v  bytes to move per run (default 67108864)\n"
+            "  -m  modes among rw,spin,sleep (default all)\n"
+            "  -c  pin threads on CPUs\n", name);
+}
+
+/**
+ * \brief Entry point of the program.
+ * \param argc number of arguments.
+ * \param argv array of arguments.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int main(int argc, char** argv)
+{
+    struct bench_config config;
+    struct utsname uts;
+    size_t values[BENCH_LIST_MAX];
+    size_t s = 0;
+    size_t t = 0;
+    int m = 0;
+    int opt = 0;
+    int ret = EXIT_SUCCESS;
+
+    memset(&config, 0x00, sizeof(config));
+    config.device = "/dev/kmmap";
+    config.sizes[0] = 64;
+    config.sizes[1] = 1024;
+    config.sizes[2] = 16384;
+    config.nb_sizes = 3;
+    config.channels[0] = 1;
+    config.channels[1] = 2;
+    config.channels[2] = 4;
+    config.nb_channels = 3;
+    config.volume = 64 * 1024 * 1024;
+
+    for(m = 0; m < MODE_MAX; m++)
+    {
+        config.modes[m] = 1;
+    }
+
+    while((opt = getopt(argc, argv, "d:s:t:v:m:ch")) != -1)
+    {
+        switch(opt)
+        {
+        case 'd':
+            config.device = optarg;
+            break;
+        case 's':
+            config.nb_sizes = bench_parse_list(optarg, config.sizes);
+            if(config.nb_sizes == 0)
+            {
+                bench_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            config.nb_channels = bench_parse_list(optarg, values);
+            if(config.nb_channels == 0)
+            {
+                bench_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            for(t = 0; t < config.nb_channels; t++)
+            {
+                config.channels[t] = (unsigned int)values[t];
+            }
+            break;
+        case 'v':
+            config.volume = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            for(m = 0; m < MODE_MAX; m++)
+            {
+                config.modes[m] = strstr(optarg, g_mode_names[m]) != NULL;
+            }
+            break;
+        case 'c':
+            config.pin = 1;
+            break;
+        default:
+            bench_usage(argv[0]);
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if(config.volume == 0)
+    {
+        bench_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    for(s = 0; s < config.nb_sizes; s++)
+    {
+        if(config.sizes[s] < sizeof(uint64_t))
+        {
+            fprintf(stderr, "size must be at least %zu\n", sizeof(uint64_t));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(uname(&uts) == 0)
+    {
+        printf("kernel %s %s\n", uts.release, uts.machine);
+    }
+    printf("%-5s %8s %8s %10s %12s %10s %10s %10s %10s\n", "mode", "size",
+            "channels", "MB/s", "msg/s", "p50(us)", "p99(us)", "p999(us)",
+            "sleeps");
+
+    for(m = 0; m < MODE_MAX; m++)
+    {
+        if(!config.modes[m])
+        {
+            continue;
+        }
+
+        for(s = 0; s < config.nb_sizes; s++)
+        {
+            for(t = 0; t < config.nb_channels; t++)
+            {
+                if(bench_run(&config, (enum bench_mode)m, config.sizes[s],
+                            config.channels[t]) == -1)
+                {
+                    ret = EXIT_FAILURE;
+                }
+            }
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,235 @@
+/*
+ * kmmap_dmabuf_userspace - Hand a kmmap buffer to another process.
+ * Copyright (c) 2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file kmmap_dmabuf_userspace.c
+ * \brief Userspace program to pass a kmmap buffer as a dma-buf fd.
+ * \author Sebastien Vincent
+ * \date 2017
+ *
+ * The parent process fills the buffer of its kmmap file, exports it as a
+ * dma-buf and sends the fd through a UNIX socket (SCM_RIGHTS). The child
+ * maps the dma-buf and reads the data, nothing is copied.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <linux/dma-buf.h>
+
+#include "kmmap.h"
+
+/**
+ * \brief Bracket CPU access to a dma-buf.
+ * \param fd dma-buf.
+ * \param flags DMA_BUF_SYNC_* flags.
+ * \return 0 if success, -1 otherwise.
+ */
+static int dmabuf_sync(int fd, uint64_t flags)
+{
+    struct dma_buf_sync sync;
+
+    sync.flags = flags;
+    return ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+/**
+ * \brief Send a fd through a UNIX socket.
+ * \param sock socket.
+ * \param fd fd to send.
+ * \param size size of the buffer, sent as data.
+ * \return 0 if success, -1 otherwise.
+ */
+static int dmabuf_send(int sock, int fd, uint64_t size)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr* cmsg = NULL;
+
+    memset(&msg, 0x00, sizeof(msg));
+    memset(control, 0x00, sizeof(control));
+    iov.iov_base = &size;
+    iov.iov_len = sizeof(size);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, 0) == -1 ? -1 : 0;
+}
+
+/**
+ * \brief Receive a fd from a UNIX socket.
+ * \param sock socket.
+ * \param size filled with size of the buffer.
+ * \return fd, or -1 if failure.
+ */
+static int dmabuf_recv(int sock, uint64_t* size)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr* cmsg = NULL;
+    int fd = -1;
+
+    memset(&msg, 0x00, sizeof(msg));
+    iov.iov_base = size;
+    iov.iov_len = sizeof(*size);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if(recvmsg(sock, &msg, 0) <= 0)
+    {
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        return -1;
+    }
+
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/**
+ * \brief Map the received dma-buf and print its content.
+ * \param sock socket.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int dmabuf_consumer(int sock)
+{
+    uint64_t size = 0;
+    int fd = dmabuf_recv(sock, &size);
+    char* mem = NULL;
+
+    if(fd == -1)
+    {
+        perror("recvmsg");
+        return EXIT_FAILURE;
+    }
+
+    mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+    printf("consumer: %.*s\n", (int)strnlen(mem, size), mem);
+    dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+    munmap(mem, size);
+    close(fd);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * \brief Entry point of the program.
+ * \param argc number of arguments.
+ * \param argv array of arguments.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int main(int argc, char** argv)
+{
+    const char* input = argc > 1 ? argv[1] : "Test dma-buf!";
+    int socks[2] = {-1, -1};
+    int fd = -1;
+    uint64_t size = 0;
+    struct kmmap_export exp;
+    char* mem = NULL;
+    pid_t pid = -1;
+    int status = 0;
+
+    if(socketpair(AF_UNIX, SOCK_DGRAM, 0, socks) == -1)
+    {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    pid = fork();
+    if(pid == -1)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    else if(pid == 0)
+    {
+        close(socks[0]);
+        _exit(dmabuf_consumer(socks[1]));
+    }
+    close(socks[1]);
+
+    fd = open("/dev/kmmap", O_RDWR);
+    if(fd == -1)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    exp.flags = O_RDWR | O_CLOEXEC;
+    exp.fd = -1;
+    if(ioctl(fd, KMMAP_IOCGSIZE, &size) == -1 ||
+            ioctl(fd, KMMAP_IOCEXPORT, &exp) == -1)
+    {
+        perror("ioctl");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    /* the dma-buf keeps the memory alive */
+    close(fd);
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, exp.fd, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("mmap");
+        close(exp.fd);
+        exit(EXIT_FAILURE);
+    }
+
+    dmabuf_sync(exp.fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+    strncpy(mem, input, size - 1);
+    dmabuf_sync(exp.fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+    munmap(mem, size);
+
+    if(dmabuf_send(socks[0], exp.fd, size) == -1)
+    {
+        perror("sendmsg");
+    }
+
+    close(exp.fd);
+    close(socks[0]);
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
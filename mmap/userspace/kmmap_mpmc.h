@@ -0,0 +1,196 @@
+/*
+ * kmmap_mpmc - MPMC queue over the kmmap shared memory.
+ * Copyright (c) 2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file kmmap_mpmc.h
+ * \brief Header-only bounded multi-producer/multi-consumer queue over kmmap.
+ * \author Sebastien Vincent
+ * \date 2017
+ *
+ * Layout is described in kmmap.h. Any number of processes enqueue and
+ * dequeue concurrently, without lock nor system call.
+ */
+
+#ifndef KMMAP_MPMC_H
+#define KMMAP_MPMC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#include "kmmap.h"
+
+/**
+ * \struct kmmap_mpmc
+ * \brief Local view of a queue.
+ */
+struct kmmap_mpmc
+{
+    struct kmmap_mpmc_header* header; /**< Shared header. */
+    uint8_t* slots; /**< First slot. */
+    uint64_t mask; /**< nr_slots - 1. */
+    uint64_t slot_size; /**< Size of a slot. */
+    uint64_t max_len; /**< Maximum payload length. */
+};
+
+/**
+ * \brief Attach to a queue formatted with KMMAP_IOCMPMCINIT.
+ * \param queue queue to initialize.
+ * \param mem start of the mapping.
+ * \param mem_size size of the mapping.
+ * \return 0 if success, -1 otherwise (errno is set).
+ */
+static inline int kmmap_mpmc_attach(struct kmmap_mpmc* queue, void* mem,
+        size_t mem_size)
+{
+    struct kmmap_mpmc_header* header = mem;
+
+    if(mem_size < sizeof(struct kmmap_mpmc_header) ||
+            __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) !=
+            KMMAP_MPMC_MAGIC ||
+            header->slots_offset + header->nr_slots * header->slot_size >
+            mem_size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    queue->header = header;
+    queue->slots = (uint8_t*)mem + header->slots_offset;
+    queue->mask = header->nr_slots - 1;
+    queue->slot_size = header->slot_size;
+    queue->max_len = header->slot_size - sizeof(struct kmmap_mpmc_slot);
+    return 0;
+}
+
+/**
+ * \brief Get a slot.
+ * \param queue queue.
+ * \param pos position.
+ * \return slot.
+ */
+static inline struct kmmap_mpmc_slot* kmmap_mpmc_slot(struct kmmap_mpmc* queue,
+        uint64_t pos)
+{
+    return (struct kmmap_mpmc_slot*)(queue->slots +
+            (pos & queue->mask) * queue->slot_size);
+}
+
+/**
+ * \brief Copy a record in the queue.
+ * \param queue queue.
+ * \param buf payload.
+ * \param len length of payload.
+ * \return 0 if success, -1 otherwise (errno is EAGAIN if queue is full,
+ * EMSGSIZE if record is too big).
+ */
+static inline int kmmap_mpmc_enqueue(struct kmmap_mpmc* queue,
+        const void* buf, uint32_t len)
+{
+    struct kmmap_mpmc_slot* slot = NULL;
+    uint64_t pos = __atomic_load_n(&queue->header->enqueue_pos,
+            __ATOMIC_RELAXED);
+
+    if(len > queue->max_len)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    for(;;)
+    {
+        int64_t diff = 0;
+
+        slot = kmmap_mpmc_slot(queue, pos);
+        diff = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) -
+                pos);
+
+        if(diff == 0)
+        {
+            /* slot is free, try to own it (pos is updated on failure) */
+            if(__atomic_compare_exchange_n(&queue->header->enqueue_pos, &pos,
+                        pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            /* slot still holds the record of previous lap */
+            errno = EAGAIN;
+            return -1;
+        }
+        else
+        {
+            /* another producer was faster */
+            pos = __atomic_load_n(&queue->header->enqueue_pos,
+                    __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(slot + 1, buf, len);
+    slot->len = len;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * \brief Copy a record out of the queue.
+ * \param queue queue.
+ * \param buf buffer to fill, at least max_len bytes.
+ * \return length of payload, -1 otherwise (errno is EAGAIN if queue is
+ * empty).
+ */
+static inline int64_t kmmap_mpmc_dequeue(struct kmmap_mpmc* queue, void* buf)
+{
+    struct kmmap_mpmc_slot* slot = NULL;
+    uint64_t pos = __atomic_load_n(&queue->header->dequeue_pos,
+            __ATOMIC_RELAXED);
+    uint32_t len = 0;
+
+    for(;;)
+    {
+        int64_t diff = 0;
+
+        slot = kmmap_mpmc_slot(queue, pos);
+        diff = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) -
+                (pos + 1));
+
+        if(diff == 0)
+        {
+            /* slot is full, try to own it (pos is updated on failure) */
+            if(__atomic_compare_exchange_n(&queue->header->dequeue_pos, &pos,
+                        pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            /* record not yet published */
+            errno = EAGAIN;
+            return -1;
+        }
+        else
+        {
+            /* another consumer was faster */
+            pos = __atomic_load_n(&queue->header->dequeue_pos,
+                    __ATOMIC_RELAXED);
+        }
+    }
+
+    /* len comes from shared memory, do not trust it */
+    len = slot->len;
+    len = len > queue->max_len ? (uint32_t)queue->max_len : len;
+    memcpy(buf, slot + 1, len);
+    __atomic_store_n(&slot->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+    return len;
+}
+
+#endif /* KMMAP_MPMC_H */
@@ -0,0 +1,274 @@
+/*
+ * kmmap_mpmc_stress - Stress the kmmap MPMC queue with many processes.
+ * Copyright (c) 2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file kmmap_mpmc_stress.c
+ * \brief Userspace program to check the kmmap MPMC queue.
+ * \author Sebastien Vincent
+ * \date 2017
+ *
+ * Usage: kmmap_mpmc_stress [producers] [consumers] [records] [slot_size]
+ *
+ * Producer processes enqueue (producer, sequence) records, consumer
+ * processes dequeue them and count every record in a shared table. At the
+ * end, each record must have been received exactly once.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "kmmap_mpmc.h"
+
+/**
+ * \struct stress_record
+ * \brief Record exchanged through the queue.
+ */
+struct stress_record
+{
+    uint32_t producer; /**< Producer index. */
+    uint32_t reserved; /**< Unused. */
+    uint64_t seq; /**< Sequence number of the producer. */
+};
+
+/**
+ * \struct stress_shared
+ * \brief Results shared by all processes.
+ */
+struct stress_shared
+{
+    uint64_t received; /**< Number of records dequeued. */
+    uint64_t invalid; /**< Number of malformed records. */
+    uint8_t counts[]; /**< Times each record was received. */
+};
+
+/**
+ * \brief Current monotonic time.
+ * \return time in seconds.
+ */
+static double stress_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * \brief Enqueue the records of a producer.
+ * \param queue queue.
+ * \param id producer index.
+ * \param records number of records.
+ */
+static void stress_producer(struct kmmap_mpmc* queue, uint32_t id,
+        uint64_t records)
+{
+    struct stress_record record;
+
+    memset(&record, 0x00, sizeof(record));
+    record.producer = id;
+
+    for(record.seq = 0; record.seq < records; record.seq++)
+    {
+        while(kmmap_mpmc_enqueue(queue, &record, sizeof(record)) == -1)
+        {
+            /* full */
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * \brief Dequeue records until all of them are received.
+ * \param queue queue.
+ * \param shared results.
+ * \param producers number of producers.
+ * \param records number of records per producer.
+ */
+static void stress_consumer(struct kmmap_mpmc* queue,
+        struct stress_shared* shared, uint32_t producers, uint64_t records)
+{
+    uint64_t total = producers * records;
+    uint8_t* buf = malloc(queue->max_len);
+
+    if(!buf)
+    {
+        return;
+    }
+
+    while(__atomic_load_n(&shared->received, __ATOMIC_RELAXED) < total)
+    {
+        struct stress_record record;
+        int64_t len = kmmap_mpmc_dequeue(queue, buf);
+
+        if(len == -1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(&record, buf, sizeof(record));
+        if(len != sizeof(record) || record.producer >= producers ||
+                record.seq >= records)
+        {
+            __atomic_add_fetch(&shared->invalid, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            __atomic_add_fetch(&shared->counts[record.producer * records +
+                    record.seq], 1, __ATOMIC_RELAXED);
+        }
+        __atomic_add_fetch(&shared->received, 1, __ATOMIC_RELAXED);
+    }
+
+    free(buf);
+}
+
+/**
+ * \brief Entry point of the program.
+ * \param argc number of arguments.
+ * \param argv array of arguments.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int main(int argc, char** argv)
+{
+    uint32_t producers = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) : 4;
+    uint32_t consumers = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : 4;
+    uint64_t records = argc > 3 ? strtoull(argv[3], NULL, 0) : 1000000;
+    struct kmmap_mpmc_init init;
+    struct kmmap_mpmc queue;
+    struct stress_shared* shared = NULL;
+    size_t shared_size = 0;
+    uint64_t mem_size = 0;
+    uint64_t lost = 0;
+    uint64_t duplicated = 0;
+    uint64_t i = 0;
+    double start = 0;
+    char* mem = NULL;
+    int fd = -1;
+    int ret = EXIT_SUCCESS;
+
+    memset(&init, 0x00, sizeof(init));
+    init.slot_size = argc > 4 ? (uint32_t)strtoul(argv[4], NULL, 0) : 64;
+
+    if(producers == 0 || consumers == 0 || records == 0)
+    {
+        fprintf(stderr, "Usage: %s [producers] [consumers] [records] "
+                "[slot_size]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open("/dev/kmmap", O_RDWR);
+    if(fd == -1)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    if(ioctl(fd, KMMAP_IOCGSIZE, &mem_size) == -1 ||
+            ioctl(fd, KMMAP_IOCMPMCINIT, &init) == -1)
+    {
+        perror("ioctl");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    if(kmmap_mpmc_attach(&queue, mem, mem_size) == -1 ||
+            queue.max_len < sizeof(struct stress_record))
+    {
+        fprintf(stderr, "Cannot attach to queue\n");
+        munmap(mem, mem_size);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    /* inherited by children */
+    shared_size = sizeof(struct stress_shared) + producers * records;
+    shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED)
+    {
+        perror("mmap");
+        munmap(mem, mem_size);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    start = stress_now();
+
+    for(i = 0; i < producers + consumers; i++)
+    {
+        pid_t pid = fork();
+
+        if(pid == -1)
+        {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        else if(pid == 0)
+        {
+            if(i < producers)
+            {
+                stress_producer(&queue, (uint32_t)i, records);
+            }
+            else
+            {
+                stress_consumer(&queue, shared, producers, records);
+            }
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    for(i = 0; i < producers + consumers; i++)
+    {
+        wait(NULL);
+    }
+
+    for(i = 0; i < producers * records; i++)
+    {
+        lost += shared->counts[i] == 0;
+        duplicated += shared->counts[i] > 1;
+    }
+
+    printf("%u producers %u consumers: %lu records in %.3fs, %lu lost, "
+            "%lu duplicated, %lu invalid\n", producers, consumers,
+            (unsigned long)shared->received, stress_now() - start,
+            (unsigned long)lost, (unsigned long)duplicated,
+            (unsigned long)shared->invalid);
+
+    if(lost != 0 || duplicated != 0 || shared->invalid != 0)
+    {
+        ret = EXIT_FAILURE;
+    }
+
+    munmap(shared, shared_size);
+    munmap(mem, mem_size);
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,222 @@
+/*
+ * kmmap_percpu_userspace - Drain the kmmap per-CPU rings.
+ * Copyright (c) 2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file kmmap_percpu_userspace.c
+ * \brief Userspace program to drain the per-CPU rings filled by the kernel.
+ * \author Sebastien Vincent
+ * \date 2017
+ *
+ * Usage: kmmap_percpu_userspace [seconds]
+ *
+ * The module has to be loaded with percpu_size (and percpu_timer_ms for the
+ * demo producer). Records are expected to be struct kmmap_timer_event.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "kmmap_ring.h"
+
+/**
+ * \struct percpu_reader
+ * \brief Consumer of the ring of a CPU.
+ */
+struct percpu_reader
+{
+    void* mem; /**< Mapping, NULL if CPU has no ring. */
+    struct kmmap_ring ring; /**< Ring. */
+    uint64_t count; /**< Records consumed. */
+    uint64_t gaps; /**< Records missed according to sequence numbers. */
+    uint32_t next_seq; /**< Next sequence number expected. */
+};
+
+/**
+ * \brief Current monotonic time.
+ * \return time in seconds.
+ */
+static double percpu_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * \brief Consume the records available in a ring.
+ * \param reader reader.
+ * \return number of records consumed.
+ */
+static uint64_t percpu_drain(struct percpu_reader* reader)
+{
+    uint64_t nb = 0;
+    uint32_t len = 0;
+    const void* payload = NULL;
+
+    while((payload = kmmap_ring_peek(&reader->ring, &len)) != NULL)
+    {
+        struct kmmap_timer_event event;
+
+        if(len == sizeof(event))
+        {
+            memcpy(&event, payload, sizeof(event));
+            if(reader->count != 0 && event.seq != reader->next_seq)
+            {
+                reader->gaps += (uint32_t)(event.seq - reader->next_seq);
+            }
+            reader->next_seq = event.seq + 1;
+        }
+
+        kmmap_ring_release(&reader->ring, len);
+        reader->count++;
+        nb++;
+    }
+    return nb;
+}
+
+/**
+ * \brief Entry point of the program.
+ * \param argc number of arguments.
+ * \param argv array of arguments.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int main(int argc, char** argv)
+{
+    int fd = -1;
+    double duration = argc > 1 ? strtod(argv[1], NULL) : 5.0;
+    double end = 0;
+    struct kmmap_percpu_info info;
+    struct percpu_reader* readers = NULL;
+    uint32_t i = 0;
+    uint64_t sleeps = 0;
+
+    fd = open("/dev/kmmap", O_RDWR);
+    if(fd == -1)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    if(ioctl(fd, KMMAP_IOCGPERCPU, &info) == -1)
+    {
+        perror("ioctl");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    readers = calloc(info.nr_cpus, sizeof(struct percpu_reader));
+    if(!readers)
+    {
+        perror("calloc");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < info.nr_cpus; i++)
+    {
+        void* mem = mmap(NULL, info.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, (off_t)(info.offset + i * info.size));
+
+        if(mem == MAP_FAILED)
+        {
+            if(errno != ENXIO)
+            {
+                perror("mmap");
+            }
+            continue;
+        }
+
+        if(kmmap_ring_attach(&readers[i].ring, mem, info.size) == -1)
+        {
+            perror("kmmap_ring_attach");
+            munmap(mem, info.size);
+            continue;
+        }
+        readers[i].mem = mem;
+    }
+
+    end = percpu_now() + duration;
+    while(percpu_now() < end)
+    {
+        uint64_t nb = 0;
+        int empty = 1;
+        struct pollfd pfd;
+
+        for(i = 0; i < info.nr_cpus; i++)
+        {
+            if(readers[i].mem)
+            {
+                nb += percpu_drain(&readers[i]);
+            }
+        }
+
+        if(nb != 0)
+        {
+            continue;
+        }
+
+        /* all rings empty, sleep until a kernel producer wakes us up */
+        for(i = 0; i < info.nr_cpus && empty; i++)
+        {
+            if(readers[i].mem)
+            {
+                empty = kmmap_ring_prepare_wait(&readers[i].ring);
+            }
+        }
+
+        if(empty)
+        {
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            poll(&pfd, 1, 100);
+            sleeps++;
+        }
+
+        for(i = 0; i < info.nr_cpus; i++)
+        {
+            if(readers[i].mem)
+            {
+                kmmap_ring_finish_wait(&readers[i].ring);
+            }
+        }
+    }
+
+    for(i = 0; i < info.nr_cpus; i++)
+    {
+        if(readers[i].mem)
+        {
+            printf("cpu %u: %lu records, %lu gaps, %lu lost by kernel\n", i,
+                    (unsigned long)readers[i].count,
+                    (unsigned long)readers[i].gaps,
+                    (unsigned long)__atomic_load_n(
+                        &readers[i].ring.header->lost, __ATOMIC_RELAXED));
+            munmap(readers[i].mem, info.size);
+        }
+    }
+    printf("%lu sleeps\n", (unsigned long)sleeps);
+
+    free(readers);
+    close(fd);
+    return EXIT_SUCCESS;
+}
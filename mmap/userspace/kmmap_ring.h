@@ -0,0 +1,302 @@
+/*
+ * kmmap_ring - SPSC ring over the kmmap shared memory.
+ * Copyright (c) 2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file kmmap_ring.h
+ * \brief Header-only single-producer/single-consumer ring over kmmap.
+ * \author Sebastien Vincent
+ * \date 2017
+ *
+ * Layout is described in kmmap.h. One process produces, one process consumes,
+ * no system call is needed in steady state. Each side caches the position of
+ * the other one and only reads the shared cache line when its cached value
+ * says the ring is full (producer) or empty (consumer).
+ */
+
+#ifndef KMMAP_RING_H
+#define KMMAP_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#include "kmmap.h"
+
+/**
+ * \struct kmmap_ring
+ * \brief Local view of a ring.
+ */
+struct kmmap_ring
+{
+    struct kmmap_ring_header* header; /**< Shared header. */
+    uint8_t* data; /**< Shared data area. */
+    uint64_t size; /**< Size of data area. */
+    uint64_t mask; /**< size - 1. */
+    uint64_t head; /**< Local head (producer) or cached head (consumer). */
+    uint64_t tail; /**< Local tail (consumer) or cached tail (producer). */
+};
+
+/**
+ * \brief Size taken by a record in the data area.
+ * \param len length of payload.
+ * \return size in bytes.
+ */
+static inline uint64_t kmmap_ring_record_size(uint32_t len)
+{
+    return (sizeof(struct kmmap_ring_record) + len + KMMAP_RING_ALIGN - 1) &
+        ~(uint64_t)(KMMAP_RING_ALIGN - 1);
+}
+
+/**
+ * \brief Attach to a ring formatted with KMMAP_IOCRINGINIT.
+ * \param ring ring to initialize.
+ * \param mem start of the mapping.
+ * \param mem_size size of the mapping.
+ * \return 0 if success, -1 otherwise (errno is set).
+ */
+static inline int kmmap_ring_attach(struct kmmap_ring* ring, void* mem,
+        size_t mem_size)
+{
+    struct kmmap_ring_header* header = mem;
+
+    if(mem_size < sizeof(struct kmmap_ring_header) ||
+            __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) !=
+            KMMAP_RING_MAGIC ||
+            header->data_offset + header->data_size > mem_size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ring->header = header;
+    ring->data = (uint8_t*)mem + header->data_offset;
+    ring->size = header->data_size;
+    ring->mask = header->data_size - 1;
+    ring->head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    ring->tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+/**
+ * \brief Reserve space for a record (producer).
+ *
+ * The payload can be written in place, then kmmap_ring_commit() publishes it.
+ * \param ring ring.
+ * \param len length of payload.
+ * \return pointer to payload, or NULL if ring is full (errno is EAGAIN) or
+ * record too big (errno is EMSGSIZE).
+ */
+static inline void* kmmap_ring_reserve(struct kmmap_ring* ring, uint32_t len)
+{
+    uint64_t total = kmmap_ring_record_size(len);
+    uint64_t offset = ring->head & ring->mask;
+    uint64_t end = ring->size - offset;
+    uint64_t needed = total > end ? end + total : total;
+    struct kmmap_ring_record* record = NULL;
+
+    if(total > ring->size / 2)
+    {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    if(ring->head + needed - ring->tail > ring->size)
+    {
+        /* refresh cached tail */
+        ring->tail = __atomic_load_n(&ring->header->tail, __ATOMIC_ACQUIRE);
+
+        if(ring->head + needed - ring->tail > ring->size)
+        {
+            errno = EAGAIN;
+            return NULL;
+        }
+    }
+
+    if(total > end)
+    {
+        /* fill the end of the data area, record goes at the beginning */
+        record = (struct kmmap_ring_record*)(ring->data + offset);
+        record->len = (uint32_t)(end - sizeof(struct kmmap_ring_record));
+        record->flags = KMMAP_RING_PAD;
+        ring->head += end;
+        offset = 0;
+    }
+
+    record = (struct kmmap_ring_record*)(ring->data + offset);
+    record->len = len;
+    record->flags = 0;
+    return record + 1;
+}
+
+/**
+ * \brief Publish the record returned by kmmap_ring_reserve() (producer).
+ * \param ring ring.
+ * \param len length of payload, same as the one reserved.
+ */
+static inline void kmmap_ring_commit(struct kmmap_ring* ring, uint32_t len)
+{
+    ring->head += kmmap_ring_record_size(len);
+    __atomic_store_n(&ring->header->head, ring->head, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Copy a record in the ring (producer).
+ * \param ring ring.
+ * \param buf payload.
+ * \param len length of payload.
+ * \return 0 if success, -1 otherwise (errno is EAGAIN if ring is full).
+ */
+static inline int kmmap_ring_produce(struct kmmap_ring* ring, const void* buf,
+        uint32_t len)
+{
+    void* payload = kmmap_ring_reserve(ring, len);
+
+    if(!payload)
+    {
+        return -1;
+    }
+
+    memcpy(payload, buf, len);
+    kmmap_ring_commit(ring, len);
+    return 0;
+}
+
+/**
+ * \brief Get the next record without consuming it (consumer).
+ * \param ring ring.
+ * \param len filled with length of payload.
+ * \return pointer to payload, or NULL if ring is empty.
+ */
+static inline const void* kmmap_ring_peek(struct kmmap_ring* ring,
+        uint32_t* len)
+{
+    struct kmmap_ring_record* record = NULL;
+
+    for(;;)
+    {
+        if(ring->tail == ring->head)
+        {
+            /* refresh cached head */
+            ring->head = __atomic_load_n(&ring->header->head,
+                    __ATOMIC_ACQUIRE);
+
+            if(ring->tail == ring->head)
+            {
+                return NULL;
+            }
+        }
+
+        record = (struct kmmap_ring_record*)(ring->data +
+                (ring->tail & ring->mask));
+
+        if(!(record->flags & KMMAP_RING_PAD))
+        {
+            break;
+        }
+
+        /* skip padding up to the end of data area */
+        ring->tail += sizeof(struct kmmap_ring_record) + record->len;
+    }
+
+    *len = record->len;
+    return record + 1;
+}
+
+/**
+ * \brief Give back the space of the record returned by kmmap_ring_peek()
+ * (consumer).
+ * \param ring ring.
+ * \param len length of payload.
+ */
+static inline void kmmap_ring_release(struct kmmap_ring* ring, uint32_t len)
+{
+    ring->tail += kmmap_ring_record_size(len);
+    __atomic_store_n(&ring->header->tail, ring->tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Copy the next record out of the ring (consumer).
+ * \param ring ring.
+ * \param buf buffer to fill.
+ * \param len size of buffer.
+ * \return length of payload, -1 otherwise (errno is EAGAIN if ring is empty,
+ * EMSGSIZE if buffer is too small).
+ */
+static inline int64_t kmmap_ring_consume(struct kmmap_ring* ring, void* buf,
+        size_t len)
+{
+    uint32_t record_len = 0;
+    const void* payload = kmmap_ring_peek(ring, &record_len);
+
+    if(!payload)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if(record_len > len)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    memcpy(buf, payload, record_len);
+    kmmap_ring_release(ring, record_len);
+    return record_len;
+}
+
+/**
+ * \brief Check if the consumer has to be kicked after a commit (producer).
+ *
+ * If it returns 1, the producer calls ioctl(KMMAP_IOCKICK).
+ * \param ring ring.
+ * \return 1 if consumer sleeps, 0 otherwise.
+ */
+static inline int kmmap_ring_need_wakeup(struct kmmap_ring* ring)
+{
+    /* order the store of head with the load of flags */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return (__atomic_load_n(&ring->header->flags, __ATOMIC_RELAXED) &
+            KMMAP_RING_NEED_WAKEUP) != 0;
+}
+
+/**
+ * \brief Announce that the consumer is about to sleep (consumer).
+ *
+ * If it returns 1, the consumer can wait with poll() or on its eventfd, then
+ * call kmmap_ring_finish_wait().
+ * \param ring ring.
+ * \return 1 if ring is still empty, 0 otherwise (flag is cleared).
+ */
+static inline int kmmap_ring_prepare_wait(struct kmmap_ring* ring)
+{
+    __atomic_store_n(&ring->header->flags, KMMAP_RING_NEED_WAKEUP,
+            __ATOMIC_RELAXED);
+    /* order the store of flags with the load of head */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    ring->head = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+    if(ring->head != ring->tail)
+    {
+        __atomic_store_n(&ring->header->flags, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * \brief Announce that the consumer is awake (consumer).
+ * \param ring ring.
+ */
+static inline void kmmap_ring_finish_wait(struct kmmap_ring* ring)
+{
+    __atomic_store_n(&ring->header->flags, 0, __ATOMIC_RELAXED);
+}
+
+#endif /* KMMAP_RING_H */
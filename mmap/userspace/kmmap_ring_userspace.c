@@ -0,0 +1,313 @@
+/*
+ * kmmap_ring_userspace - SPSC ring over kmmap between two processes.
+ * Copyright (c) 2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file kmmap_ring_userspace.c
+ * \brief Userspace program to exchange records through a kmmap ring.
+ * \author Sebastien Vincent
+ * \date 2017
+ *
+ * The parent process produces records with a sequence number, the child
+ * consumes and checks them. No system call is done while records flow.
+ *
+ * Usage: kmmap_ring_userspace [count] [size] [spin|poll|eventfd]
+ *
+ * With poll or eventfd, an idle consumer sleeps and the producer kicks it only
+ * when it announced it (KMMAP_RING_NEED_WAKEUP).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+#include "kmmap_ring.h"
+
+/**
+ * \brief Number of empty peeks before the consumer sleeps.
+ */
+#define RING_SPIN_COUNT 1024
+
+/**
+ * \enum ring_wait
+ * \brief How the consumer waits for records.
+ */
+enum ring_wait
+{
+    RING_WAIT_SPIN, /**< Busy-poll the ring. */
+    RING_WAIT_POLL, /**< Sleep in poll() on the device. */
+    RING_WAIT_EVENTFD, /**< Sleep in read() of an eventfd. */
+};
+
+/**
+ * \brief Current monotonic time.
+ * \return time in seconds.
+ */
+static double ring_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * \brief Sleep until the producer kicks.
+ * \param ring ring.
+ * \param wait how to wait.
+ * \param fd device or eventfd.
+ * \return 1 if the consumer slept, 0 otherwise.
+ */
+static int ring_sleep(struct kmmap_ring* ring, enum ring_wait wait, int fd)
+{
+    uint64_t value = 0;
+    struct pollfd pfd;
+
+    if(!kmmap_ring_prepare_wait(ring))
+    {
+        return 0;
+    }
+
+    if(wait == RING_WAIT_POLL)
+    {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, -1);
+    }
+    else
+    {
+        if(read(fd, &value, sizeof(value)) == -1)
+        {
+            perror("read");
+        }
+    }
+
+    kmmap_ring_finish_wait(ring);
+    return 1;
+}
+
+/**
+ * \brief Consume records and check their sequence number.
+ * \param ring ring.
+ * \param count number of records to consume.
+ * \param wait how to wait.
+ * \param fd device or eventfd.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int ring_consumer(struct kmmap_ring* ring, uint64_t count,
+        enum ring_wait wait, int fd)
+{
+    uint64_t expected = 0;
+    uint64_t sleeps = 0;
+    unsigned int spins = 0;
+    double start = ring_now();
+
+    while(expected < count)
+    {
+        uint32_t len = 0;
+        const void* payload = kmmap_ring_peek(ring, &len);
+        uint64_t seq = 0;
+
+        if(!payload)
+        {
+            if(wait != RING_WAIT_SPIN && ++spins >= RING_SPIN_COUNT)
+            {
+                sleeps += ring_sleep(ring, wait, fd);
+                spins = 0;
+            }
+            continue;
+        }
+
+        spins = 0;
+
+        memcpy(&seq, payload, sizeof(seq));
+        if(seq != expected)
+        {
+            fprintf(stderr, "consumer: got %lu expected %lu\n",
+                    (unsigned long)seq, (unsigned long)expected);
+            return EXIT_FAILURE;
+        }
+
+        kmmap_ring_release(ring, len);
+        expected++;
+    }
+
+    printf("consumer: %lu records, %.0f records/s, %lu sleeps\n",
+            (unsigned long)count, count / (ring_now() - start),
+            (unsigned long)sleeps);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * \brief Produce records with a sequence number.
+ * \param ring ring.
+ * \param count number of records to produce.
+ * \param size size of records.
+ * \param wait how the consumer waits.
+ * \param fd device.
+ */
+static void ring_producer(struct kmmap_ring* ring, uint64_t count,
+        uint32_t size, enum ring_wait wait, int fd)
+{
+    uint64_t seq = 0;
+    uint64_t kicks = 0;
+
+    while(seq < count)
+    {
+        void* payload = kmmap_ring_reserve(ring, size);
+
+        if(!payload)
+        {
+            /* full */
+            continue;
+        }
+
+        memcpy(payload, &seq, sizeof(seq));
+        kmmap_ring_commit(ring, size);
+        seq++;
+
+        if(wait != RING_WAIT_SPIN && kmmap_ring_need_wakeup(ring))
+        {
+            if(ioctl(fd, KMMAP_IOCKICK) == -1)
+            {
+                perror("ioctl");
+            }
+            kicks++;
+        }
+    }
+
+    printf("producer: %lu records, %lu kicks\n", (unsigned long)count,
+            (unsigned long)kicks);
+}
+
+/**
+ * \brief Entry point of the program.
+ * \param argc number of arguments.
+ * \param argv array of arguments.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int main(int argc, char** argv)
+{
+    int fd = -1;
+    uint64_t count = argc > 1 ? strtoull(argv[1], NULL, 0) : 10000000;
+    uint32_t size = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : 64;
+    enum ring_wait wait = RING_WAIT_SPIN;
+    int wait_fd = -1;
+    uint64_t mem_size = 0;
+    uint64_t data_size = 0;
+    struct kmmap_ring ring;
+    char* mem = NULL;
+    pid_t pid = -1;
+    int status = 0;
+
+    if(size < sizeof(uint64_t))
+    {
+        fprintf(stderr, "Size must be at least %zu\n", sizeof(uint64_t));
+        exit(EXIT_FAILURE);
+    }
+
+    if(argc > 3 && strcmp(argv[3], "poll") == 0)
+    {
+        wait = RING_WAIT_POLL;
+    }
+    else if(argc > 3 && strcmp(argv[3], "eventfd") == 0)
+    {
+        wait = RING_WAIT_EVENTFD;
+    }
+    else if(argc > 3 && strcmp(argv[3], "spin") != 0)
+    {
+        fprintf(stderr, "Usage: %s [count] [size] [spin|poll|eventfd]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open("/dev/kmmap", O_RDWR);
+    if(fd == -1)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    if(ioctl(fd, KMMAP_IOCGSIZE, &mem_size) == -1 ||
+            ioctl(fd, KMMAP_IOCRINGINIT, &data_size) == -1)
+    {
+        perror("ioctl");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    if(kmmap_ring_attach(&ring, mem, mem_size) == -1)
+    {
+        perror("kmmap_ring_attach");
+        munmap(mem, mem_size);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    wait_fd = fd;
+    if(wait == RING_WAIT_EVENTFD)
+    {
+        int32_t efd = eventfd(0, 0);
+
+        if(efd == -1 || ioctl(fd, KMMAP_IOCSEVENTFD, &efd) == -1)
+        {
+            perror("eventfd");
+            munmap(mem, mem_size);
+            close(fd);
+            exit(EXIT_FAILURE);
+        }
+        wait_fd = efd;
+    }
+
+    pid = fork();
+    if(pid == -1)
+    {
+        perror("fork");
+        munmap(mem, mem_size);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    else if(pid == 0)
+    {
+        _exit(ring_consumer(&ring, count, wait, wait_fd));
+    }
+
+    ring_producer(&ring, count, size, wait, fd);
+    waitpid(pid, &status, 0);
+
+    if(wait_fd != fd)
+    {
+        close(wait_fd);
+    }
+    munmap(mem, mem_size);
+    close(fd);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
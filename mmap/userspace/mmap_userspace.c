@@ -11,10 +11,17 @@
  * \brief Userspace program to test kmmap kernel module.
  * \author Sebastien Vincent
  * \date 2017
+ *
+ * Usage: mmap_userspace [message]
+ *
+ * With a message, write it to the memory of the device, otherwise print the
+ * memory. The program asks for the memory shared by all files
+ * (KMMAP_IOCSHARED), so the message is still there for the next run.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -22,6 +29,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "kmmap.h"
 
 /**
  * \brief Entry point of the program.
@@ -43,6 +53,14 @@ int main(int argc, char** argv)
         exit(EXIT_FAILURE);
     }
 
+    /* each file has its own memory otherwise */
+    if(ioctl(fd, KMMAP_IOCSHARED) == -1)
+    {
+        perror("ioctl");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
     mem = mmap(NULL, 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0); 
 
     if(mem == MAP_FAILED)
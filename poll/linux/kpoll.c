@@ -20,49 +20,170 @@
 #include <linux/fs.h>
 #include <linux/sched.h>
 #include <linux/wait.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/string.h>
 #include <linux/poll.h>
+#include <linux/uio.h>
 
 #include <asm/uaccess.h>
 
+#include "kpoll.h"
+
+/**
+ * \def RING_MAX_SIZE
+ * \brief Maximum size of the message ring in bytes.
+ */
+#define RING_MAX_SIZE (1UL << 30)
+
+/**
+ * \def RECORD_ALIGN
+ * \brief Alignment of records in the ring.
+ */
+#define RECORD_ALIGN 8
+
+/**
+ * \def RECORD_PAD
+ * \brief Record only fills the end of the ring (or was discarded), skip it.
+ */
+#define RECORD_PAD 0x1
+
+/**
+ * \def RECORD_BUSY
+ * \brief Record is being filled by a writer or copied by a reader.
+ */
+#define RECORD_BUSY 0x2
+
+/**
+ * \struct ring_record
+ * \brief Header of a message in the ring, followed by the data.
+ *
+ * Records never wrap: if one does not fit before the end of the ring, a pad
+ * record fills the end and the message starts again at offset 0.
+ */
+struct ring_record
+{
+    uint32_t len; /**< Length of the message (pad: length of the pad). */
+    uint32_t flags; /**< RECORD_* flags. */
+};
+
+/**
+ * \struct ring
+ * \brief Ring of variable-length messages.
+ *
+ * Positions are free-running byte offsets with
+ * head <= claim <= tail <= reserve, so dequeue never moves data. Records are
+ * reserved and claimed under the lock, but user copies happen outside of it:
+ * - [head, claim): records being copied to readers;
+ * - [claim, tail): records ready to be read;
+ * - [tail, reserve): records being copied from writers.
+ * head (resp. tail) only moves over records that are no longer busy, so
+ * records are released in order whatever order copies end.
+ *
+ * With a single reader and a single writer, the lock is not taken: only the
+ * reader moves head and claim, only the writer moves tail and reserve (see
+ * ring_spsc_*()). Each side has its own cache line.
+ */
+struct ring
+{
+    char* buffer; /**< Storage. */
+    size_t size; /**< Size of storage (power of two). */
+    size_t max_len; /**< Maximum length of a message. */
+    /** Position of the oldest record still in use. */
+    size_t head ____cacheline_aligned_in_smp;
+    size_t claim; /**< Position of the next record to read. */
+    /** End of the published records. */
+    size_t tail ____cacheline_aligned_in_smp;
+    size_t reserve; /**< Position of the next record to write. */
+};
+
+/**
+ * \struct kpoll_channel
+ * \brief Independent message queue.
+ *
+ * Each priority has its own ring (lane) so that a full low priority lane does
+ * not block urgent messages, readers always serve the highest lane first.
+ * Aligned on a cache line so that busy channels do not share one.
+ *
+ * A channel with one reader and one writer switches to the lock-free path
+ * (spsc): readers only serialize with readers (read_mutex), writers with
+ * writers (write_mutex). spsc changes with both mutexes and the lock held,
+ * so it is stable while holding any of them.
+ */
+struct kpoll_channel
+{
+    spinlock_t lock; /**< Protects lanes. */
+    struct ring lanes[KPOLL_PRIO_MAX]; /**< Messages, one ring per priority. */
+    wait_queue_head_t read_wq; /**< Readers waiting for a message. */
+    wait_queue_head_t write_wq[KPOLL_PRIO_MAX]; /**< Writers waiting per lane. */
+    struct mutex read_mutex; /**< Serializes readers on the lock-free path. */
+    struct mutex write_mutex; /**< Serializes writers on the lock-free path. */
+    int readers; /**< Files with KPOLL_ROLE_READ (protected by lock). */
+    int writers; /**< Files with KPOLL_ROLE_WRITE (protected by lock). */
+    bool spsc; /**< Lock-free path is used. */
+    struct kref refcount; /**< Files attached. */
+    struct hlist_node node; /**< Entry in g_channels. */
+    char name[KPOLL_NAME_MAX]; /**< Name, empty for the default channel. */
+} ____cacheline_aligned_in_smp;
+
 /**
- * \def MSG_ARRAY_SIZE.
- * \brief Size of the messages array.
+ * \struct kpoll_file
+ * \brief Per-open state.
  */
-#define MSG_ARRAY_SIZE 10
+struct kpoll_file
+{
+    bool framed; /**< read() and write() carry several kpoll_frame. */
+    unsigned int priority; /**< Lane of the messages written (not framed). */
+    unsigned int role; /**< KPOLL_ROLE_* flags. */
+    struct kpoll_channel* channel; /**< Channel used by this file. */
+};
 
 /* forward declarations */
 static int kpoll_open(struct inode* inodep, struct file* filep);
 static int kpoll_release(struct inode* inodep, struct file* filep);
-static ssize_t kpoll_write(struct file* filep, const char* buffer,
-        size_t len, loff_t* offset);
-static ssize_t kpoll_read(struct file* filep, char* buffer, size_t len,
-        loff_t* offset);
+static ssize_t kpoll_write_iter(struct kiocb* iocb, struct iov_iter* from);
+static ssize_t kpoll_read_iter(struct kiocb* iocb, struct iov_iter* to);
+static long kpoll_ioctl(struct file* filep, unsigned int cmd,
+        unsigned long arg);
 static unsigned int kpoll_poll(struct file* filep, poll_table* wait);
 
 /**
- * \brief The wait queue.
+ * \brief Use the lock-free path when a channel has one reader and one writer
+ * (configuration parameter).
+ */
+static bool spsc = 1;
+
+/**
+ * \brief Capacity in bytes of the message ring (configuration parameter).
+ *
+ * It is rounded up to a power of two.
  */
-DECLARE_WAIT_QUEUE_HEAD(wq);
+static unsigned long ring_size = 16384;
 
 /**
- * \brief Use non-blocking read() if file requests it (configuration parameter).
+ * \brief Maximum size of a message (configuration parameter).
  */
-static bool nonblock = 0;
+static unsigned int msg_size = 1023;
 
 /**
- * \brief Message in kernel side for the device.
+ * \brief Channel of the files that did not attach to a named one.
  */
-static char g_messages[MSG_ARRAY_SIZE][1024]; 
+static struct kpoll_channel g_default;
 
 /**
- * \brief Number of message in g_message.
+ * \brief Named channels, hashed by name.
  */
-static size_t g_messages_count = 0;
+static DEFINE_HASHTABLE(g_channels, 8);
 
 /**
- * \brief Spinlock to control read/write in the array.
+ * \brief Mutex to control lookup, creation and removal of named channels.
  */
-static spinlock_t spinlock_wq;
+static DEFINE_MUTEX(g_channels_lock);
 
 /**
  * \brief File operations.
@@ -71,8 +192,9 @@ static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = kpoll_open,
     .release = kpoll_release,
-    .read = kpoll_read,
-    .write = kpoll_write,
+    .read_iter = kpoll_read_iter,
+    .write_iter = kpoll_write_iter,
+    .unlocked_ioctl = kpoll_ioctl,
     .poll = kpoll_poll,
 };
 
@@ -86,230 +208,1624 @@ static struct miscdevice kpoll_misc = {
 };
 
 /**
- * \brief Open callback for character device.
- * \param inodep inode.
- * \param filep file.
- * \return 0 if success, negative value otherwise.
+ * \brief Size taken in the ring by a message.
+ * \param len length of the message.
+ * \return size of the record.
  */
-static int kpoll_open(struct inode* inodep, struct file* filep)
+static size_t ring_record_size(size_t len)
 {
-    printk(KERN_INFO "%s: open\n", THIS_MODULE->name);
-    return 0;
+    return ALIGN(sizeof(struct ring_record) + len, RECORD_ALIGN);
 }
 
 /**
- * \brief Release callback for character device.
- * \param inodep inode.
- * \param filep file.
- * \return 0 if success, negative value otherwise.
+ * \brief Get the record at a position.
+ * \param ring ring.
+ * \param pos position.
+ * \return record.
  */
-static int kpoll_release(struct inode* inodep, struct file* filep)
+static struct ring_record* ring_record(struct ring* ring, size_t pos)
 {
-    printk(KERN_INFO "%s: release\n", THIS_MODULE->name);
-    return 0;
+    return (struct ring_record*)(ring->buffer + (pos & (ring->size - 1)));
 }
 
 /**
- * \brief Read callback for character device.
- * \param filep file.
- * \param u_buffer buffer to fill.
- * \param len length to read.
- * \param offset offset of the buffer.
- * \return number of characters read, or negative value if failure.
+ * \brief Test if the ring has a record to read.
+ * \param ring ring.
+ * \return true if readable.
  */
-static ssize_t kpoll_read(struct file* filep, char* u_buffer, size_t len,
-        loff_t* offset)
+static bool ring_readable(struct ring* ring)
 {
-    int err = 0;
-    ssize_t len_msg = 0;
-    unsigned long mask = 0;
+    return READ_ONCE(ring->claim) != READ_ONCE(ring->tail);
+}
 
-    printk(KERN_INFO "%s: wants to read %zu bytes from offset %lld\n",
-            THIS_MODULE->name, len, *offset);
+/**
+ * \brief Space needed to reserve a message, pad included.
+ * \param ring ring.
+ * \param len length of the message.
+ * \return number of bytes.
+ */
+static size_t ring_needed(struct ring* ring, size_t len)
+{
+    size_t size = READ_ONCE(ring->size);
+    size_t offset = READ_ONCE(ring->reserve) & (size - 1);
+    size_t needed = ring_record_size(len);
+
+    if(offset + needed > size)
+    {
+        needed += size - offset;
+    }
+    return needed;
+}
 
-    spin_lock_irqsave(&spinlock_wq, mask);
+/**
+ * \brief Test if a message fits in the ring.
+ * \param ring ring.
+ * \param len length of the message.
+ * \return true if it fits.
+ */
+static bool ring_fits(struct ring* ring, size_t len)
+{
+    size_t used = READ_ONCE(ring->reserve) - READ_ONCE(ring->head);
 
-    while(g_messages_count == 0)
+    if(len > READ_ONCE(ring->max_len))
     {
-        /* array empty, wait for item */
-        spin_unlock_irqrestore(&spinlock_wq, mask);
+        return false;
+    }
+    return READ_ONCE(ring->size) - used >= ring_needed(ring, len);
+}
 
-        /* returns now if nonblock is requested */
-        if(nonblock && filep->f_flags & O_NONBLOCK)
+/**
+ * \brief Reserve a message at the end of the ring.
+ *
+ * Must be called with the lock held and ring_fits() true. The caller fills
+ * the data without the lock then calls ring_commit().
+ * \param ring ring.
+ * \param len length of the message.
+ * \return record to fill.
+ */
+static struct ring_record* ring_reserve(struct ring* ring, size_t len)
+{
+    size_t offset = ring->reserve & (ring->size - 1);
+    struct ring_record* record = NULL;
+
+    if(offset + ring_record_size(len) > ring->size)
+    {
+        /* fill the end of the ring and start again at 0 */
+        record = ring_record(ring, ring->reserve);
+        record->len = ring->size - offset - sizeof(struct ring_record);
+        record->flags = RECORD_PAD;
+        ring->reserve += ring->size - offset;
+    }
+
+    record = ring_record(ring, ring->reserve);
+    record->len = len;
+    record->flags = RECORD_BUSY;
+    ring->reserve += ring_record_size(len);
+    return record;
+}
+
+/**
+ * \brief Publish a message filled after ring_reserve().
+ *
+ * Must be called with the lock held.
+ * \param ring ring.
+ * \param record record.
+ * \param valid false to discard the record (i.e. copy failed).
+ * \return true if new records are readable.
+ */
+static bool ring_commit(struct ring* ring, struct ring_record* record,
+        bool valid)
+{
+    size_t tail = ring->tail;
+
+    record->flags = valid ? 0 : RECORD_PAD;
+
+    /* a writer still copying holds back the records after its own */
+    while(ring->tail != ring->reserve &&
+            !(ring_record(ring, ring->tail)->flags & RECORD_BUSY))
+    {
+        ring->tail += ring_record_size(ring_record(ring, ring->tail)->len);
+    }
+    return ring->tail != tail;
+}
+
+/**
+ * \brief Get the oldest unread message without claiming it.
+ *
+ * Must be called with the lock held.
+ * \param ring ring.
+ * \return record, or NULL if there is nothing to read.
+ */
+static struct ring_record* ring_peek(struct ring* ring)
+{
+    while(ring->claim != ring->tail)
+    {
+        struct ring_record* record = ring_record(ring, ring->claim);
+        bool front = ring->head == ring->claim;
+
+        if(!(record->flags & RECORD_PAD))
         {
-            return -EAGAIN;
+            return record;
         }
 
-        if(wait_event_interruptible(wq, (g_messages_count > 0)) != 0)
+        ring->claim += ring_record_size(record->len);
+
+        if(front)
         {
-            return -ERESTARTSYS;
+            /* nothing in use before the pad, release it now */
+            ring->head = ring->claim;
         }
-        
-        spin_lock_irqsave(&spinlock_wq, mask);
     }
+    return NULL;
+}
 
-    /* calculate buffer size left to copy */
-    len_msg = strlen(g_messages[0]);
+/**
+ * \brief Claim the message returned by ring_peek().
+ *
+ * Must be called with the lock held. The caller copies the data without the
+ * lock then calls ring_release().
+ * \param ring ring.
+ * \param record record.
+ */
+static void ring_claim(struct ring* ring, struct ring_record* record)
+{
+    record->flags = RECORD_BUSY;
+    ring->claim += ring_record_size(record->len);
+}
 
-    if(len_msg == 0)
-    {
-        /* EOF */
-        spin_unlock_irqrestore(&spinlock_wq, mask);
-        return 0;
-    }
-    else if(len_msg > len)
+/**
+ * \brief Release messages claimed with ring_claim().
+ *
+ * Must be called with the lock held.
+ * \param ring ring.
+ * \param start position of the first claimed record.
+ * \param end position after the last claimed record.
+ * \return true if space was freed.
+ */
+static bool ring_release(struct ring* ring, size_t start, size_t end)
+{
+    size_t head = ring->head;
+
+    while(start != end)
     {
-        len_msg = len;
+        struct ring_record* record = ring_record(ring, start);
+
+        start += ring_record_size(record->len);
+        record->flags &= ~RECORD_BUSY;
     }
-    else if(len_msg < 0)
+
+    /* a reader still copying holds back the records after its own */
+    while(ring->head != ring->claim &&
+            !(ring_record(ring, ring->head)->flags & RECORD_BUSY))
     {
-        spin_unlock_irqrestore(&spinlock_wq, mask);
-        return -EINVAL;
+        ring->head += ring_record_size(ring_record(ring, ring->head)->len);
     }
+    return ring->head != head;
+}
 
-    err = copy_to_user(u_buffer, g_messages[0], len_msg);
+/**
+ * \brief Reserve a message without the lock (single writer).
+ * \param ring ring.
+ * \param len length of message.
+ * \return record, or NULL if it does not fit.
+ */
+static struct ring_record* ring_spsc_reserve(struct ring* ring, size_t len)
+{
+    /* pairs with smp_store_release() of ring_spsc_release() */
+    size_t head = smp_load_acquire(&ring->head);
 
-    /* shift other messages */
-    if(g_messages_count > 1)
+    if(ring->size - (ring->reserve - head) < ring_needed(ring, len))
     {
-        memmove(g_messages, g_messages + 1, (g_messages_count - 1) * 1024);
+        return NULL;
     }
-    g_messages_count--;
+    return ring_reserve(ring, len);
+}
+
+/**
+ * \brief Publish a message filled after ring_spsc_reserve().
+ * \param ring ring.
+ * \param record record.
+ * \param valid false to discard the record (i.e. copy failed).
+ */
+static void ring_spsc_commit(struct ring* ring, struct ring_record* record,
+        bool valid)
+{
+    record->flags = valid ? 0 : RECORD_PAD;
 
-    spin_unlock_irqrestore(&spinlock_wq, mask);
+    /* pairs with smp_load_acquire() of ring_spsc_peek() */
+    smp_store_release(&ring->tail, ring->reserve);
+}
 
-    /* array has at least one space left */
-    wake_up_interruptible(&wq);
+/**
+ * \brief Get the oldest unread message without the lock (single reader).
+ *
+ * Claim it with ring_spsc_claim(), pads are skipped and released by
+ * ring_spsc_release().
+ * \param ring ring.
+ * \return record, or NULL if there is nothing to read.
+ */
+static struct ring_record* ring_spsc_peek(struct ring* ring)
+{
+    /* pairs with smp_store_release() of ring_spsc_commit() */
+    size_t tail = smp_load_acquire(&ring->tail);
 
-    if(err == 0)
+    while(ring->claim != tail)
     {
-        /* success */
-        printk(KERN_DEBUG "%s: sent %zu characters to user\n", THIS_MODULE->name,
-                len_msg);
+        struct ring_record* record = ring_record(ring, ring->claim);
 
-        /* *offset += len_msg; */
-        return len_msg;
+        if(!(record->flags & RECORD_PAD))
+        {
+            return record;
+        }
+        ring->claim += ring_record_size(record->len);
     }
-    else
+    return NULL;
+}
+
+/**
+ * \brief Claim the message returned by ring_spsc_peek().
+ * \param ring ring.
+ * \param record record.
+ */
+static void ring_spsc_claim(struct ring* ring, struct ring_record* record)
+{
+    /* only this reader looks at claimed records, no need to mark them */
+    ring->claim += ring_record_size(record->len);
+}
+
+/**
+ * \brief Release every claimed message without the lock (single reader).
+ * \param ring ring.
+ * \return true if space was freed.
+ */
+static bool ring_spsc_release(struct ring* ring)
+{
+    if(ring->head == ring->claim)
     {
-        printk(KERN_DEBUG "%s: failed to send %zu characters to user\n",
-                THIS_MODULE->name, len_msg);
-        return -EFAULT;
+        return false;
     }
+
+    /* data is copied, pairs with smp_load_acquire() of ring_spsc_reserve() */
+    smp_store_release(&ring->head, ring->claim);
+    return true;
 }
 
 /**
- * \brief Write callback for character device.
- * \param filep file.
- * \param u_buffer buffer that contains data to write.
- * \param len length to write.
- * \param offset offset of the buffer.
- * \return number of characters written, or negative value if failure.
+ * \brief Wake up one waiter (and all pollers), if any.
+ *
+ * Readers and writers wait exclusively, so a message (resp. a free space)
+ * wakes only one of them. The one that is woken up passes the wake-up on if
+ * more messages (resp. space) are left.
+ * \param queue wait queue.
+ * \param key POLL* events of the wake-up.
+ */
+static void kpoll_wake(wait_queue_head_t* queue, unsigned int key)
+{
+    /* pairs with the barrier of prepare_to_wait(), see waitqueue_active() */
+    smp_mb();
+
+    if(waitqueue_active(queue))
+    {
+        wake_up_interruptible_poll(queue, key);
+    }
+}
+
+/**
+ * \brief Replace the storage of the messages of a channel.
+ *
+ * Lanes must be empty and idle.
+ * \param channel channel.
+ * \param size capacity in bytes of each lane, 0 keeps the current one.
+ * \param max_len maximum length of a message, 0 keeps the current one.
+ * \return 0 if success, negative value otherwise.
  */
-static ssize_t kpoll_write(struct file* filep, const char* u_buffer,
-        size_t len, loff_t* offset)
+static int kpoll_configure(struct kpoll_channel* channel, uint64_t size,
+        uint64_t max_len)
 {
-    ssize_t len_msg = len + *offset;
+    char* buffers[KPOLL_PRIO_MAX];
     unsigned long mask = 0;
+    unsigned int i = 0;
+    bool busy = false;
 
-    printk(KERN_INFO "%s: wants to write %zu bytes from %lld offset\n",
-            THIS_MODULE->name, len, *offset);
+    size = size ? size : READ_ONCE(channel->lanes[0].size);
+    max_len = max_len ? max_len : READ_ONCE(channel->lanes[0].max_len);
+
+    if(size == 0 || size > RING_MAX_SIZE || max_len == 0 ||
+            max_len > RING_MAX_SIZE)
+    {
+        return -EINVAL;
+    }
 
-    spin_lock_irqsave(&spinlock_wq, mask);
+    size = roundup_pow_of_two(size);
 
-    while(g_messages_count >= MSG_ARRAY_SIZE)
+    /* a record must fit even when a pad is needed in front of it */
+    if(ring_record_size(max_len) > size / 2)
     {
-        /* array full, wait for empty space */
-        spin_unlock_irqrestore(&spinlock_wq, mask);
+        return -EINVAL;
+    }
 
-        if(nonblock && filep->f_flags & O_NONBLOCK)
+    for(i = 0; i < KPOLL_PRIO_MAX; i++)
+    {
+        buffers[i] = vmalloc(size);
+        if(!buffers[i])
         {
-            return -EAGAIN;
+            while(i-- > 0)
+            {
+                vfree(buffers[i]);
+            }
+            return -ENOMEM;
         }
+    }
 
-        if(wait_event_interruptible(wq,
-              (g_messages_count < MSG_ARRAY_SIZE)) != 0)
-        {
-            return -ERESTARTSYS;
-        }
+    /* no lock-free operation either */
+    mutex_lock(&channel->read_mutex);
+    mutex_lock(&channel->write_mutex);
+    spin_lock_irqsave(&channel->lock, mask);
 
-        spin_lock_irqsave(&spinlock_wq, mask);
+    for(i = 0; i < KPOLL_PRIO_MAX; i++)
+    {
+        busy |= channel->lanes[i].head != channel->lanes[i].reserve;
     }
 
-    if(len_msg > (1024 - 1))
+    for(i = 0; !busy && i < KPOLL_PRIO_MAX; i++)
     {
-        spin_unlock_irqrestore(&spinlock_wq, mask);
-        return -E2BIG;
+        struct ring* lane = &channel->lanes[i];
+
+        swap(lane->buffer, buffers[i]);
+        lane->size = size;
+        lane->max_len = max_len;
+        lane->head = 0;
+        lane->claim = 0;
+        lane->tail = 0;
+        lane->reserve = 0;
     }
 
-    if(copy_from_user(g_messages[g_messages_count], u_buffer, len) != 0)
+    spin_unlock_irqrestore(&channel->lock, mask);
+    mutex_unlock(&channel->write_mutex);
+    mutex_unlock(&channel->read_mutex);
+
+    /* old storage, or new one if busy */
+    for(i = 0; i < KPOLL_PRIO_MAX; i++)
     {
-        spin_unlock_irqrestore(&spinlock_wq, mask);
-        return -EFAULT;
+        vfree(buffers[i]);
     }
 
-    g_messages[g_messages_count][len] = 0x00;
-    g_messages_count++;
-    
-    spin_unlock_irqrestore(&spinlock_wq, mask);
- 
-    /* array has at least one item left */
-    wake_up_interruptible(&wq);
+    if(busy)
+    {
+        return -EBUSY;
+    }
 
-    *offset += len;
-    printk(KERN_INFO "%s: received %zu characters from user\n",
-            THIS_MODULE->name, len);
-    return len;
+    /* writers may wait for a bigger ring or have a too big message now */
+    for(i = 0; i < KPOLL_PRIO_MAX; i++)
+    {
+        wake_up_interruptible_all(&channel->write_wq[i]);
+    }
+    return 0;
 }
 
 /**
- * \brief See if data is ready.
- * \param filep file descriptor.
- * \param wait table to hold waitqueues.
- * \return mask of POLL* value or 0 if nothing available yet.
+ * \brief Account the role of a file in a channel and choose the path.
+ *
+ * The lock-free path is entered only when no locked operation is copying
+ * (lanes idle), otherwise the last one calls this function again.
+ * \param channel channel.
+ * \param role KPOLL_ROLE_* flags of the file.
+ * \param delta 1 if file comes, -1 if it goes, 0 to only choose the path.
  */
-static unsigned int kpoll_poll(struct file* filep, poll_table* wait)
+static void kpoll_spsc_update(struct kpoll_channel* channel,
+        unsigned int role, int delta)
 {
-  unsigned int mask = 0;
+    unsigned long mask = 0;
+    unsigned int i = 0;
+    bool fast = false;
 
-  /* adds waitqueue to the table */
-  poll_wait(filep, &wq, wait);
+    /* no lock-free operation is running while both mutexes are held */
+    mutex_lock(&channel->read_mutex);
+    mutex_lock(&channel->write_mutex);
+    spin_lock_irqsave(&channel->lock, mask);
 
-  if(g_messages_count < MSG_ARRAY_SIZE)
-  {
-    mask |= POLLOUT | POLLWRNORM;
-  }
-  
-  if(g_messages_count > 0)
-  {
-    mask |= POLLIN | POLLRDNORM;
-  }
+    channel->readers += role & KPOLL_ROLE_READ ? delta : 0;
+    channel->writers += role & KPOLL_ROLE_WRITE ? delta : 0;
 
-  return mask;
+    fast = READ_ONCE(spsc) && channel->readers == 1 && channel->writers == 1;
+
+    for(i = 0; fast && !channel->spsc && i < KPOLL_PRIO_MAX; i++)
+    {
+        struct ring* lane = &channel->lanes[i];
+
+        fast = lane->head == lane->claim && lane->tail == lane->reserve;
+    }
+    WRITE_ONCE(channel->spsc, fast);
+
+    spin_unlock_irqrestore(&channel->lock, mask);
+    mutex_unlock(&channel->write_mutex);
+    mutex_unlock(&channel->read_mutex);
+}
+
+/**
+ * \brief Test if a channel waits for locked operations to end before
+ * switching to the lock-free path.
+ * \param channel channel.
+ * \return true if kpoll_spsc_update() has to be called.
+ */
+static bool kpoll_spsc_pending(struct kpoll_channel* channel)
+{
+    return READ_ONCE(spsc) && !READ_ONCE(channel->spsc) &&
+        READ_ONCE(channel->readers) == 1 && READ_ONCE(channel->writers) == 1;
 }
 
+/**
+ * \brief Free the storage of the messages of a channel.
+ * \param channel channel.
+ */
+static void kpoll_channel_destroy(struct kpoll_channel* channel)
+{
+    unsigned int i = 0;
+
+    for(i = 0; i < KPOLL_PRIO_MAX; i++)
+    {
+        vfree(channel->lanes[i].buffer);
+        channel->lanes[i].buffer = NULL;
+    }
+}
 
 /**
- * \brief Module initialization.
- *
- * Set up stuff when module is added.
+ * \brief Initialize a channel.
+ * \param channel channel.
+ * \param name name.
  * \return 0 if success, negative value otherwise.
  */
-static int __init kpoll_init(void)
+static int kpoll_channel_init(struct kpoll_channel* channel, const char* name)
+{
+    unsigned int i = 0;
+
+    spin_lock_init(&channel->lock);
+    init_waitqueue_head(&channel->read_wq);
+    for(i = 0; i < KPOLL_PRIO_MAX; i++)
+    {
+        init_waitqueue_head(&channel->write_wq[i]);
+    }
+    mutex_init(&channel->read_mutex);
+    mutex_init(&channel->write_mutex);
+    kref_init(&channel->refcount);
+    INIT_HLIST_NODE(&channel->node);
+    strscpy(channel->name, name, sizeof(channel->name));
+
+    /* module parameters are the defaults of every channel */
+    return kpoll_configure(channel, ring_size, msg_size);
+}
+
+/**
+ * \brief Get a named channel, create it if needed.
+ * \param name name.
+ * \return channel with a reference taken, or ERR_PTR() if failure.
+ */
+static struct kpoll_channel* kpoll_channel_get(const char* name)
 {
+    struct kpoll_channel* channel = NULL;
+    u32 key = jhash(name, strlen(name), 0);
     int ret = 0;
 
-    printk(KERN_INFO "%s: initialization\n", THIS_MODULE->name);
+    mutex_lock(&g_channels_lock);
 
-    /* register device */
-    ret = misc_register(&kpoll_misc);
+    hash_for_each_possible(g_channels, channel, node, key)
+    {
+        if(strcmp(channel->name, name) == 0)
+        {
+            kref_get(&channel->refcount);
+            mutex_unlock(&g_channels_lock);
+            return channel;
+        }
+    }
 
-    if(ret == 0)
-    { 
-        printk(KERN_INFO "%s: device created correctly\n", THIS_MODULE->name);
+    channel = kzalloc(sizeof(struct kpoll_channel), GFP_KERNEL);
+    if(!channel)
+    {
+        mutex_unlock(&g_channels_lock);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    ret = kpoll_channel_init(channel, name);
+    if(ret != 0)
+    {
+        mutex_unlock(&g_channels_lock);
+        kfree(channel);
+        return ERR_PTR(ret);
     }
 
-    spin_lock_init(&spinlock_wq); 
+    hash_add(g_channels, &channel->node, key);
+    mutex_unlock(&g_channels_lock);
+
+    printk(KERN_DEBUG "%s: channel %s created\n", THIS_MODULE->name, name);
+    return channel;
+}
+
+/**
+ * \brief Free a named channel, called when last reference is dropped.
+ *
+ * Called with g_channels_lock held, releases it.
+ * \param refcount reference count of the channel.
+ */
+static void kpoll_channel_free(struct kref* refcount)
+{
+    struct kpoll_channel* channel = container_of(refcount,
+            struct kpoll_channel, refcount);
+
+    hash_del(&channel->node);
+    mutex_unlock(&g_channels_lock);
+
+    printk(KERN_DEBUG "%s: channel %s removed\n", THIS_MODULE->name,
+            channel->name);
+    kpoll_channel_destroy(channel);
+    kfree(channel);
+}
+
+/**
+ * \brief Drop a reference on a channel.
+ * \param channel channel.
+ */
+static void kpoll_channel_put(struct kpoll_channel* channel)
+{
+    /* default channel keeps the reference of kpoll_init() */
+    kref_put_mutex(&channel->refcount, kpoll_channel_free, &g_channels_lock);
+}
+
+/**
+ * \brief Attach a file to a named channel.
+ *
+ * A file starts on the default channel and can be attached only once, so
+ * that channel of a file does not change under a running read() or write().
+ * \param file file.
+ * \param u_name name of the channel (userspace).
+ * \return 0 if success, negative value otherwise.
+ */
+static int kpoll_channel_attach(struct kpoll_file* file, const char* u_name)
+{
+    char name[KPOLL_NAME_MAX];
+    struct kpoll_channel* channel = NULL;
+
+    if(copy_from_user(name, u_name, sizeof(name)) != 0)
+    {
+        return -EFAULT;
+    }
+
+    if(strnlen(name, sizeof(name)) == sizeof(name) || name[0] == 0x00)
+    {
+        return -EINVAL;
+    }
+
+    channel = kpoll_channel_get(name);
+    if(IS_ERR(channel))
+    {
+        return PTR_ERR(channel);
+    }
+
+    if(cmpxchg(&file->channel, &g_default, channel) != &g_default)
+    {
+        kpoll_channel_put(channel);
+        return -EBUSY;
+    }
+
+    kpoll_spsc_update(channel, READ_ONCE(file->role), 1);
+    kpoll_spsc_update(&g_default, READ_ONCE(file->role), -1);
+    return 0;
+}
+
+/**
+ * \brief Open callback for character device.
+ * \param inodep inode.
+ * \param filep file.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kpoll_open(struct inode* inodep, struct file* filep)
+{
+    struct kpoll_file* file = kzalloc(sizeof(struct kpoll_file), GFP_KERNEL);
+
+    if(!file)
+    {
+        return -ENOMEM;
+    }
+
+    file->channel = &g_default;
+    file->role = (filep->f_mode & FMODE_READ ? KPOLL_ROLE_READ : 0) |
+        (filep->f_mode & FMODE_WRITE ? KPOLL_ROLE_WRITE : 0);
+    filep->private_data = file;
+    /* read_iter/write_iter honour IOCB_NOWAIT */
+    filep->f_mode |= FMODE_NOWAIT;
+    kpoll_spsc_update(&g_default, file->role, 1);
+    printk(KERN_INFO "%s: open\n", THIS_MODULE->name);
+    return 0;
+}
+
+/**
+ * \brief Release callback for character device.
+ * \param inodep inode.
+ * \param filep file.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kpoll_release(struct inode* inodep, struct file* filep)
+{
+    struct kpoll_file* file = filep->private_data;
+
+    kpoll_spsc_update(file->channel, file->role, -1);
+    if(file->channel != &g_default)
+    {
+        kpoll_channel_put(file->channel);
+    }
+    kfree(file);
+    printk(KERN_INFO "%s: release\n", THIS_MODULE->name);
+    return 0;
+}
+
+/**
+ * \brief Test if a channel has a message to read in any lane.
+ * \param channel channel.
+ * \return true if a message is ready, false otherwise.
+ */
+static bool kpoll_readable(struct kpoll_channel* channel)
+{
+    unsigned int i = 0;
+
+    for(i = 0; i < KPOLL_PRIO_MAX; i++)
+    {
+        if(ring_readable(&channel->lanes[i]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * \brief Get the next record to read from the highest non-empty lane.
+ *
+ * Must be called with lock held.
+ * \param channel channel.
+ * \param prio filled with the lane of the record.
+ * \return record, or NULL if all lanes are empty.
+ */
+static struct ring_record* kpoll_peek(struct kpoll_channel* channel,
+        unsigned int* prio)
+{
+    unsigned int i = KPOLL_PRIO_MAX;
+
+    while(i-- > 0)
+    {
+        struct ring_record* record = ring_peek(&channel->lanes[i]);
+
+        if(record)
+        {
+            *prio = i;
+            return record;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief Claim a record and extend the claimed range of its lane.
+ *
+ * Must be called with lock held.
+ * \param channel channel.
+ * \param prio lane of the record.
+ * \param record record returned by kpoll_peek().
+ * \param start claimed range start of each lane.
+ * \param end claimed range end of each lane (start == end if none).
+ */
+static void kpoll_claim(struct kpoll_channel* channel, unsigned int prio,
+        struct ring_record* record, size_t* start, size_t* end)
+{
+    struct ring* lane = &channel->lanes[prio];
+
+    if(start[prio] == end[prio])
+    {
+        start[prio] = lane->claim;
+    }
+    ring_claim(lane, record);
+    end[prio] = lane->claim;
+}
+
+/**
+ * \brief Copy a message to userspace as a frame.
+ * \param record record.
+ * \param prio priority of the lane of the record.
+ * \param to buffer to fill, has room for the whole frame.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kpoll_frame_to_iter(struct ring_record* record, unsigned int prio,
+        struct iov_iter* to)
+{
+    struct kpoll_frame frame;
+
+    memset(&frame, 0x00, sizeof(frame));
+    frame.len = record->len;
+    frame.priority = prio;
+
+    if(copy_to_iter(&frame, sizeof(frame), to) != sizeof(frame) ||
+            copy_to_iter(record + 1, record->len, to) != record->len)
+    {
+        return -EFAULT;
+    }
+
+    /* padding is left untouched */
+    iov_iter_advance(to, KPOLL_FRAME_SIZE(record->len) - sizeof(frame) -
+            record->len);
+    return 0;
+}
+
+/**
+ * \brief Copy claimed messages of a lane to userspace as frames.
+ * \param lane lane.
+ * \param prio priority of the lane.
+ * \param to buffer to fill.
+ * \param start position of the first claimed record.
+ * \param end position after the last claimed record.
+ * \return number of bytes filled, or negative value if failure.
+ */
+static ssize_t kpoll_frames_to_iter(struct ring* lane, unsigned int prio,
+        struct iov_iter* to, size_t start, size_t end)
+{
+    size_t done = 0;
+
+    while(start != end)
+    {
+        struct ring_record* record = ring_record(lane, start);
+
+        start += ring_record_size(record->len);
+
+        if(record->flags & RECORD_PAD)
+        {
+            continue;
+        }
+
+        /* claimed frames fit in the buffer */
+        if(kpoll_frame_to_iter(record, prio, to) != 0)
+        {
+            return -EFAULT;
+        }
+        done += KPOLL_FRAME_SIZE(record->len);
+    }
+    return done;
+}
+
+/**
+ * \brief Test if an I/O must fail instead of blocking.
+ *
+ * O_NONBLOCK comes from the file, IOCB_NOWAIT from io_uring or RWF_NOWAIT.
+ * \param iocb I/O control block.
+ * \return true if the I/O must not block.
+ */
+static bool kpoll_nowait(struct kiocb* iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+        (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/**
+ * \brief Take one of the mutexes of the lock-free path.
+ * \param lock read_mutex or write_mutex of the channel.
+ * \param nowait fail with -EAGAIN instead of waiting.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kpoll_spsc_lock(struct mutex* lock, bool nowait)
+{
+    if(nowait)
+    {
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
+    }
+    return mutex_lock_interruptible(lock) != 0 ? -ERESTARTSYS : 0;
+}
+
+/**
+ * \brief Get the next record to read from the highest non-empty lane,
+ * without the lock.
+ *
+ * Must be called with read_mutex held.
+ * \param channel channel.
+ * \param prio filled with the lane of the record.
+ * \return record, or NULL if all lanes are empty.
+ */
+static struct ring_record* kpoll_spsc_peek(struct kpoll_channel* channel,
+        unsigned int* prio)
+{
+    unsigned int i = KPOLL_PRIO_MAX;
+
+    while(i-- > 0)
+    {
+        struct ring_record* record = ring_spsc_peek(&channel->lanes[i]);
+
+        if(record)
+        {
+            *prio = i;
+            return record;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief Read messages on the lock-free path.
+ *
+ * Records are copied as they are claimed, then released all at once.
+ * \param channel channel.
+ * \param file file.
+ * \param iocb I/O control block.
+ * \param to buffer to fill.
+ * \param ret filled with the result of the read.
+ * \return true if done, false if the read has to be tried again (the
+ * channel left the lock-free path or a message came).
+ */
+static bool kpoll_spsc_read(struct kpoll_channel* channel,
+        struct kpoll_file* file, struct kiocb* iocb, struct iov_iter* to,
+        ssize_t* ret)
+{
+    size_t len = iov_iter_count(to);
+    struct ring_record* record = NULL;
+    bool freed[KPOLL_PRIO_MAX];
+    unsigned int prio = 0;
+    unsigned int i = 0;
+    ssize_t len_msg = 0;
+    int err = 0;
+    bool claimed = false;
+    bool more = false;
+
+    *ret = kpoll_spsc_lock(&channel->read_mutex, kpoll_nowait(iocb));
+    if(*ret != 0)
+    {
+        return true;
+    }
+
+    if(!channel->spsc)
+    {
+        mutex_unlock(&channel->read_mutex);
+        return false;
+    }
+
+    record = kpoll_spsc_peek(channel, &prio);
+    claimed = record != NULL;
+
+    if(record && file->framed && KPOLL_FRAME_SIZE(record->len) > len)
+    {
+        mutex_unlock(&channel->read_mutex);
+        kpoll_wake(&channel->read_wq, POLLIN | POLLRDNORM);
+        *ret = -EMSGSIZE;
+        return true;
+    }
+
+    if(record && !file->framed)
+    {
+        len_msg = min_t(size_t, record->len, len);
+        err = copy_to_iter(record + 1, len_msg, to) != len_msg;
+        ring_spsc_claim(&channel->lanes[prio], record);
+        record = NULL;
+    }
+
+    /* in framed mode, copy all the messages that fit */
+    while(record && err == 0 && len_msg + KPOLL_FRAME_SIZE(record->len) <= len)
+    {
+        err = kpoll_frame_to_iter(record, prio, to) != 0;
+        len_msg += KPOLL_FRAME_SIZE(record->len);
+        ring_spsc_claim(&channel->lanes[prio], record);
+        record = kpoll_spsc_peek(channel, &prio);
+    }
+
+    /* skipped pads are released as well */
+    for(i = 0; i < KPOLL_PRIO_MAX; i++)
+    {
+        freed[i] = ring_spsc_release(&channel->lanes[i]);
+    }
+    more = kpoll_readable(channel);
+
+    mutex_unlock(&channel->read_mutex);
+
+    for(i = 0; i < KPOLL_PRIO_MAX; i++)
+    {
+        if(freed[i])
+        {
+            /* lane has at least one space left */
+            kpoll_wake(&channel->write_wq[i], POLLOUT | POLLWRNORM);
+        }
+    }
+
+    if(claimed)
+    {
+        if(more)
+        {
+            /* pass the wake-up on to another reader */
+            kpoll_wake(&channel->read_wq, POLLIN | POLLRDNORM);
+        }
+
+        /* empty message is EOF */
+        *ret = len_msg == 0 ? 0 : (err == 0 ? len_msg : -EFAULT);
+        return true;
+    }
+
+    /* all lanes empty, wait for item */
+    if(kpoll_nowait(iocb))
+    {
+        *ret = -EAGAIN;
+        return true;
+    }
+
+    if(wait_event_interruptible_exclusive(channel->read_wq,
+                kpoll_readable(channel)) != 0)
+    {
+        /* do not swallow a wake-up meant for another reader */
+        if(kpoll_readable(channel))
+        {
+            kpoll_wake(&channel->read_wq, POLLIN | POLLRDNORM);
+        }
+        *ret = -ERESTARTSYS;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * \brief Read messages on the locked path.
+ *
+ * Records are claimed under the lock and copied without it, so that readers
+ * copy in parallel.
+ * \param channel channel.
+ * \param file file.
+ * \param iocb I/O control block.
+ * \param to buffer to fill.
+ * \param ret filled with the result of the read.
+ * \return true if done, false if the channel switched to the lock-free path.
+ */
+static bool kpoll_locked_read(struct kpoll_channel* channel,
+        struct kpoll_file* file, struct kiocb* iocb, struct iov_iter* to,
+        ssize_t* ret)
+{
+    int err = 0;
+    ssize_t len_msg = 0;
+    unsigned long mask = 0;
+    struct ring_record* record = NULL;
+    struct ring_record* next = NULL;
+    size_t start[KPOLL_PRIO_MAX];
+    size_t end[KPOLL_PRIO_MAX];
+    bool freed[KPOLL_PRIO_MAX];
+    unsigned int prio = 0;
+    unsigned int i = 0;
+    bool more = false;
+    size_t len = iov_iter_count(to);
+
+    memset(start, 0x00, sizeof(start));
+    memset(end, 0x00, sizeof(end));
+
+    spin_lock_irqsave(&channel->lock, mask);
+
+    while(!channel->spsc && (record = kpoll_peek(channel, &prio)) == NULL)
+    {
+        /* all lanes empty, wait for item */
+        spin_unlock_irqrestore(&channel->lock, mask);
+
+        /* returns now if nonblock is requested */
+        if(kpoll_nowait(iocb))
+        {
+            *ret = -EAGAIN;
+            return true;
+        }
+
+        if(wait_event_interruptible_exclusive(channel->read_wq,
+                    kpoll_readable(channel)) != 0)
+        {
+            /* do not swallow a wake-up meant for another reader */
+            if(kpoll_readable(channel))
+            {
+                kpoll_wake(&channel->read_wq, POLLIN | POLLRDNORM);
+            }
+            *ret = -ERESTARTSYS;
+            return true;
+        }
+
+        spin_lock_irqsave(&channel->lock, mask);
+    }
+
+    if(channel->spsc)
+    {
+        /* nothing claimed, lanes are the lock-free path's now */
+        spin_unlock_irqrestore(&channel->lock, mask);
+        return false;
+    }
+
+    if(file->framed && KPOLL_FRAME_SIZE(record->len) > len)
+    {
+        spin_unlock_irqrestore(&channel->lock, mask);
+        kpoll_wake(&channel->read_wq, POLLIN | POLLRDNORM);
+        *ret = -EMSGSIZE;
+        return true;
+    }
+
+    kpoll_claim(channel, prio, record, start, end);
+    len_msg = KPOLL_FRAME_SIZE(record->len);
+
+    /* in framed mode, take all the messages that fit */
+    while(file->framed && (next = kpoll_peek(channel, &prio)) != NULL &&
+            len_msg + KPOLL_FRAME_SIZE(next->len) <= len)
+    {
+        kpoll_claim(channel, prio, next, start, end);
+        len_msg += KPOLL_FRAME_SIZE(next->len);
+    }
+    more = kpoll_readable(channel);
+
+    spin_unlock_irqrestore(&channel->lock, mask);
+
+    if(more)
+    {
+        /* pass the wake-up on to another reader */
+        kpoll_wake(&channel->read_wq, POLLIN | POLLRDNORM);
+    }
+
+    /* records are ours until released, copy may fault so do it unlocked */
+    if(file->framed)
+    {
+        /* same order as claimed, highest lane first */
+        len_msg = 0;
+        i = KPOLL_PRIO_MAX;
+        while(i-- > 0 && err == 0)
+        {
+            ssize_t copied = kpoll_frames_to_iter(&channel->lanes[i], i, to,
+                    start[i], end[i]);
+
+            err = copied < 0;
+            len_msg = copied < 0 ? copied : len_msg + copied;
+        }
+    }
+    else
+    {
+        len_msg = min_t(size_t, record->len, len);
+
+        if(len_msg > 0)
+        {
+            err = copy_to_iter(record + 1, len_msg, to) != len_msg;
+        }
+    }
+
+    spin_lock_irqsave(&channel->lock, mask);
+    for(i = 0; i < KPOLL_PRIO_MAX; i++)
+    {
+        freed[i] = start[i] != end[i] &&
+            ring_release(&channel->lanes[i], start[i], end[i]);
+    }
+    spin_unlock_irqrestore(&channel->lock, mask);
+
+    for(i = 0; i < KPOLL_PRIO_MAX; i++)
+    {
+        if(freed[i])
+        {
+            /* lane has at least one space left */
+            kpoll_wake(&channel->write_wq[i], POLLOUT | POLLWRNORM);
+        }
+    }
+
+    if(len_msg == 0)
+    {
+        /* EOF */
+        *ret = 0;
+    }
+    else if(err == 0)
+    {
+        /* success */
+        printk(KERN_DEBUG "%s: sent %zu characters to user\n", THIS_MODULE->name,
+                len_msg);
+
+        /* iocb->ki_pos += len_msg; */
+        *ret = len_msg;
+    }
+    else
+    {
+        printk(KERN_DEBUG "%s: failed to send %zu characters to user\n",
+                THIS_MODULE->name, len);
+        *ret = -EFAULT;
+    }
+    return true;
+}
+
+/**
+ * \brief Read callback for character device.
+ *
+ * Returns one message of the highest non-empty lane, truncated to len, or in
+ * framed mode as many frames as fit in len, highest lanes first.
+ * \param iocb I/O control block.
+ * \param to buffer to fill.
+ * \return number of characters read, or negative value if failure.
+ */
+static ssize_t kpoll_read_iter(struct kiocb* iocb, struct iov_iter* to)
+{
+    struct kpoll_file* file = iocb->ki_filp->private_data;
+    struct kpoll_channel* channel = READ_ONCE(file->channel);
+    ssize_t ret = 0;
+    bool done = false;
+
+    printk(KERN_INFO "%s: wants to read %zu bytes from offset %lld\n",
+            THIS_MODULE->name, iov_iter_count(to), iocb->ki_pos);
+
+    if(!(READ_ONCE(file->role) & KPOLL_ROLE_READ))
+    {
+        return -EBADF;
+    }
+
+    /* path may change while waiting, try again with the other one */
+    do
+    {
+        done = READ_ONCE(channel->spsc) ?
+            kpoll_spsc_read(channel, file, iocb, to, &ret) :
+            kpoll_locked_read(channel, file, iocb, to, &ret);
+    }
+    while(!done);
+
+    if(kpoll_spsc_pending(channel) && !kpoll_nowait(iocb))
+    {
+        /* last locked operation may have been waited for */
+        kpoll_spsc_update(channel, 0, 0);
+    }
+    return ret;
+}
+
+/**
+ * \brief Queue a message on the locked path.
+ * \param channel channel.
+ * \param nowait fail with -EAGAIN instead of waiting.
+ * \param from message.
+ * \param len length of message.
+ * \param prio lane of the message.
+ * \param published poll events readers have to be woken up with, 0 if none.
+ * \param ret filled with 0 if success, negative value otherwise.
+ * \return true if done, false if the channel switched to the lock-free path.
+ */
+static bool kpoll_locked_push(struct kpoll_channel* channel, bool nowait,
+        struct iov_iter* from, size_t len, unsigned int prio,
+        unsigned int* published, int* ret)
+{
+    struct ring* lane = &channel->lanes[prio];
+    int err = 0;
+    unsigned long mask = 0;
+    struct ring_record* record = NULL;
+    bool more = false;
+
+    spin_lock_irqsave(&channel->lock, mask);
+
+    while(!channel->spsc && !ring_fits(lane, len))
+    {
+        /* lane full, wait for empty space */
+        spin_unlock_irqrestore(&channel->lock, mask);
+
+        if(len > READ_ONCE(lane->max_len))
+        {
+            *ret = -E2BIG;
+            return true;
+        }
+
+        if(nowait)
+        {
+            *ret = -EAGAIN;
+            return true;
+        }
+
+        if(*published)
+        {
+            /* readers have to make room */
+            kpoll_wake(&channel->read_wq, *published);
+            *published = 0;
+        }
+
+        if(wait_event_interruptible_exclusive(channel->write_wq[prio],
+                    ring_fits(lane, len) ||
+                    len > READ_ONCE(lane->max_len)) != 0)
+        {
+            /* do not swallow a wake-up meant for another writer */
+            kpoll_wake(&channel->write_wq[prio], POLLOUT | POLLWRNORM);
+            *ret = -ERESTARTSYS;
+            return true;
+        }
+
+        spin_lock_irqsave(&channel->lock, mask);
+    }
+
+    if(channel->spsc)
+    {
+        /* nothing reserved, lanes are the lock-free path's now */
+        spin_unlock_irqrestore(&channel->lock, mask);
+        return false;
+    }
+
+    record = ring_reserve(lane, len);
+    more = ring_fits(lane, 0);
+
+    spin_unlock_irqrestore(&channel->lock, mask);
+
+    if(more)
+    {
+        /* pass the wake-up on to another writer */
+        kpoll_wake(&channel->write_wq[prio], POLLOUT | POLLWRNORM);
+    }
+
+    /* space is ours until committed, copy may fault so do it unlocked */
+    err = copy_from_iter(record + 1, len, from) != len;
+
+    spin_lock_irqsave(&channel->lock, mask);
+    /* a failed copy is committed as a pad that readers skip */
+    if(ring_commit(lane, record, err == 0))
+    {
+        *published |= POLLIN | POLLRDNORM | (prio > 0 ? POLLPRI : 0);
+    }
+    spin_unlock_irqrestore(&channel->lock, mask);
+
+    *ret = err == 0 ? 0 : -EFAULT;
+    return true;
+}
+
+/**
+ * \brief Queue a message on the lock-free path.
+ * \param channel channel.
+ * \param nowait fail with -EAGAIN instead of waiting.
+ * \param from message.
+ * \param len length of message.
+ * \param prio lane of the message.
+ * \param published poll events readers have to be woken up with, 0 if none.
+ * \param ret filled with 0 if success, negative value otherwise.
+ * \return true if done, false if the write has to be tried again (the
+ * channel left the lock-free path or space was freed).
+ */
+static bool kpoll_spsc_push(struct kpoll_channel* channel, bool nowait,
+        struct iov_iter* from, size_t len, unsigned int prio,
+        unsigned int* published, int* ret)
+{
+    struct ring* lane = &channel->lanes[prio];
+    struct ring_record* record = NULL;
+    int err = 0;
+    bool more = false;
+
+    *ret = kpoll_spsc_lock(&channel->write_mutex, nowait);
+    if(*ret != 0)
+    {
+        return true;
+    }
+
+    if(!channel->spsc)
+    {
+        mutex_unlock(&channel->write_mutex);
+        return false;
+    }
+
+    if(len > lane->max_len)
+    {
+        mutex_unlock(&channel->write_mutex);
+        *ret = -E2BIG;
+        return true;
+    }
+
+    record = ring_spsc_reserve(lane, len);
+    if(record)
+    {
+        /* data is copied before the record is published */
+        err = copy_from_iter(record + 1, len, from) != len;
+        ring_spsc_commit(lane, record, err == 0);
+        more = ring_fits(lane, 0);
+    }
+
+    mutex_unlock(&channel->write_mutex);
+
+    if(record)
+    {
+        if(more)
+        {
+            /* pass the wake-up on to another writer */
+            kpoll_wake(&channel->write_wq[prio], POLLOUT | POLLWRNORM);
+        }
+
+        *published |= POLLIN | POLLRDNORM | (prio > 0 ? POLLPRI : 0);
+        *ret = err == 0 ? 0 : -EFAULT;
+        return true;
+    }
+
+    /* lane full, wait for empty space */
+    if(nowait)
+    {
+        *ret = -EAGAIN;
+        return true;
+    }
+
+    if(*published)
+    {
+        /* readers have to make room */
+        kpoll_wake(&channel->read_wq, *published);
+        *published = 0;
+    }
+
+    if(wait_event_interruptible_exclusive(channel->write_wq[prio],
+                ring_fits(lane, len) || len > READ_ONCE(lane->max_len)) != 0)
+    {
+        /* do not swallow a wake-up meant for another writer */
+        kpoll_wake(&channel->write_wq[prio], POLLOUT | POLLWRNORM);
+        *ret = -ERESTARTSYS;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * \brief Queue a message from userspace, wait for space if needed.
+ * \param channel channel.
+ * \param nowait fail with -EAGAIN instead of waiting.
+ * \param from message.
+ * \param len length of message.
+ * \param prio lane of the message.
+ * \param published poll events readers have to be woken up with, 0 if none.
+ * \return 0 if success, negative value otherwise.
+ */
+static int kpoll_push(struct kpoll_channel* channel, bool nowait,
+        struct iov_iter* from, size_t len, unsigned int prio,
+        unsigned int* published)
+{
+    int ret = 0;
+    bool done = false;
+
+    /* path may change while waiting, try again with the other one */
+    do
+    {
+        done = READ_ONCE(channel->spsc) ?
+            kpoll_spsc_push(channel, nowait, from, len, prio, published,
+                    &ret) :
+            kpoll_locked_push(channel, nowait, from, len, prio, published,
+                    &ret);
+    }
+    while(!done);
+
+    return ret;
+}
+
+/**
+ * \brief Write callback for character device.
+ *
+ * Queues one message in the lane of the file, or in framed mode all the
+ * frames of the buffer in their own lane.
+ * \param iocb I/O control block.
+ * \param from buffer that contains data to write.
+ * \return number of characters written, or negative value if failure.
+ */
+static ssize_t kpoll_write_iter(struct kiocb* iocb, struct iov_iter* from)
+{
+    struct kpoll_file* file = iocb->ki_filp->private_data;
+    struct kpoll_channel* channel = READ_ONCE(file->channel);
+    struct kpoll_frame frame;
+    size_t len = iov_iter_count(from);
+    size_t done = 0;
+    int err = 0;
+    unsigned int published = 0;
+    bool nowait = kpoll_nowait(iocb);
+
+    printk(KERN_INFO "%s: wants to write %zu bytes from %lld offset\n",
+            THIS_MODULE->name, len, iocb->ki_pos);
+
+    if(!(READ_ONCE(file->role) & KPOLL_ROLE_WRITE))
+    {
+        return -EBADF;
+    }
+
+    if(!file->framed)
+    {
+        err = kpoll_push(channel, nowait, from, len,
+                READ_ONCE(file->priority), &published);
+        done = err == 0 ? len : 0;
+    }
+
+    while(file->framed && done < len)
+    {
+        if(len - done < sizeof(frame))
+        {
+            err = -EINVAL;
+            break;
+        }
+
+        if(copy_from_iter(&frame, sizeof(frame), from) != sizeof(frame))
+        {
+            err = -EFAULT;
+            break;
+        }
+
+        if(frame.len > len - done - sizeof(frame) ||
+                frame.priority >= KPOLL_PRIO_MAX)
+        {
+            err = -EINVAL;
+            break;
+        }
+
+        err = kpoll_push(channel, nowait, from, frame.len, frame.priority,
+                &published);
+        if(err != 0)
+        {
+            break;
+        }
+
+        /* padding of the last frame is optional */
+        iov_iter_advance(from, min_t(size_t, KPOLL_FRAME_SIZE(frame.len) -
+                    sizeof(frame) - frame.len, iov_iter_count(from)));
+        done += min_t(size_t, KPOLL_FRAME_SIZE(frame.len), len - done);
+    }
+
+    if(published)
+    {
+        /* a lane has at least one item left */
+        kpoll_wake(&channel->read_wq, published);
+    }
+
+    if(kpoll_spsc_pending(channel) && !nowait)
+    {
+        /* last locked operation may have been waited for */
+        kpoll_spsc_update(channel, 0, 0);
+    }
+
+    if(done == 0 && err != 0)
+    {
+        return err;
+    }
+
+    iocb->ki_pos += done;
+    printk(KERN_INFO "%s: received %zu characters from user\n",
+            THIS_MODULE->name, done);
+    return done;
+}
+
+/**
+ * \brief Ioctl callback for character device.
+ * \param filep file.
+ * \param cmd ioctl command.
+ * \param arg argument.
+ * \return 0 if success, negative value otherwise.
+ */
+static long kpoll_ioctl(struct file* filep, unsigned int cmd,
+        unsigned long arg)
+{
+    struct kpoll_file* file = filep->private_data;
+    struct kpoll_channel* channel = READ_ONCE(file->channel);
+    struct kpoll_config config;
+    int32_t value = 0;
+
+    if(_IOC_TYPE(cmd) != KPOLL_IOCTL_MAGIC)
+    {
+        return -ENOTTY;
+    }
+
+    switch(_IOC_NR(cmd))
+    {
+    case KPOLL_GET_CONFIG:
+        memset(&config, 0x00, sizeof(config));
+        config.ring_size = READ_ONCE(channel->lanes[0].size);
+        config.msg_size = READ_ONCE(channel->lanes[0].max_len);
+        if(copy_to_user((void*)arg, &config, sizeof(config)) != 0)
+        {
+            return -EFAULT;
+        }
+        break;
+    case KPOLL_SET_CONFIG:
+        if(copy_from_user(&config, (void*)arg, sizeof(config)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        if(config.reserved != 0)
+        {
+            return -EINVAL;
+        }
+        return kpoll_configure(channel, config.ring_size, config.msg_size);
+    case KPOLL_SET_FRAMED:
+        if(copy_from_user(&value, (void*)arg, sizeof(value)) != 0)
+        {
+            return -EFAULT;
+        }
+        file->framed = value != 0;
+        break;
+    case KPOLL_SET_PRIO:
+        if(copy_from_user(&value, (void*)arg, sizeof(value)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        if(value < 0 || value >= KPOLL_PRIO_MAX)
+        {
+            return -EINVAL;
+        }
+        WRITE_ONCE(file->priority, value);
+        break;
+    case KPOLL_SET_ROLE:
+        if(copy_from_user(&value, (void*)arg, sizeof(value)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        /* a file cannot take a role its open mode does not allow */
+        if(value == 0 || (value & ~file->role) != 0)
+        {
+            return -EINVAL;
+        }
+        kpoll_spsc_update(channel, xchg(&file->role, value), -1);
+        kpoll_spsc_update(channel, value, 1);
+        break;
+    case KPOLL_ATTACH:
+        return kpoll_channel_attach(file, (const char*)arg);
+    default:
+        return -ENOTTY;
+    }
+    return 0;
+}
+
+/**
+ * \brief See if data is ready.
+ * \param filep file descriptor.
+ * \param wait table to hold waitqueues.
+ * \return mask of POLL* value or 0 if nothing available yet.
+ */
+static unsigned int kpoll_poll(struct file* filep, poll_table* wait)
+{
+  struct kpoll_file* file = filep->private_data;
+  struct kpoll_channel* channel = READ_ONCE(file->channel);
+  struct ring* lane = &channel->lanes[READ_ONCE(file->priority)];
+  unsigned long flags = 0;
+  unsigned int mask = 0;
+  unsigned int i = 0;
+
+  /* adds waitqueues to the table (exclusively with EPOLLEXCLUSIVE) */
+  poll_wait(filep, &channel->read_wq, wait);
+  for(i = 0; i < KPOLL_PRIO_MAX; i++)
+  {
+    poll_wait(filep, &channel->write_wq[i], wait);
+  }
+
+  /* consistent snapshot of the lanes, not torn by a running read/write */
+  spin_lock_irqsave(&channel->lock, flags);
+
+  /* writable if the lane of the file takes a message of any size */
+  if(ring_fits(lane, lane->max_len))
+  {
+    mask |= POLLOUT | POLLWRNORM;
+  }
+  
+  for(i = 0; i < KPOLL_PRIO_MAX; i++)
+  {
+    if(ring_readable(&channel->lanes[i]))
+    {
+      /* urgent messages are above default priority */
+      mask |= POLLIN | POLLRDNORM | (i > 0 ? POLLPRI : 0);
+    }
+  }
+
+  spin_unlock_irqrestore(&channel->lock, flags);
+
+  return mask;
+}
+
+
+/**
+ * \brief Module initialization.
+ *
+ * Set up stuff when module is added.
+ * \return 0 if success, negative value otherwise.
+ */
+static int __init kpoll_init(void)
+{
+    int ret = 0;
+
+    printk(KERN_INFO "%s: initialization\n", THIS_MODULE->name);
+
+    ret = kpoll_channel_init(&g_default, "");
+    if(ret != 0)
+    {
+        return ret;
+    }
+
+    /* register device */
+    ret = misc_register(&kpoll_misc);
+
+    if(ret == 0)
+    {
+        printk(KERN_INFO "%s: device created correctly\n", THIS_MODULE->name);
+    }
+    else
+    {
+        kpoll_channel_destroy(&g_default);
+    }
 
     return ret;
 }
@@ -322,6 +1838,7 @@ static int __init kpoll_init(void)
 static void __exit kpoll_exit(void)
 {
     misc_deregister(&kpoll_misc);
+    kpoll_channel_destroy(&g_default);
     printk(KERN_INFO "%s: exit\n", THIS_MODULE->name);
 }
 
@@ -329,8 +1846,13 @@ static void __exit kpoll_exit(void)
 module_init(kpoll_init);
 module_exit(kpoll_exit);
 
-module_param(nonblock, bool, (S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR));
-MODULE_PARM_DESC(nonblock, "Authorize non-blocking read() if file requests it");
+module_param(ring_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(ring_size, "Default capacity in bytes of a channel queue");
+module_param(msg_size, uint, S_IRUGO);
+MODULE_PARM_DESC(msg_size, "Default maximum size in bytes of a message");
+module_param(spsc, bool, (S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR));
+MODULE_PARM_DESC(spsc,
+        "Skip the lock of channels with one reader and one writer");
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Sebastien Vincent");
@@ -0,0 +1,116 @@
+/*
+ * kpoll - poll device kernel module.
+ * Copyright (c) 2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file kpoll.h
+ * \brief Ioctl definitions of kpoll.
+ * \author Sebastien Vincent
+ * \date 2017
+ */
+
+#ifndef KPOLL_H
+#define KPOLL_H
+
+#ifdef __linux__
+#include <asm/ioctl.h>
+#else
+#error "Not supported OS."
+#endif
+
+#define KPOLL_IOCTL_MAGIC 'p'
+
+#define KPOLL_GET_CONFIG 1
+#define KPOLL_SET_CONFIG 2
+#define KPOLL_SET_FRAMED 3
+#define KPOLL_ATTACH 4
+#define KPOLL_SET_PRIO 5
+#define KPOLL_SET_ROLE 6
+
+/**
+ * \def KPOLL_NAME_MAX
+ * \brief Maximum size of a channel name, NUL included.
+ */
+#define KPOLL_NAME_MAX 32
+
+/**
+ * \def KPOLL_PRIO_MAX
+ * \brief Number of priorities, 0 (default) is the lowest.
+ */
+#define KPOLL_PRIO_MAX 4
+
+/**
+ * \def KPOLL_ROLE_READ
+ * \brief File reads messages.
+ */
+#define KPOLL_ROLE_READ 0x1
+
+/**
+ * \def KPOLL_ROLE_WRITE
+ * \brief File writes messages.
+ */
+#define KPOLL_ROLE_WRITE 0x2
+
+/* capacity of each priority lane and maximum size of a message */
+#define KPOLL_IOCGCONFIG _IOR(KPOLL_IOCTL_MAGIC, KPOLL_GET_CONFIG, \
+        struct kpoll_config)
+/* resize the queue, it must be empty (0 keeps the current value) */
+#define KPOLL_IOCSCONFIG _IOW(KPOLL_IOCTL_MAGIC, KPOLL_SET_CONFIG, \
+        struct kpoll_config)
+/* framed mode for this file (1 to enable, 0 to disable) */
+#define KPOLL_IOCSFRAMED _IOW(KPOLL_IOCTL_MAGIC, KPOLL_SET_FRAMED, int32_t)
+/* attach this file to a named channel, created on first use (only once per
+ * file, before any poll()) */
+#define KPOLL_IOCATTACH _IOW(KPOLL_IOCTL_MAGIC, KPOLL_ATTACH, \
+        char[KPOLL_NAME_MAX])
+/* priority of the messages written by this file outside of framed mode
+ * (0 to KPOLL_PRIO_MAX - 1) */
+#define KPOLL_IOCSPRIO _IOW(KPOLL_IOCTL_MAGIC, KPOLL_SET_PRIO, int32_t)
+/* restrict this file to KPOLL_ROLE_READ or KPOLL_ROLE_WRITE (defaults to the
+ * open mode), a channel with one reader and one writer skips its lock */
+#define KPOLL_IOCSROLE _IOW(KPOLL_IOCTL_MAGIC, KPOLL_SET_ROLE, int32_t)
+
+/**
+ * \def KPOLL_FRAME_ALIGN
+ * \brief Alignment of the frames in a buffer.
+ */
+#define KPOLL_FRAME_ALIGN 8
+
+/**
+ * \def KPOLL_FRAME_SIZE
+ * \brief Size taken in a buffer by a frame, padding included.
+ */
+#define KPOLL_FRAME_SIZE(len) ((sizeof(struct kpoll_frame) + (len) + \
+        KPOLL_FRAME_ALIGN - 1) & ~((size_t)KPOLL_FRAME_ALIGN - 1))
+
+/**
+ * \struct kpoll_config
+ * \brief Queue configuration.
+ */
+struct kpoll_config
+{
+    uint64_t ring_size; /**< Capacity in bytes of a lane (power of two). */
+    uint32_t msg_size; /**< Maximum size of a message. */
+    uint32_t reserved; /**< Must be 0. */
+};
+
+/**
+ * \struct kpoll_frame
+ * \brief Header of a message in framed mode, followed by the data.
+ *
+ * In framed mode, read() fills the buffer with as many frames as fit and
+ * write() queues every frame of the buffer. Each frame starts at a multiple
+ * of KPOLL_FRAME_ALIGN, padding bytes are undefined. Frames of higher
+ * priority are read first.
+ */
+struct kpoll_frame
+{
+    uint32_t len; /**< Length of the message. */
+    uint32_t priority; /**< Priority, 0 to KPOLL_PRIO_MAX - 1. */
+};
+
+#endif /* KPOLL_H */
@@ -0,0 +1,260 @@
+/*
+ * kpoll_batch_userspace - Compare per-message and framed I/O on kpoll.
+ * Copyright (c) 2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file kpoll_batch_userspace.c
+ * \brief Userspace program to move messages through kpoll in batches.
+ * \author Sebastien Vincent
+ * \date 2017
+ *
+ * Usage: kpoll_batch_userspace [messages] [size] [batch] [channel] [spsc]
+ *
+ * A child process writes the messages, the parent reads them back. With a
+ * batch of 1 each read()/write() moves one message, otherwise both sides
+ * switch to framed mode and move up to batch messages per system call. If a
+ * channel name is given, both sides use that channel instead of the default
+ * one, so several instances can run side by side ("-" keeps the default
+ * channel).
+ *
+ * If spsc is 1, the producer declares itself as the only writer and the
+ * consumer as the only reader, so that the channel uses its lock-free path
+ * (see the spsc module parameter). Compare with spsc 0 to measure the lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "kpoll.h"
+
+/**
+ * \brief Current monotonic time.
+ * \return time in seconds.
+ */
+static double batch_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * \brief Open the device, in framed mode if batch is greater than 1.
+ * \param batch messages per system call.
+ * \param channel channel name, NULL for the default channel.
+ * \param role KPOLL_ROLE_* of the file, 0 to keep both.
+ * \return fd, or -1 if failure.
+ */
+static int batch_open(size_t batch, const char* channel, int32_t role)
+{
+    int32_t framed = batch > 1;
+    char name[KPOLL_NAME_MAX];
+    int fd = open("/dev/kpoll", O_RDWR);
+
+    if(fd == -1)
+    {
+        perror("open");
+        return -1;
+    }
+
+    memset(name, 0x00, sizeof(name));
+    if(channel)
+    {
+        strncpy(name, channel, sizeof(name) - 1);
+    }
+
+    if((channel && ioctl(fd, KPOLL_IOCATTACH, name) == -1) ||
+            ioctl(fd, KPOLL_IOCSFRAMED, &framed) == -1 ||
+            (role && ioctl(fd, KPOLL_IOCSROLE, &role) == -1))
+    {
+        perror("ioctl");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * \brief Write the messages.
+ * \param messages number of messages.
+ * \param size size of a message.
+ * \param batch messages per write().
+ * \param channel channel name, NULL for the default channel.
+ * \param spsc declare the file as the only writer.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int batch_producer(size_t messages, size_t size, size_t batch,
+        const char* channel, int spsc)
+{
+    size_t frame_size = batch > 1 ? KPOLL_FRAME_SIZE(size) : size;
+    char* buf = calloc(batch, frame_size);
+    size_t sent = 0;
+    size_t i = 0;
+    int fd = batch_open(batch, channel, spsc ? KPOLL_ROLE_WRITE : 0);
+
+    if(!buf || fd == -1)
+    {
+        free(buf);
+        return EXIT_FAILURE;
+    }
+
+    for(i = 0; batch > 1 && i < batch; i++)
+    {
+        struct kpoll_frame frame;
+
+        memset(&frame, 0x00, sizeof(frame));
+        frame.len = size;
+        memcpy(buf + i * frame_size, &frame, sizeof(frame));
+    }
+
+    while(sent < messages)
+    {
+        size_t nb = messages - sent < batch ? messages - sent : batch;
+        size_t len = nb * frame_size;
+        ssize_t ret = write(fd, buf, len);
+
+        if(ret <= 0)
+        {
+            perror("write");
+            break;
+        }
+
+        /* a framed write may stop early (i.e. signal) */
+        sent += batch > 1 ? (size_t)ret / frame_size : 1;
+        if(batch > 1 && (size_t)ret % frame_size != 0)
+        {
+            fprintf(stderr, "partial frame written\n");
+            break;
+        }
+    }
+
+    close(fd);
+    free(buf);
+    return sent == messages ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * \brief Read the messages.
+ * \param messages number of messages.
+ * \param size size of a message.
+ * \param batch messages per read().
+ * \param channel channel name, NULL for the default channel.
+ * \param spsc declare the file as the only reader.
+ * \param calls filled with number of read() done.
+ * \return number of messages read.
+ */
+static size_t batch_consumer(size_t messages, size_t size, size_t batch,
+        const char* channel, int spsc, size_t* calls)
+{
+    size_t frame_size = batch > 1 ? KPOLL_FRAME_SIZE(size) : size;
+    char* buf = calloc(batch, frame_size);
+    size_t received = 0;
+    int fd = batch_open(batch, channel, spsc ? KPOLL_ROLE_READ : 0);
+
+    if(!buf || fd == -1)
+    {
+        free(buf);
+        return 0;
+    }
+
+    while(received < messages)
+    {
+        ssize_t ret = read(fd, buf, batch * frame_size);
+
+        if(ret <= 0)
+        {
+            perror("read");
+            break;
+        }
+        (*calls)++;
+
+        if(batch > 1)
+        {
+            ssize_t off = 0;
+
+            while(off < ret)
+            {
+                struct kpoll_frame frame;
+
+                memcpy(&frame, buf + off, sizeof(frame));
+                off += KPOLL_FRAME_SIZE(frame.len);
+                received++;
+            }
+        }
+        else
+        {
+            received++;
+        }
+    }
+
+    close(fd);
+    free(buf);
+    return received;
+}
+
+/**
+ * \brief Entry point of the program.
+ * \param argc number of arguments.
+ * \param argv array of arguments.
+ * \return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int main(int argc, char** argv)
+{
+    size_t messages = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+    size_t size = argc > 2 ? strtoul(argv[2], NULL, 0) : 64;
+    size_t batch = argc > 3 ? strtoul(argv[3], NULL, 0) : 64;
+    const char* channel = argc > 4 && strcmp(argv[4], "-") ? argv[4] : NULL;
+    int spsc = argc > 5 ? atoi(argv[5]) : 0;
+    size_t received = 0;
+    size_t calls = 0;
+    double start = 0;
+    double elapsed = 0;
+    pid_t pid = -1;
+    int status = 0;
+
+    if(messages == 0 || size == 0 || batch == 0)
+    {
+        fprintf(stderr, "Usage: %s [messages] [size] [batch] [channel] "
+                "[spsc]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    start = batch_now();
+
+    pid = fork();
+    if(pid == -1)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    else if(pid == 0)
+    {
+        _exit(batch_producer(messages, size, batch, channel, spsc));
+    }
+
+    received = batch_consumer(messages, size, batch, channel, spsc, &calls);
+    elapsed = batch_now() - start;
+    waitpid(pid, &status, 0);
+
+    printf("%zu messages of %zu bytes, batch %zu%s: %.3fs, %.0f msg/s, "
+            "%zu read() calls\n", received, size, batch, spsc ? ", spsc" : "",
+            elapsed, received / elapsed, calls);
+
+    return received == messages && WIFEXITED(status) &&
+        WEXITSTATUS(status) == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
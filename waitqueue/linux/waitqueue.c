@@ -20,43 +20,150 @@
 #include <linux/fs.h>
 #include <linux/sched.h>
 #include <linux/wait.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/uio.h>
 
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
 
+#include "waitqueue.h"
+
+/**
+ * \def RING_MAX_SIZE
+ * \brief Maximum size of the message ring in bytes.
+ */
+#define RING_MAX_SIZE (1UL << 30)
+
+/**
+ * \def RECORD_ALIGN
+ * \brief Alignment of records in the ring.
+ */
+#define RECORD_ALIGN 8
+
+/**
+ * \def RECORD_PAD
+ * \brief Record only fills the end of the ring (or was discarded), skip it.
+ */
+#define RECORD_PAD 0x1
+
 /**
- * \def MSG_ARRAY_SIZE.
- * \brief Size of the messages array.
+ * \def RECORD_BUSY
+ * \brief Record is being filled by a writer or copied by a reader.
  */
-#define MSG_ARRAY_SIZE 10
+#define RECORD_BUSY 0x2
+
+/**
+ * \struct ring_record
+ * \brief Header of a message in the ring, followed by the data.
+ *
+ * Records never wrap: if one does not fit before the end of the ring, a pad
+ * record fills the end and the message starts again at offset 0.
+ */
+struct ring_record
+{
+    uint32_t len; /**< Length of the message (pad: length of the pad). */
+    uint32_t flags; /**< RECORD_* flags. */
+};
+
+/**
+ * \struct ring
+ * \brief Ring of variable-length messages.
+ *
+ * Positions are free-running byte offsets with
+ * head <= claim <= tail <= reserve, so dequeue never moves data. Records are
+ * reserved and claimed under the lock, but user copies happen outside of it:
+ * - [head, claim): records being copied to readers;
+ * - [claim, tail): records ready to be read;
+ * - [tail, reserve): records being copied from writers.
+ * head (resp. tail) only moves over records that are no longer busy, so
+ * records are released in order whatever order copies end.
+ */
+struct ring
+{
+    char* buffer; /**< Storage. */
+    size_t size; /**< Size of storage (power of two). */
+    size_t max_len; /**< Maximum length of a message. */
+    size_t head; /**< Position of the oldest record still in use. */
+    size_t claim; /**< Position of the next record to read. */
+    size_t tail; /**< End of the published records. */
+    size_t reserve; /**< Position of the next record to write. */
+};
+
+/**
+ * \struct waitqueue_file
+ * \brief Per-open state.
+ */
+struct waitqueue_file
+{
+    struct list_head list; /**< Entry in g_readers. */
+    size_t cursor; /**< Position of the next record (broadcast mode). */
+    bool overrun; /**< Messages were dropped before being read. */
+};
 
 /* forward declarations */
 static int waitqueue_open(struct inode* inodep, struct file* filep);
 static int waitqueue_release(struct inode* inodep, struct file* filep);
-static ssize_t waitqueue_write(struct file* filep, const char* buffer,
-        size_t len, loff_t* offset);
-static ssize_t waitqueue_read(struct file* filep, char* buffer, size_t len,
-        loff_t* offset);
+static ssize_t waitqueue_write_iter(struct kiocb* iocb,
+        struct iov_iter* from);
+static ssize_t waitqueue_read_iter(struct kiocb* iocb, struct iov_iter* to);
+static long waitqueue_ioctl(struct file* filep, unsigned int cmd,
+        unsigned long arg);
+
+/**
+ * \brief Readers waiting for a message.
+ */
+static DECLARE_WAIT_QUEUE_HEAD(g_read_wq);
+
+/**
+ * \brief Writers waiting for space.
+ */
+static DECLARE_WAIT_QUEUE_HEAD(g_write_wq);
+
+/**
+ * \brief Every reader gets every message (configuration parameter).
+ *
+ * Otherwise a message is read by only one reader.
+ */
+static bool broadcast = 0;
 
 /**
- * \brief The wait queue.
+ * \brief In broadcast mode, drop the oldest messages of slow readers instead
+ * of blocking writers (configuration parameter).
  */
-DECLARE_WAIT_QUEUE_HEAD(wq);
+static bool overrun = 0;
 
 /**
- * \brief Use non-blocking read() if file requests it (configuration parameter).
+ * \brief Capacity in bytes of the message ring (configuration parameter).
+ *
+ * It is rounded up to a power of two.
  */
-static bool nonblock = 0;
+static unsigned long ring_size = 16384;
 
 /**
- * \brief Message in kernel side for the device.
+ * \brief Maximum size of a message (configuration parameter).
  */
-static char g_messages[MSG_ARRAY_SIZE][1024]; 
+static unsigned int msg_size = 1023;
 
 /**
- * \brief Number of message in g_message.
+ * \brief Messages in kernel side for the device.
  */
-static size_t g_messages_count = 0;
+static struct ring g_ring = {
+    .buffer = NULL,
+    .size = 0,
+    .max_len = 0,
+    .head = 0,
+    .claim = 0,
+    .tail = 0,
+    .reserve = 0,
+};
+
+/**
+ * \brief Files opened for reading, protected by spinlock_wq.
+ */
+static LIST_HEAD(g_readers);
 
 /**
  * \brief Spinlock to control read/write in the array.
@@ -70,8 +177,9 @@ static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = waitqueue_open,
     .release = waitqueue_release,
-    .read = waitqueue_read,
-    .write = waitqueue_write,
+    .read_iter = waitqueue_read_iter,
+    .write_iter = waitqueue_write_iter,
+    .unlocked_ioctl = waitqueue_ioctl,
 };
 
 /**
@@ -83,6 +191,366 @@ static struct miscdevice waitqueue_misc = {
     .fops  = &fops,
 };
 
+/**
+ * \brief Size taken in the ring by a message.
+ * \param len length of the message.
+ * \return size of the record.
+ */
+static size_t ring_record_size(size_t len)
+{
+    return ALIGN(sizeof(struct ring_record) + len, RECORD_ALIGN);
+}
+
+/**
+ * \brief Get the record at a position.
+ * \param ring ring.
+ * \param pos position.
+ * \return record.
+ */
+static struct ring_record* ring_record(struct ring* ring, size_t pos)
+{
+    return (struct ring_record*)(ring->buffer + (pos & (ring->size - 1)));
+}
+
+/**
+ * \brief Test if the ring has a record to read.
+ * \param ring ring.
+ * \return true if readable.
+ */
+static bool ring_readable(struct ring* ring)
+{
+    return READ_ONCE(ring->claim) != READ_ONCE(ring->tail);
+}
+
+/**
+ * \brief Space needed to reserve a message, pad included.
+ * \param ring ring.
+ * \param len length of the message.
+ * \return number of bytes.
+ */
+static size_t ring_needed(struct ring* ring, size_t len)
+{
+    size_t size = READ_ONCE(ring->size);
+    size_t offset = READ_ONCE(ring->reserve) & (size - 1);
+    size_t needed = ring_record_size(len);
+
+    if(offset + needed > size)
+    {
+        needed += size - offset;
+    }
+    return needed;
+}
+
+/**
+ * \brief Test if a message fits in the ring.
+ * \param ring ring.
+ * \param len length of the message.
+ * \return true if it fits.
+ */
+static bool ring_fits(struct ring* ring, size_t len)
+{
+    size_t used = READ_ONCE(ring->reserve) - READ_ONCE(ring->head);
+
+    if(len > READ_ONCE(ring->max_len))
+    {
+        return false;
+    }
+    return READ_ONCE(ring->size) - used >= ring_needed(ring, len);
+}
+
+/**
+ * \brief Reserve a message at the end of the ring.
+ *
+ * Must be called with the lock held and ring_fits() true. The caller fills
+ * the data without the lock then calls ring_commit().
+ * \param ring ring.
+ * \param len length of the message.
+ * \return record to fill.
+ */
+static struct ring_record* ring_reserve(struct ring* ring, size_t len)
+{
+    size_t offset = ring->reserve & (ring->size - 1);
+    struct ring_record* record = NULL;
+
+    if(offset + ring_record_size(len) > ring->size)
+    {
+        /* fill the end of the ring and start again at 0 */
+        record = ring_record(ring, ring->reserve);
+        record->len = ring->size - offset - sizeof(struct ring_record);
+        record->flags = RECORD_PAD;
+        ring->reserve += ring->size - offset;
+    }
+
+    record = ring_record(ring, ring->reserve);
+    record->len = len;
+    record->flags = RECORD_BUSY;
+    ring->reserve += ring_record_size(len);
+    return record;
+}
+
+/**
+ * \brief Publish a message filled after ring_reserve().
+ *
+ * Must be called with the lock held.
+ * \param ring ring.
+ * \param record record.
+ * \param valid false to discard the record (i.e. copy failed).
+ * \return true if new records are readable.
+ */
+static bool ring_commit(struct ring* ring, struct ring_record* record,
+        bool valid)
+{
+    size_t tail = ring->tail;
+
+    record->flags = valid ? 0 : RECORD_PAD;
+
+    /* a writer still copying holds back the records after its own */
+    while(ring->tail != ring->reserve &&
+            !(ring_record(ring, ring->tail)->flags & RECORD_BUSY))
+    {
+        ring->tail += ring_record_size(ring_record(ring, ring->tail)->len);
+    }
+    return ring->tail != tail;
+}
+
+/**
+ * \brief Claim the oldest unread message.
+ *
+ * Must be called with the lock held. The caller copies the data without the
+ * lock then calls ring_release().
+ * \param ring ring.
+ * \return record, or NULL if there is nothing to read.
+ */
+static struct ring_record* ring_claim(struct ring* ring)
+{
+    while(ring->claim != ring->tail)
+    {
+        struct ring_record* record = ring_record(ring, ring->claim);
+        bool front = ring->head == ring->claim;
+
+        ring->claim += ring_record_size(record->len);
+
+        if(!(record->flags & RECORD_PAD))
+        {
+            record->flags = RECORD_BUSY;
+            return record;
+        }
+        else if(front)
+        {
+            /* nothing in use before the pad, release it now */
+            ring->head = ring->claim;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief Release a message returned by ring_claim().
+ *
+ * Must be called with the lock held.
+ * \param ring ring.
+ * \param record record.
+ * \return true if space was freed.
+ */
+static bool ring_release(struct ring* ring, struct ring_record* record)
+{
+    size_t head = ring->head;
+
+    record->flags = 0;
+
+    /* a reader still copying holds back the records after its own */
+    while(ring->head != ring->claim &&
+            !(ring_record(ring, ring->head)->flags & RECORD_BUSY))
+    {
+        ring->head += ring_record_size(ring_record(ring, ring->head)->len);
+    }
+    return ring->head != head;
+}
+
+/**
+ * \brief Wake up one waiter, if any.
+ *
+ * Readers (except in broadcast mode) and writers wait exclusively, so a
+ * message (resp. a free space) wakes only one of them. The one that is woken
+ * up passes the wake-up on if more messages (resp. space) are left.
+ * \param queue wait queue.
+ */
+static void waitqueue_wake(wait_queue_head_t* queue)
+{
+    /* pairs with the barrier of prepare_to_wait(), see waitqueue_active() */
+    smp_mb();
+
+    if(waitqueue_active(queue))
+    {
+        wake_up_interruptible(queue);
+    }
+}
+
+/**
+ * \brief Move head to the slowest reader (broadcast mode).
+ *
+ * Must be called with the lock held.
+ * \return true if space was freed.
+ */
+static bool waitqueue_update_head(void)
+{
+    struct waitqueue_file* file = NULL;
+    size_t old = g_ring.head;
+    size_t head = g_ring.tail;
+
+    /* cursors are between head and tail */
+    list_for_each_entry(file, &g_readers, list)
+    {
+        if(file->cursor - old < head - old)
+        {
+            head = file->cursor;
+        }
+    }
+
+    g_ring.head = head;
+    g_ring.claim = head;
+    return head != old;
+}
+
+/**
+ * \brief Drop the oldest messages until a message fits (broadcast mode).
+ *
+ * Must be called with the lock held. Readers whose messages are dropped are
+ * moved to the new head and flagged as overrun.
+ * \param len length of the message.
+ */
+static void waitqueue_drop(size_t len)
+{
+    struct waitqueue_file* file = NULL;
+    size_t old = g_ring.head;
+
+    if(len > g_ring.max_len)
+    {
+        return;
+    }
+
+    /* records being written cannot be dropped */
+    while(!ring_fits(&g_ring, len) && g_ring.head != g_ring.tail)
+    {
+        g_ring.head += ring_record_size(ring_record(&g_ring,
+                    g_ring.head)->len);
+    }
+    g_ring.claim = g_ring.head;
+
+    list_for_each_entry(file, &g_readers, list)
+    {
+        if(file->cursor - old < g_ring.head - old)
+        {
+            file->cursor = g_ring.head;
+            file->overrun = true;
+        }
+    }
+}
+
+/**
+ * \brief Get the next message of a reader (broadcast mode).
+ *
+ * Must be called with the lock held.
+ * \param file reader.
+ * \return record, or NULL if reader is up to date.
+ */
+static struct ring_record* waitqueue_cursor_peek(struct waitqueue_file* file)
+{
+    while(file->cursor != g_ring.tail)
+    {
+        struct ring_record* record = ring_record(&g_ring, file->cursor);
+
+        if(!(record->flags & RECORD_PAD))
+        {
+            return record;
+        }
+        file->cursor += ring_record_size(record->len);
+    }
+    return NULL;
+}
+
+/**
+ * \brief Test if a reader has a message or was overrun (broadcast mode).
+ * \param file reader.
+ * \return true if read() would not block.
+ */
+static bool waitqueue_cursor_readable(struct waitqueue_file* file)
+{
+    return READ_ONCE(file->cursor) != READ_ONCE(g_ring.tail) ||
+        READ_ONCE(file->overrun);
+}
+
+/**
+ * \brief Replace the storage of the messages.
+ *
+ * Ring must be empty and idle.
+ * \param size capacity in bytes, 0 keeps the current one.
+ * \param max_len maximum length of a message, 0 keeps the current one.
+ * \return 0 if success, negative value otherwise.
+ */
+static int waitqueue_configure(uint64_t size, uint64_t max_len)
+{
+    struct waitqueue_file* file = NULL;
+    char* buffer = NULL;
+    unsigned long mask = 0;
+
+    size = size ? size : READ_ONCE(g_ring.size);
+    max_len = max_len ? max_len : READ_ONCE(g_ring.max_len);
+
+    if(size == 0 || size > RING_MAX_SIZE || max_len == 0 ||
+            max_len > RING_MAX_SIZE)
+    {
+        return -EINVAL;
+    }
+
+    size = roundup_pow_of_two(size);
+
+    /* a record must fit even when a pad is needed in front of it */
+    if(ring_record_size(max_len) > size / 2)
+    {
+        return -EINVAL;
+    }
+
+    buffer = vmalloc(size);
+    if(!buffer)
+    {
+        return -ENOMEM;
+    }
+
+    spin_lock_irqsave(&spinlock_wq, mask);
+
+    if(g_ring.head != g_ring.reserve)
+    {
+        spin_unlock_irqrestore(&spinlock_wq, mask);
+        vfree(buffer);
+        return -EBUSY;
+    }
+
+    swap(g_ring.buffer, buffer);
+    g_ring.size = size;
+    g_ring.max_len = max_len;
+    g_ring.head = 0;
+    g_ring.claim = 0;
+    g_ring.tail = 0;
+    g_ring.reserve = 0;
+    list_for_each_entry(file, &g_readers, list)
+    {
+        file->cursor = 0;
+        file->overrun = false;
+    }
+    ring_size = size;
+    msg_size = max_len;
+
+    spin_unlock_irqrestore(&spinlock_wq, mask);
+
+    /* old storage */
+    vfree(buffer);
+
+    /* writers may wait for a bigger ring or have a too big message now */
+    wake_up_interruptible_all(&g_write_wq);
+    return 0;
+}
+
 /**
  * \brief Open callback for character device.
  * \param inodep inode.
@@ -91,6 +559,27 @@ static struct miscdevice waitqueue_misc = {
  */
 static int waitqueue_open(struct inode* inodep, struct file* filep)
 {
+    struct waitqueue_file* file = kzalloc(sizeof(struct waitqueue_file),
+            GFP_KERNEL);
+    unsigned long mask = 0;
+
+    if(!file)
+    {
+        return -ENOMEM;
+    }
+
+    if(filep->f_mode & FMODE_READ)
+    {
+        /* in broadcast mode, reader gets messages written from now */
+        spin_lock_irqsave(&spinlock_wq, mask);
+        file->cursor = g_ring.tail;
+        list_add_tail(&file->list, &g_readers);
+        spin_unlock_irqrestore(&spinlock_wq, mask);
+    }
+
+    filep->private_data = file;
+    /* read_iter/write_iter honour IOCB_NOWAIT */
+    filep->f_mode |= FMODE_NOWAIT;
     printk(KERN_INFO "%s: open\n", THIS_MODULE->name);
     return 0;
 }
@@ -103,89 +592,225 @@ static int waitqueue_open(struct inode* inodep, struct file* filep)
  */
 static int waitqueue_release(struct inode* inodep, struct file* filep)
 {
+    struct waitqueue_file* file = filep->private_data;
+    unsigned long mask = 0;
+    bool freed = false;
+
+    if(filep->f_mode & FMODE_READ)
+    {
+        spin_lock_irqsave(&spinlock_wq, mask);
+        list_del(&file->list);
+        if(broadcast)
+        {
+            /* may have been the slowest reader */
+            freed = waitqueue_update_head();
+        }
+        spin_unlock_irqrestore(&spinlock_wq, mask);
+    }
+
+    if(freed)
+    {
+        waitqueue_wake(&g_write_wq);
+    }
+
+    kfree(file);
     printk(KERN_INFO "%s: release\n", THIS_MODULE->name);
     return 0;
 }
 
 /**
- * \brief Read callback for character device.
- * \param filep file.
- * \param u_buffer buffer to fill.
- * \param len length to read.
- * \param offset offset of the buffer.
+ * \brief Test if an I/O must fail instead of blocking.
+ *
+ * O_NONBLOCK comes from the file, IOCB_NOWAIT from io_uring or RWF_NOWAIT.
+ * \param iocb I/O control block.
+ * \return true if the I/O must not block.
+ */
+static bool waitqueue_nowait(struct kiocb* iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+        (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/**
+ * \brief Read the next message of a reader (broadcast mode).
+ * \param iocb I/O control block.
+ * \param to buffer to fill.
  * \return number of characters read, or negative value if failure.
  */
-static ssize_t waitqueue_read(struct file* filep, char* u_buffer, size_t len,
-        loff_t* offset)
+static ssize_t waitqueue_read_broadcast(struct kiocb* iocb,
+        struct iov_iter* to)
 {
+    struct waitqueue_file* file = iocb->ki_filp->private_data;
     int err = 0;
     ssize_t len_msg = 0;
     unsigned long mask = 0;
-
-    printk(KERN_INFO "%s: wants to read %zu bytes from offset %lld\n",
-            THIS_MODULE->name, len, *offset);
+    struct ring_record* record = NULL;
+    bool freed = false;
 
     spin_lock_irqsave(&spinlock_wq, mask);
 
-    while(g_messages_count == 0)
+    while(!file->overrun && (record = waitqueue_cursor_peek(file)) == NULL)
     {
-        /* array empty, wait for item */
+        /* reader up to date, release skipped pads and wait for item */
+        freed = waitqueue_update_head();
         spin_unlock_irqrestore(&spinlock_wq, mask);
 
-        /* returns now if nonblock is requested */
-        if(nonblock && filep->f_flags & O_NONBLOCK)
+        if(freed)
+        {
+            waitqueue_wake(&g_write_wq);
+        }
+
+        if(waitqueue_nowait(iocb))
         {
             return -EAGAIN;
         }
 
-        if(wait_event_interruptible(wq, (g_messages_count > 0)) != 0)
+        /* every reader wants every message, do not wait exclusively */
+        if(wait_event_interruptible(g_read_wq,
+                    waitqueue_cursor_readable(file)) != 0)
         {
             return -ERESTARTSYS;
         }
-        
+
         spin_lock_irqsave(&spinlock_wq, mask);
     }
 
-    /* calculate buffer size left to copy */
-    len_msg = strlen(g_messages[0]);
+    if(file->overrun)
+    {
+        /* messages were dropped before this reader got them */
+        file->overrun = false;
+        spin_unlock_irqrestore(&spinlock_wq, mask);
+        return -EPIPE;
+    }
+
+    spin_unlock_irqrestore(&spinlock_wq, mask);
+
+    /* head cannot pass cursor unless writers drop it (overrun) */
+    len_msg = min_t(size_t, record->len, iov_iter_count(to));
+
+    if(len_msg > 0)
+    {
+        err = copy_to_iter(record + 1, len_msg, to) != len_msg;
+    }
+
+    spin_lock_irqsave(&spinlock_wq, mask);
+
+    if(file->overrun)
+    {
+        /* record was dropped, and maybe overwritten, during the copy */
+        file->overrun = false;
+        spin_unlock_irqrestore(&spinlock_wq, mask);
+        return -EPIPE;
+    }
+
+    file->cursor += ring_record_size(record->len);
+    freed = waitqueue_update_head();
+    spin_unlock_irqrestore(&spinlock_wq, mask);
+
+    if(freed)
+    {
+        /* ring has at least one space left */
+        waitqueue_wake(&g_write_wq);
+    }
 
     if(len_msg == 0)
     {
         /* EOF */
-        spin_unlock_irqrestore(&spinlock_wq, mask);
         return 0;
     }
-    else if(len_msg > len)
+    return err == 0 ? len_msg : -EFAULT;
+}
+
+/**
+ * \brief Read callback for character device.
+ * \param iocb I/O control block.
+ * \param to buffer to fill.
+ * \return number of characters read, or negative value if failure.
+ */
+static ssize_t waitqueue_read_iter(struct kiocb* iocb, struct iov_iter* to)
+{
+    int err = 0;
+    ssize_t len_msg = 0;
+    unsigned long mask = 0;
+    struct ring_record* record = NULL;
+    bool freed = false;
+    bool more = false;
+    size_t len = iov_iter_count(to);
+
+    printk(KERN_INFO "%s: wants to read %zu bytes from offset %lld\n",
+            THIS_MODULE->name, len, iocb->ki_pos);
+
+    if(broadcast)
     {
-        len_msg = len;
+        return waitqueue_read_broadcast(iocb, to);
     }
-    else if(len_msg < 0)
+
+    spin_lock_irqsave(&spinlock_wq, mask);
+
+    while((record = ring_claim(&g_ring)) == NULL)
     {
+        /* ring empty, wait for item */
         spin_unlock_irqrestore(&spinlock_wq, mask);
-        return -EINVAL;
+
+        /* returns now if nonblock is requested */
+        if(waitqueue_nowait(iocb))
+        {
+            return -EAGAIN;
+        }
+
+        if(wait_event_interruptible_exclusive(g_read_wq,
+                    ring_readable(&g_ring)) != 0)
+        {
+            /* do not swallow a wake-up meant for another reader */
+            if(ring_readable(&g_ring))
+            {
+                waitqueue_wake(&g_read_wq);
+            }
+            return -ERESTARTSYS;
+        }
+
+        spin_lock_irqsave(&spinlock_wq, mask);
     }
 
-    err = copy_to_user(u_buffer, g_messages[0], len_msg);
+    more = g_ring.claim != g_ring.tail;
+    spin_unlock_irqrestore(&spinlock_wq, mask);
 
-    /* shift other messages */
-    if(g_messages_count > 1)
+    if(more)
     {
-        memmove(g_messages, g_messages + 1, (g_messages_count - 1) * 1024);
+        /* pass the wake-up on to another reader */
+        waitqueue_wake(&g_read_wq);
     }
-    g_messages_count--;
 
+    /* record is ours until released, copy may fault so do it unlocked */
+    len_msg = min_t(size_t, record->len, len);
+
+    if(len_msg > 0)
+    {
+        err = copy_to_iter(record + 1, len_msg, to) != len_msg;
+    }
+
+    spin_lock_irqsave(&spinlock_wq, mask);
+    freed = ring_release(&g_ring, record);
     spin_unlock_irqrestore(&spinlock_wq, mask);
 
-    /* array has at least one space left */
-    wake_up_interruptible(&wq);
+    if(freed)
+    {
+        /* ring has at least one space left */
+        waitqueue_wake(&g_write_wq);
+    }
 
-    if(err == 0)
+    if(len_msg == 0)
+    {
+        /* EOF */
+        return 0;
+    }
+    else if(err == 0)
     {
         /* success */
         printk(KERN_DEBUG "%s: sent %zu characters to user\n", THIS_MODULE->name,
                 len_msg);
 
-        /* *offset += len_msg; */
+        /* iocb->ki_pos += len_msg; */
         return len_msg;
     }
     else
@@ -198,68 +823,149 @@ static ssize_t waitqueue_read(struct file* filep, char* u_buffer, size_t len,
 
 /**
  * \brief Write callback for character device.
- * \param filep file.
- * \param u_buffer buffer that contains data to write.
- * \param len length to write.
- * \param offset offset of the buffer.
+ * \param iocb I/O control block.
+ * \param from buffer that contains data to write.
  * \return number of characters written, or negative value if failure.
  */
-static ssize_t waitqueue_write(struct file* filep, const char* u_buffer,
-        size_t len, loff_t* offset)
+static ssize_t waitqueue_write_iter(struct kiocb* iocb,
+        struct iov_iter* from)
 {
-    ssize_t len_msg = len + *offset;
+    int err = 0;
     unsigned long mask = 0;
+    struct ring_record* record = NULL;
+    bool published = false;
+    bool more = false;
+    size_t len = iov_iter_count(from);
 
     printk(KERN_INFO "%s: wants to write %zu bytes from %lld offset\n",
-            THIS_MODULE->name, len, *offset);
+            THIS_MODULE->name, len, iocb->ki_pos);
 
     spin_lock_irqsave(&spinlock_wq, mask);
 
-    while(g_messages_count >= MSG_ARRAY_SIZE)
+    while(!ring_fits(&g_ring, len))
     {
-        /* array full, wait for empty space */
+        if(broadcast && overrun)
+        {
+            /* slow readers lose their oldest messages */
+            waitqueue_drop(len);
+            if(ring_fits(&g_ring, len))
+            {
+                break;
+            }
+        }
+
+        /* ring full, wait for empty space */
         spin_unlock_irqrestore(&spinlock_wq, mask);
 
-        if(nonblock && filep->f_flags & O_NONBLOCK)
+        if(len > READ_ONCE(g_ring.max_len))
+        {
+            return -E2BIG;
+        }
+
+        if(waitqueue_nowait(iocb))
         {
             return -EAGAIN;
         }
 
-        if(wait_event_interruptible(wq,
-                    (g_messages_count < MSG_ARRAY_SIZE)) != 0)
+        if(wait_event_interruptible_exclusive(g_write_wq,
+                    ring_fits(&g_ring, len) ||
+                    len > READ_ONCE(g_ring.max_len)) != 0)
         {
+            /* do not swallow a wake-up meant for another writer */
+            waitqueue_wake(&g_write_wq);
             return -ERESTARTSYS;
         }
 
         spin_lock_irqsave(&spinlock_wq, mask);
     }
 
-    if(len_msg > (1024 - 1))
+    record = ring_reserve(&g_ring, len);
+    more = ring_fits(&g_ring, 0);
+
+    spin_unlock_irqrestore(&spinlock_wq, mask);
+
+    if(more)
     {
-        spin_unlock_irqrestore(&spinlock_wq, mask);
-        return -E2BIG;
+        /* pass the wake-up on to another writer */
+        waitqueue_wake(&g_write_wq);
     }
 
-    if(copy_from_user(g_messages[g_messages_count], u_buffer, len) != 0)
+    /* space is ours until committed, copy may fault so do it unlocked */
+    err = copy_from_iter(record + 1, len, from) != len;
+
+    spin_lock_irqsave(&spinlock_wq, mask);
+    /* a failed copy is committed as a pad that readers skip */
+    published = ring_commit(&g_ring, record, err == 0);
+    if(broadcast && list_empty(&g_readers))
     {
-        spin_unlock_irqrestore(&spinlock_wq, mask);
-        return -EFAULT;
+        /* nobody subscribed, message is dropped right away */
+        g_ring.head = g_ring.tail;
+        g_ring.claim = g_ring.tail;
     }
-
-    g_messages[g_messages_count][len] = 0x00;
-    g_messages_count++;
-    
     spin_unlock_irqrestore(&spinlock_wq, mask);
- 
-    /* array has at least one item left */
-    wake_up_interruptible(&wq);
 
-    *offset += len;
+    if(published)
+    {
+        /* ring has at least one item left */
+        waitqueue_wake(&g_read_wq);
+    }
+
+    if(err != 0)
+    {
+        return -EFAULT;
+    }
+
+    iocb->ki_pos += len;
     printk(KERN_INFO "%s: received %zu characters from user\n",
             THIS_MODULE->name, len);
     return len;
 }
 
+/**
+ * \brief Ioctl callback for character device.
+ * \param filep file.
+ * \param cmd ioctl command.
+ * \param arg argument.
+ * \return 0 if success, negative value otherwise.
+ */
+static long waitqueue_ioctl(struct file* filep, unsigned int cmd,
+        unsigned long arg)
+{
+    struct waitqueue_config config;
+
+    if(_IOC_TYPE(cmd) != WAITQUEUE_IOCTL_MAGIC)
+    {
+        return -ENOTTY;
+    }
+
+    switch(_IOC_NR(cmd))
+    {
+    case WAITQUEUE_GET_CONFIG:
+        memset(&config, 0x00, sizeof(config));
+        config.ring_size = READ_ONCE(g_ring.size);
+        config.msg_size = READ_ONCE(g_ring.max_len);
+        if(copy_to_user((void*)arg, &config, sizeof(config)) != 0)
+        {
+            return -EFAULT;
+        }
+        break;
+    case WAITQUEUE_SET_CONFIG:
+        if(copy_from_user(&config, (void*)arg, sizeof(config)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        if(config.reserved != 0)
+        {
+            return -EINVAL;
+        }
+        return waitqueue_configure(config.ring_size, config.msg_size);
+    default:
+        return -ENOTTY;
+    }
+    return 0;
+}
+
 /**
  * \brief Module initialization.
  *
@@ -272,15 +978,25 @@ static int __init waitqueue_init(void)
 
     printk(KERN_INFO "%s: initialization\n", THIS_MODULE->name);
 
+    spin_lock_init(&spinlock_wq);
+
+    ret = waitqueue_configure(ring_size, msg_size);
+    if(ret != 0)
+    {
+        return ret;
+    }
+
     /* register device */
     ret = misc_register(&waitqueue_misc);
 
     if(ret == 0)
-    { 
+    {
         printk(KERN_INFO "%s: device created correctly\n", THIS_MODULE->name);
     }
-
-    spin_lock_init(&spinlock_wq); 
+    else
+    {
+        vfree(g_ring.buffer);
+    }
 
     return ret;
 }
@@ -293,6 +1009,7 @@ static int __init waitqueue_init(void)
 static void __exit waitqueue_exit(void)
 {
     misc_deregister(&waitqueue_misc);
+    vfree(g_ring.buffer);
     printk(KERN_INFO "%s: exit\n", THIS_MODULE->name);
 }
 
@@ -300,8 +1017,15 @@ static void __exit waitqueue_exit(void)
 module_init(waitqueue_init);
 module_exit(waitqueue_exit);
 
-module_param(nonblock, bool, (S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR));
-MODULE_PARM_DESC(nonblock, "Authorize non-blocking read() if file requests it");
+module_param(broadcast, bool, S_IRUGO);
+MODULE_PARM_DESC(broadcast, "Every reader gets every message");
+module_param(overrun, bool, S_IRUGO);
+MODULE_PARM_DESC(overrun,
+        "Broadcast mode drops messages of slow readers instead of blocking");
+module_param(ring_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(ring_size, "Capacity in bytes of the message queue");
+module_param(msg_size, uint, S_IRUGO);
+MODULE_PARM_DESC(msg_size, "Maximum size in bytes of a message");
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Sebastien Vincent");
@@ -0,0 +1,48 @@
+/*
+ * waitqueue - waitqueue device kernel module.
+ * Copyright (c) 2017, Sebastien Vincent
+ *
+ * Distributed under the terms of the BSD 3-clause License.
+ * See the LICENSE file for details.
+ */
+
+/**
+ * \file waitqueue.h
+ * \brief Ioctl definitions of waitqueue.
+ * \author Sebastien Vincent
+ * \date 2017
+ */
+
+#ifndef WAITQUEUE_H
+#define WAITQUEUE_H
+
+#ifdef __linux__
+#include <asm/ioctl.h>
+#else
+#error "Not supported OS."
+#endif
+
+#define WAITQUEUE_IOCTL_MAGIC 'w'
+
+#define WAITQUEUE_GET_CONFIG 1
+#define WAITQUEUE_SET_CONFIG 2
+
+/* capacity of the queue and maximum size of a message */
+#define WAITQUEUE_IOCGCONFIG _IOR(WAITQUEUE_IOCTL_MAGIC, WAITQUEUE_GET_CONFIG, \
+        struct waitqueue_config)
+/* resize the queue, it must be empty (0 keeps the current value) */
+#define WAITQUEUE_IOCSCONFIG _IOW(WAITQUEUE_IOCTL_MAGIC, WAITQUEUE_SET_CONFIG, \
+        struct waitqueue_config)
+
+/**
+ * \struct waitqueue_config
+ * \brief Queue configuration.
+ */
+struct waitqueue_config
+{
+    uint64_t ring_size; /**< Capacity in bytes (rounded to a power of two). */
+    uint32_t msg_size; /**< Maximum size of a message. */
+    uint32_t reserved; /**< Must be 0. */
+};
+
+#endif /* WAITQUEUE_H */